@@ -14,6 +14,7 @@
 #include <deque>
 #include <cassert>
 #include "../../include/networking/message.h"
+#include "../../include/networking/message_schema.h"
 #include "../../include/constants.h"
 // #include "AsyncSyncronization.h"
 #include "TaskSafeQueue.h"
@@ -12,9 +12,7 @@ TCPServer::TCPServer(uint16_t port) : m_server(port) {
 void TCPServer::onConnect(void *arg, AsyncClient *client) {
     std::cout << "New client connected from " << client->remoteIP().toString().c_str() << '\n';
     // Dummy handshake
-    Message msg;
-    msg.header.id = fortress::net::MsgTypes::ServerAccept;
-    sendMessage(msg, client);
+    sendMessage(fortress::net::makeMessage<fortress::net::ServerAccept>({ 0 }), client);
 }
 
 void TCPServer::begin() { m_server.begin(); }
@@ -42,6 +40,11 @@ void TCPServer::readHeader(uint8_t *data) {
 void TCPServer::readBody(uint8_t *data) { std::memcpy(m_tempInMessage.body.data(), data, m_tempInMessage.size()); }
 
 void TCPServer::onMessage(Message &msg, AsyncClient *client) {
+    if (!fortress::net::isValidBody(msg.header.id, msg.header.size)) {
+        std::cout << "Message with header " << msg.header << " discarded\n";
+        return;
+    }
+
     // Make an action according to the Header ID
     if (msg.header.id == fortress::net::MsgTypes::ServerPing) sendMessage(msg, client);
     if (m_onMessageCallback) m_onMessageCallback(msg, client);
@@ -85,7 +88,7 @@ void TCPServer::writeHeader(AsyncClient *client) {
     // Check if msg header is valid
     assert(msg->header.id >= 0 && msg->header.id <= fortress::net::MsgTypes::MessageAll);
     // Check if body size is reasonable
-    assert(msg->header.size < 128);
+    assert(msg->header.size <= fortress::net::maxBodySize(msg->header.id));
     // Check if body size matches the actual buffer length
     if (msg->header.size != msg->body.size()) { std::cout << msg << '\n'; }
     assert(msg->header.size == msg->body.size());
@@ -124,7 +127,7 @@ void TCPServer::writeBody(AsyncClient *client) {
     // Check if msg header is valid
     assert(msg->header.id >= 0 && msg->header.id <= fortress::net::MsgTypes::MessageAll);
     // Check if body size is reasonable
-    assert(msg->header.size < 128);
+    assert(msg->header.size <= fortress::net::maxBodySize(msg->header.id));
     // Check if body size matches the actual buffer length
     if (msg->header.size != msg->body.size()) { std::cout << msg << '\n'; }
     assert(msg->header.size == msg->body.size());
@@ -149,7 +152,7 @@ void TCPServer::sendMessage(const Message &msg, AsyncClient *client) {
      // Check if msg header is valid
     assert(msg.header.id >= 0 && msg.header.id <= fortress::net::MsgTypes::MessageAll);
     // Check if body size is reasonable
-    assert(msg.header.size < 128);
+    assert(msg.header.size <= fortress::net::maxBodySize(msg.header.id));
     // Check if body size match the actual buffer length
     assert(msg.header.size == msg.body.size());
     
@@ -7,6 +7,8 @@
 
 #include "../../include/SharedParams.h"
 #include "../../include/networking/message.h"
+#include "../../include/networking/readings_batch.h"
+#include "../../include/networking/sequenced_readings.h"
 #include "ACF2101.h"
 #include "ADS8332.h"
 #include "MCP4726.h"
@@ -63,6 +65,20 @@ unsigned long prevInfoMicros = 0;
 long displayInfoInterval = 5 * 1E6;
 unsigned long totalReadings;
 
+// Samples are sent in ServerReadingsBatch frames, flushed every MAX_SAMPLES_PER_BATCH samples or
+// DEFAULT_BATCH_SPAN_MICROS, whichever comes first
+fortress::net::readings_batch readingsBatch;
+
+// Once a client asks with ClientResumeSession, its readings frames are numbered as ServerSequencedReadings so that it
+// can tell lost frames from a stall; older clients keep getting plain frames. Nothing is kept to be sent again: a new
+// epoch at every boot tells the client that frames sent before a reset are gone.
+AsyncClient *sequencedClient = nullptr;
+uint32_t readingsSequence = 0;
+uint32_t bootEpoch = 0;
+
+// The client that told with ClientSetReadingsCodecs it can decode ServerReadingsPacked
+AsyncClient *packingClient = nullptr;
+
 //------------hardware functions-----------------
 void bipSpeaker(int bipNum) {
     for (int i = 0; i <= bipNum; i++) {
@@ -136,14 +152,39 @@ void printFreeMemory() {
     Serial.println(ESP.getFreeHeap());
 }
 
+void sendReadings(const Message &msg) {
+    if (tcp_client == sequencedClient)
+        tcp_server.sendMessage(fortress::net::makeSequencedReadings(readingsSequence++, msg), tcp_client);
+    else
+        tcp_server.sendMessage(msg, tcp_client);
+}
+
+void resumeSession(Message &msg, AsyncClient *client) {
+    auto request = fortress::net::decodePayload<fortress::net::ClientResumeSession>(msg);
+    if (request.epoch == bootEpoch && request.sequence != readingsSequence)
+        std::cout << "Client missed " << readingsSequence - request.sequence << " frames" << std::endl;
+
+    sequencedClient = client;
+    tcp_server.sendMessage(
+        fortress::net::makeMessage<fortress::net::ServerResumeSession>({bootEpoch, readingsSequence}), client);
+}
+
+void setReadingsCodecs(Message &msg, AsyncClient *client) {
+    auto request = fortress::net::decodePayload<fortress::net::ClientSetReadingsCodecs>(msg);
+    if (request.codecs & fortress::net::codecMask(fortress::net::readings_codec::delta_packed))
+        packingClient = client;
+    else if (packingClient == client)
+        packingClient = nullptr;
+}
+
 void startUpdating(Message &msg, AsyncClient *client) {
     if (isUpdating) {
         std::cerr << "Already sending reading" << std::endl;
         return;
     }
 
-    uint16_t frequency;
-    msg >> frequency;
+    auto request = fortress::net::decodePayload<fortress::net::ClientStartUpdating>(msg);
+    uint16_t frequency = request.frequency;
     samplingInterval = static_cast<long>(1.0 / frequency * 1'000'000);
 
     if (samplingInterval > 0) {
@@ -151,6 +192,10 @@ void startUpdating(Message &msg, AsyncClient *client) {
         isUpdating = true;
         totalReadings = 0;
         sensorReadings = {};
+        readingsBatch.clear();
+        // Pack the readings if the client can decode them: the Wi-Fi link is the bottleneck
+        readingsBatch.setCodec(client == packingClient ? fortress::net::readings_codec::delta_packed
+                                                       : fortress::net::readings_codec::raw);
         std::cout << "Start updating every " << samplingInterval << " us" << std::endl;
         previousMicros = micros();
         sessionStartTime = micros();
@@ -160,16 +205,17 @@ void startUpdating(Message &msg, AsyncClient *client) {
 
 void stopUpdating() {
     isUpdating = false;
-    Message msg;
-    msg.header.id = fortress::net::MsgTypes::ServerFinishedUpload;
-    tcp_server.sendMessage(msg, tcp_client);
+
+    // Send the last partial batch
+    if (!readingsBatch.empty()) sendReadings(readingsBatch.take());
+
+    tcp_server.sendMessage(fortress::net::makeMessage<fortress::net::ServerFinishedUpload>(), tcp_client);
     std::cout << "Stop updating. Sent " << totalReadings + 1 << " readings" << std::endl;
     chargeIntegrator.stop();
 }
 
 void setSensorHV(Message &msg) {
-    uint16_t sensorHVmV;
-    msg >> sensorHVmV;
+    uint16_t sensorHVmV = fortress::net::decodePayload<fortress::net::ClientSetSensorHV>(msg).millivolts;
     uint16_t sensorHV = static_cast<uint16_t>((static_cast<double>(sensorHVmV) * 4095) / (DACVref * DAC_OPAMP_GAIN));
     HVDAC.setOutputValue(sensorHV);
     std::cout << "Sensor HV received: " << sensorHVmV << "millivolts" << std::endl;
@@ -192,12 +238,23 @@ void onMessage(Message &msg, AsyncClient *client) {
         case MsgTypes::ClientSetSensorHV:
             setSensorHV(msg);
             break;
+
+        case MsgTypes::ClientResumeSession:
+            resumeSession(msg, client);
+            break;
+
+        case MsgTypes::ClientSetReadingsCodecs:
+            setReadingsCodecs(msg, client);
+            break;
         default:
             break;
     }
 }
 
 void setup() {
+    // Never 0, which stands for no epoch
+    bootEpoch = esp_random() | 1;
+
     // pin led configuration
     pinMode(LED_BLUE, OUTPUT);
     pinMode(LED_GREEN, OUTPUT);
@@ -303,16 +360,11 @@ void loop() {
         // Because of async, can happen that currentMicros < previousMicros and since they are unsigned, the difference
         // can overflow
         if (isUpdating && currentMicros > previousMicros && currentMicros - previousMicros >= samplingInterval) {
-            Message msg;
-            msg.header.id = fortress::net::MsgTypes::ServerReadings;
-
 #ifdef EMULATE_SAMPLING
             // Dummy data for test
             for (auto it = sensorReadings.begin(); it != sensorReadings.end(); ++it) {
                 *it += static_cast<uint16_t>(random(-5, 25));
                 if (*it > SharedParams::integratorThreshold) *it -= SharedParams::integratorThreshold;
-                // Packet the sample
-                msg << *it;
             }
 #else
             /*
@@ -324,7 +376,6 @@ void loop() {
             for (int i = 0; i < SharedParams::n_channels; ++i) {
                 // Sample from ADC
                 uint8_t adcstat = ADC.getSample(&sensorReadings[i], i);
-                msg << sensorReadings[i];
                 //Serial.print(adcstat);
                 //Serial.print(" ");
             }
@@ -341,11 +392,12 @@ void loop() {
 
 #endif
 
-            // Insert ellapsed time between this frame and the previous one
-            msg << static_cast<uint32_t>(micros() - sessionStartTime);  // Delta time
+            // Pack the sample with the ellapsed time since the beginning of the session
+            auto timestamp = static_cast<uint32_t>(micros() - sessionStartTime);
+            readingsBatch.push(sensorReadings, timestamp);
 
-            // Send the readings
-            tcp_server.sendMessage(msg, tcp_client);
+            // Send the readings once the batch is full or old enough
+            if (readingsBatch.isReady(timestamp)) sendReadings(readingsBatch.take());
 
             previousMicros = currentMicros;
             ++totalReadings;
@@ -13,29 +13,46 @@
 #include <iostream>
 #include <QFile>
 #include <QDir>
+#include <QTimer>
 #include "networking/client_interface.h"
+#include "networking/pipeline_stage.h"
+#include "networking/readings_batch.h"
+#include "networking/sequenced_readings.h"
 #include "constants.h"
 #include "SharedParams.h"
 #include "ChartModel.h"
+#include "CurrentKernel.h"
 
 using namespace fortress::net;
 
+static_assert(SharedParams::n_channels == fortress::consts::N_CHANNELS,
+              "The readings frame layout must match the number of channels");
+
 class Backend : public QObject, public client_interface {
 Q_OBJECT
     Q_PROPERTY(bool bIsConnected READ isConnected NOTIFY connectionStatusChanged)
     Q_PROPERTY(double dPingValue READ getLastPingValue())
+    // Round trip percentiles in ms since the last resetPingStatistics(), infinity before the first ping
+    Q_PROPERTY(double dPingP50 READ getPingP50)
+    Q_PROPERTY(double dPingP90 READ getPingP90)
+    Q_PROPERTY(double dPingP99 READ getPingP99)
+    Q_PROPERTY(double dPingMax READ getPingMax)
     Q_PROPERTY(QString statusBarMessage READ getStatusBarMessage NOTIFY statusBarMessageArrived)
+    Q_PROPERTY(bool bUseDatagrams READ isUsingDatagrams WRITE setUseDatagrams)
+    Q_PROPERTY(bool bUseSharedMemory READ isUsingSharedMemory WRITE setUseSharedMemory)
 
 private:
     ChartModel *m_chartModel;
 
     double m_lastPingValue{ std::numeric_limits<double>::infinity() };
+    latency_histogram m_pingHistogram;
     bool m_bIsPinging{ false };
     static constexpr asio::chrono::milliseconds PING_DELAY{ 1000 };
 
     QString const m_filename = "fortress_out.csv";
     std::unique_ptr<QTemporaryFile> m_file;                                                  // Csv output file
     QTextStream m_textStream;                             // Csv stream to write on file
+    std::mutex m_muxRecording;                            // The record stage writes, the GUI thread opens and closes
 
     asio::io_context m_context{};
     std::unique_ptr<asio::steady_timer> m_pPingTimer;
@@ -45,22 +62,109 @@ private:
 
     unsigned long m_readingsReceived{ 0 };
     unsigned long m_bytesRead{ 0 };
-    unsigned long m_prevReadingTimestamp{ 0 };
     QString m_statusBarMessage{};
     bool m_askDisconnect = false;
 
+    // Ask the server to send the readings over UDP when starting a session. Set from QML, read on the context thread.
+    std::atomic<bool> m_bUseDatagrams{ false };
+    // Or through shared memory, if the server is on this host. Preferred to UDP when both are set.
+    std::atomic<bool> m_bUseSharedMemory{ false };
+
+    // Frames numbered by the server, over TCP or UDP. After a reconnection the server is asked for the frames
+    // following the last one received, as long as it is the same server process (same epoch). Gaps, duplicates and
+    // reordered frames are counted per session and marked in the recording.
+    sequence_tracker m_readingsSequence;
+    uint32_t m_nServerEpoch{ 0 };
+    message<MsgTypes> m_sequencedReadings;
+
+    // Samples more than LATE_SAMPLE_FACTOR sampling periods after the previous one: the device fell behind. The
+    // first sample after lost frames is not counted. Used by the convert stage.
+    unsigned long m_nLateSamples{ 0 };
+    bool m_bAfterGap{ false };
+    static constexpr double LATE_SAMPLE_FACTOR = 1.5;
+
+    // Reconnect with exponential backoff if the connection drops after the server accepted it. The timer lives on
+    // the GUI thread, the attempts are also counted and reset on the context thread.
+    QString m_host;
+    uint16_t m_port{ 0 };
+    QTimer m_reconnectTimer;
+    std::atomic<int> m_nReconnectAttempts{ 0 };
+    std::atomic<bool> m_bWasAccepted{ false };
+    std::atomic<uint16_t> m_nSessionFrequency{ 0 };  // Non zero while a session runs, to start it again if needed
+    static constexpr int MAX_RECONNECT_ATTEMPTS = 8;
+    static constexpr std::chrono::milliseconds RECONNECT_DELAY{ 500 };
+    static constexpr std::chrono::milliseconds MAX_RECONNECT_DELAY{ 16000 };
+
+    // The connection counters are shown in the status bar while a session runs
+    QTimer m_statsTimer;
+    std::optional<connection_stats> m_lastConnectionStats;
+    static constexpr std::chrono::milliseconds STATS_PERIOD{ 1000 };
+
+
+    // Store last readings and their time to compute current
+    fortress::integrator_state m_integrators;
+
+    static constexpr fortress::current_conversion CURRENT_CONVERSION{
+            SharedParams::kADCMaxVal, SharedParams::kADCVref, SharedParams::kAmplifierFeedback,
+            SharedParams::kIntegratorCapacitance, SharedParams::integratorThreshold };
+
+    // Samples of the last frame and their conversion, reused to avoid allocations
+    std::vector<readings_sample> m_vUnpackedSamples;
+    std::vector<CurrentReadings_t> m_vCurrents;
+    std::vector<uint32_t> m_vDeltaTimes;
+
+    // ---- Acquisition pipeline ----
+    // The asio thread only receives the frames. A stage decodes them and computes the currents, then one writes the
+    // recording and one feeds the chart, each on its own thread. The recording is lossless: a stage that falls
+    // behind holds back the previous one, down to the socket. The chart gets the frames the display stage has room
+    // for, the others are dropped.
+
+    // What the asio thread hands to the convert stage, in the order received
+    struct acquired_frame {
+        enum class kind : uint8_t {
+            readings,
+            note,           // A line for the recording
+            gap,            // A line for the recording, samples are missing after it
+            session_start,
+            session_end
+        };
+
+        kind type{ kind::readings };
+        message<MsgTypes> msg;
+        std::string note;
+    };
 
-    // Store last current values to compute current
-    ADCReadings_t m_ADCReadings{};
+    struct converted_sample {
+        uint32_t time;
+        uint32_t deltaTime;
+        ADCReadings_t adcReadings;
+        CurrentReadings_t currentReadings;
+    };
 
+    // The samples of a frame, shared by the record and the display stages
+    using converted_samples = std::shared_ptr<const std::vector<converted_sample>>;
 
-    static inline auto computeCurrentFromADC = [](int current, int prev, uint32_t delta_t) {
-        return -static_cast<double>(current - prev) / static_cast<double>(SharedParams::kADCMaxVal) *
-               SharedParams::kADCVref *
-               SharedParams::kAmplifierFeedback *
-               SharedParams::kIntegratorCapacitance / static_cast<double>(delta_t / 1e6);
+    struct converted_frame {
+        converted_samples samples;
+        std::string note;
     };
 
+    static constexpr size_t CONVERT_QUEUE_CAPACITY = 1024;
+    static constexpr size_t RECORD_QUEUE_CAPACITY = 1024;
+    static constexpr size_t DISPLAY_QUEUE_CAPACITY = 64;
+
+    // Declared last: destroyed, and joined, before the members they use
+    pipeline_stage<acquired_frame> m_convertStage{ "CONVERT", CONVERT_QUEUE_CAPACITY,
+                                                   [this](acquired_frame &frame) { onFrameAcquired(frame); }};
+    pipeline_stage<converted_frame> m_recordStage{ "RECORD", RECORD_QUEUE_CAPACITY,
+                                                   [this](converted_frame &frame) { onFrameConverted(frame); }};
+    pipeline_stage<converted_samples> m_displayStage{ "DISPLAY", DISPLAY_QUEUE_CAPACITY,
+                                                      [this](converted_samples &samples) { displaySamples(samples); }};
+
+
+    // Drives the readings path without a connection, see test/hot_path_benchmark.cpp
+    friend class BackendBenchmark;
+
 public:
     // Avoid name collision with multiple inheritance
     using client_interface::connect;
@@ -77,6 +181,8 @@ public:
 
     Q_INVOKABLE void togglePingUpdate();
 
+    Q_INVOKABLE void resetPingStatistics();
+
     Q_INVOKABLE void sendStartUpdateCommand(uint16_t frequency);
 
     Q_INVOKABLE void sendStopUpdateCommand();
@@ -91,16 +197,70 @@ public:
 
     [[nodiscard]] double getLastPingValue() const;
 
+    [[nodiscard]] double getPingP50() const;
+
+    [[nodiscard]] double getPingP90() const;
+
+    [[nodiscard]] double getPingP99() const;
+
+    [[nodiscard]] double getPingMax() const;
+
     [[nodiscard]] QString getStatusBarMessage() const;
 
+    [[nodiscard]] bool isUsingDatagrams() const;
+
+    void setUseDatagrams(bool bUseDatagrams);
+
+    [[nodiscard]] bool isUsingSharedMemory() const;
+
+    void setUseSharedMemory(bool bUseSharedMemory);
+
 
 private:
+    // Resuming keeps the epoch and the sequence of the frames received so far
+    void openConnection(bool bResume);
+
+    void scheduleReconnect();
+
+    void onResumeSession(const resume_payload &resume);
+
+    // Account for a sequenced frame and mark gaps, duplicates and reordering in the recording. True if the frame
+    // must be delivered.
+    bool acceptFrame(uint32_t sequence);
+
+    // Hand a frame, a line for the recording or a session boundary to the convert stage. From the asio thread only.
+    void acquire(acquired_frame::kind type, message<MsgTypes> msg = {}, std::string note = {});
+
+    void onFrameAcquired(acquired_frame &frame);
+
+    void onFrameConverted(converted_frame &frame);
+
+    void displaySamples(const converted_samples &samples);
+
     void pingHandler();
 
+    [[nodiscard]] double getPingPercentile(double q) const;
+
+    // Decode and convert a readings frame, on the convert stage
     void onReadingsReceived(message<MsgTypes> &msg);
 
+    // Compute the currents of the samples of a frame in one pass, and count the late ones
+    void convertSamples(const std::vector<readings_sample> &samples, std::vector<converted_sample> &converted);
+
+    // Append a csv row, on the record stage
+    void writeSample(const converted_sample &sample);
+
     void onServerFinishedUpload();
 
+    void showConnectionStats();
+
+    // Queue depth of the stages of the pipeline
+    [[nodiscard]] std::string pipelineReport() const;
+
+    // Ask the server for readings through shared memory, over UDP or back over TCP, as set by bUseSharedMemory and
+    // bUseDatagrams. Only called on the context thread, so that opening and closing the channels never interleave.
+    void updateReadingsChannels();
+
     void openFile(uint16_t frequency);
 
     void closeFile();
@@ -112,6 +272,9 @@ signals:
 
     void connectionLost();
 
+    // The connection dropped, a new one is attempted after delay ms. connectionLost follows the last attempt.
+    void reconnecting(int attempt, int delay);
+
     void statusBarMessageArrived(QString message);
 
     void connectionFailed(QString error_message);
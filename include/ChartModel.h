@@ -12,44 +12,63 @@
 #include <QtCore/QtMath>
 
 #include "SharedParams.h"
+#include "networking/triple_buffer.h"
 
+// The readings are inserted by the display stage of Backend and read by the QML timers on the GUI thread. The
+// inserting side works on its own copy of the data and publishes it once per frame through a triple buffer: the GUI
+// always reads a whole frame, and neither side waits for the other.
 class ChartModel : public QObject {
 Q_OBJECT
     Q_PROPERTY(int plotWindowSize READ plotWindowSize() CONSTANT)
     Q_PROPERTY(int showADCValues READ showADCValues() WRITE showADCValues())
 
 private:
-    // The current index on the X axis
-    int m_dataXIndex{ 0 };
-    // The total time ticks (number of readings received);
-    int m_t{ 0 };
-    // Store the entire data as (n_channels x plotWindowSize)
-    QList<QList<QPointF>> m_chartData;
-    // Store the entire data as (n_channels x plotWindowSize)
-    QList<QList<QPointF>> m_chartCurrentData;
-
-    // Last n_channels points received to display as gauge
-    ADCReadings_t m_chLastValues{};
-    CurrentReadings_t m_chLastCurrentValues{};
-    // The current n_channels min/max values to auto rescale Y axis
-    ADCReadings_t m_chMinValues{};
-    CurrentReadings_t m_chMinCurrentValues{};
-    ADCReadings_t m_chMaxValues{};
-    CurrentReadings_t m_chMaxCurrentValues{};
-    // The n_channels total cumulative sum to display as gauge
-    ADCReadings_t m_chTotalSums{};
-    CurrentReadings_t m_chTotalCurrentSums{};
+    using PlotWindow_t = std::array<double, SharedParams::plotWindowSizeInPoint>;
+
+    struct chart_snapshot {
+        // The total time ticks (number of readings received)
+        int t{ 0 };
+        // The current index on the X axis
+        int dataXIndex{ 0 };
+        // Store the entire data as (n_channels x plotWindowSize)
+        std::array<PlotWindow_t, SharedParams::n_channels> chartData{};
+        std::array<PlotWindow_t, SharedParams::n_channels> chartCurrentData{};
+
+        // Last n_channels points received to display as gauge
+        ADCReadings_t chLastValues{};
+        CurrentReadings_t chLastCurrentValues{};
+        // The current n_channels min/max values to auto rescale Y axis, updated when published
+        ADCReadings_t chMinValues{};
+        CurrentReadings_t chMinCurrentValues{};
+        ADCReadings_t chMaxValues{};
+        CurrentReadings_t chMaxCurrentValues{};
+        // The n_channels total cumulative sum to display as gauge
+        ADCReadings_t chTotalSums{};
+        CurrentReadings_t chTotalCurrentSums{};
+
+        // Number of clearData() calls before the data started
+        uint32_t nClears{ 0 };
+    };
+
+    // Inserting side only
+    chart_snapshot m_data;
+
+    // The GUI reads the front snapshot: updated, and reset by clearData(), on the GUI thread only
+    mutable fortress::net::triple_buffer<chart_snapshot> m_snapshots;
+    // Counts the clearData() calls, for the inserting side to drop its data and the GUI to ignore the snapshots
+    // published before it noticed
+    std::atomic<uint32_t> m_nClears{ 0 };
 
     bool m_showADCValues = false;
 
-private:
-    static inline auto compareFunction = [](const QPointF &p1, const QPointF &p2) { return p1.y() < p2.y(); };
-
 public:
     explicit ChartModel(QObject *parent = nullptr);
 
     void insertReadings(const ADCReadings_t &rawReadings, const CurrentReadings_t &currentReadings);
 
+    // Make the readings inserted so far visible to the GUI. Called by the inserting side after each frame.
+    void publishSnapshot();
+
     Q_INVOKABLE void clearData();
 
     Q_INVOKABLE void
@@ -77,8 +96,15 @@ public slots:
     [[nodiscard]] double getChannelTotalSum(uint8_t channel) const;
 
 private:
+    // Drop the data of the inserting side if clearData() has been called since
+    void applyClear();
+
+    // The latest snapshot published, on the GUI thread
+    [[nodiscard]] const chart_snapshot &snapshot() const;
 
-    void generatePlotSeries(int n_channels, int length);
+    // The points of [begin, end) of a plot window
+    [[nodiscard]] static QList<QPointF> makePoints(const chart_snapshot &data, const PlotWindow_t &window, int begin,
+                                                   int end);
 
 };
 
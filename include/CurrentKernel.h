@@ -0,0 +1,66 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_CURRENT_KERNEL_H
+#define FORTRESS_CURRENT_KERNEL_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include "constants.h"
+#include "networking/message_schema.h"
+
+namespace fortress {
+
+    using ChannelReadings_t = std::array<int, consts::N_CHANNELS>;
+    using ChannelCurrents_t = std::array<double, consts::N_CHANNELS>;
+
+    // Circuit parameters of the conversion from ADC readings to currents
+    struct current_conversion {
+        double adcMaxValue;
+        double adcVref;                 // V
+        double amplifierFeedback;       // ohm/ohm
+        double integratorCapacitance;   // pF
+        int integratorThreshold;        // The integrator is reset when it crosses it
+    };
+
+    // The readings and the time of the last sample converted
+    struct integrator_state {
+        ChannelReadings_t readings{};
+        uint32_t time{ 0 };
+    };
+
+    // Implementations of convertCurrents. All of them give bit-identical results: the same operations on doubles, in
+    // the same order, only on more channels at once.
+    enum class current_kernel {
+        scalar,
+        sse2,
+        avx2
+    };
+
+    // The current of each channel is the charge its integrator gained since the previous sample, over the time
+    // elapsed. A reading that drops by more than 90 % of the threshold means that the integrator has been reset in
+    // between. Converts count samples in one pass, writing the currents and the time since the previous sample of
+    // each. state holds the sample before the first one, and is left with the last one.
+    void convertCurrents(const current_conversion &conversion, const net::readings_sample *samples, size_t count,
+                         integrator_state &state, ChannelCurrents_t *currents, uint32_t *deltaTimes);
+
+    // With a given kernel, which must be available
+    void convertCurrents(current_kernel kernel, const current_conversion &conversion,
+                         const net::readings_sample *samples, size_t count, integrator_state &state,
+                         ChannelCurrents_t *currents, uint32_t *deltaTimes);
+
+    // The fastest kernel this CPU supports, picked once at the first call
+    current_kernel selectedCurrentKernel();
+
+    std::vector<current_kernel> availableCurrentKernels();
+
+    const char *toString(current_kernel kernel);
+}
+
+#endif //FORTRESS_CURRENT_KERNEL_H
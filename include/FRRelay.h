@@ -0,0 +1,127 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_FR_RELAY_H
+#define FORTRESS_FR_RELAY_H
+
+#include <iostream>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <unordered_set>
+#include "networking/server_interface.h"
+#include "networking/client_interface.h"
+#include "networking/readings_codec.h"
+#include "constants.h"
+
+using namespace fortress::net;
+using FRClient = std::shared_ptr<tcp_connection>;
+
+// Stands between one device and many viewers. The ESP32 firmware serves a single client: the relay is that client,
+// and serves any number of desktop apps in its place.
+//
+// Each readings frame of the device is encoded once and the same buffer is queued on every viewer. The queues are
+// bounded by the overflow policy, so a slow viewer loses frames without holding back the others or the device.
+//
+// The first viewer to connect owns the device: only its control commands are forwarded, those of the others are
+// answered with a ServerMessage. When the owner leaves, the oldest viewer left takes over. Readings always go over
+// TCP: requests for sequenced frames, UDP or shared memory are ignored, as an older server would.
+//
+// The relay asks the device for packed readings itself, whatever the owner can decode: the Wi-Fi link is the
+// bottleneck. Packed frames go as they are to the viewers that sent ClientSetReadingsCodecs for them, and are
+// unpacked once into a ServerReadingsBatch shared by all the others.
+class FRRelay : public server_interface {
+
+private:
+    class device_client : public client_interface {
+    private:
+        FRRelay &m_relay;
+
+    public:
+        device_client(asio::io_context &context, FRRelay &relay) : client_interface{ context }, m_relay{ relay } {}
+
+        void onServerDisconnected() override {
+            m_relay.onDeviceDisconnected();
+        }
+
+    protected:
+        void onMessage(message<MsgTypes> &msg) override {
+            m_relay.onDeviceMessage(msg);
+        }
+    };
+
+    std::string m_deviceHost;
+    uint16_t m_nDevicePort;
+    device_client m_device;
+
+    // The viewers, the device connection and the session state are only accessed from this strand, while the
+    // device and each viewer are served by their own
+    asio::strand<asio::io_context::executor_type> m_strand;
+    std::unique_ptr<asio::steady_timer> m_pReconnectTimer;
+    bool m_bDeviceAccepted = false;
+
+    std::deque<FRClient> m_viewers;     // In order of arrival, the first one owns the device
+    // Start command of the running session, sent again if the device reconnects
+    std::optional<message<MsgTypes>> m_sessionStart;
+
+    // Frames relayed since the device connected, counted on the device strand
+    std::atomic<uint64_t> m_nFramesRelayed{ 0 };
+
+    // By viewer id. Read on the device strand for every frame, so not on m_strand.
+    std::unordered_set<uint32_t> m_packingViewers;
+    std::mutex m_muxPackingViewers;
+
+    static constexpr asio::chrono::seconds RECONNECT_PERIOD{ 2 };
+
+    // Applied to every new viewer. Blocking is not allowed: it would stall the device connection for everyone.
+    tcp_connection::overflow_policy m_overflowPolicy = tcp_connection::overflow_policy::drop_oldest;
+    size_t m_nHighWaterMark = tcp_connection::DEFAULT_HIGH_WATER_MARK;
+
+public:
+    FRRelay(asio::io_context &io_context, uint16_t port, std::string deviceHost, uint16_t devicePort);
+
+    // Start accepting viewers and connecting to the device, retrying while it cannot be reached
+    bool start();
+
+    // Overflow policy and high-water mark of the outbound queue of the viewers connecting from now on. Throws
+    // std::invalid_argument for the block policy.
+    void setOverflowPolicy(tcp_connection::overflow_policy policy,
+                           size_t highWaterMark = tcp_connection::DEFAULT_HIGH_WATER_MARK);
+
+protected:
+    bool onClientConnect(std::shared_ptr<tcp_connection> client) override;
+
+    void onClientDisconnect(std::shared_ptr<tcp_connection> client) override;
+
+    void onMessage(std::shared_ptr<tcp_connection> client, message<MsgTypes> &msg) override;
+
+private:
+    // ---- Device side ----
+
+    void onDeviceMessage(message<MsgTypes> &msg);
+
+    // Send a readings frame to every viewer in a codec it can decode
+    void relayReadings(const message<MsgTypes> &msg);
+
+    [[nodiscard]] bool isPackingViewer(uint32_t id);
+
+    void onDeviceDisconnected();
+
+    void connectToDevice();
+
+    // ---- Viewer side ----
+
+    // Forward a control command upstream if the client owns the device
+    void forwardCommand(const std::shared_ptr<tcp_connection> &client, const message<MsgTypes> &msg);
+
+    void sendText(const std::shared_ptr<tcp_connection> &client, const std::string &text);
+
+    void sendTextToAll(const std::string &text);
+};
+
+#endif //FORTRESS_FR_RELAY_H
@@ -12,7 +12,14 @@
 #include <iostream>
 #include <thread>
 #include <utility>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
 #include "networking/server_interface.h"
+#include "networking/readings_batch.h"
+#include "networking/datagram_channel.h"
+#include "networking/shm_channel.h"
+#include "networking/sequenced_readings.h"
 #include "constants.h"
 
 using namespace fortress::net;
@@ -24,21 +31,85 @@ private:
 
     // Emulate ADC readings to send repeatedly
     std::function<void(FRServer *)> m_updateCallback;
+
+    // Timers and the updating state are only accessed from this strand, while clients are served by other threads
+    asio::strand<asio::io_context::executor_type> m_strand;
     std::unique_ptr<asio::steady_timer> m_pPingTimer;
     std::unique_ptr<asio::steady_timer> m_pUpdateTimer;
 
+    // Readings go over UDP to the clients that opened a datagram channel, over TCP to the others
+    struct datagram_client {
+        asio::ip::udp::endpoint endpoint;
+        uint64_t nDatagrams;
+    };
+
+    bool m_bDatagramsEnabled = true;
+    datagram_sender m_datagramSender;
+    std::unordered_map<uint32_t, datagram_client> m_datagramClients;    // By client id
+
+    // Readings go through shared memory to the clients on this host that opened a ring. They take precedence over
+    // UDP, and get the same numbered frames as over TCP.
+    bool m_bSharedMemoryEnabled = true;
+    std::unordered_map<uint32_t, std::unique_ptr<shm_sender>> m_sharedMemoryClients;  // By client id
+
+    // Every readings frame gets a sequence number. The clients that sent ClientResumeSession get numbered frames
+    // and, after reconnecting, the frames they missed while they are still in the replay buffer. The epoch tells
+    // the sequence numbers of this run from those of an earlier one.
+    struct replay {
+        std::shared_ptr<tcp_connection> client;
+        uint32_t next;
+        uint32_t nReplayed;
+    };
+
+    const uint32_t m_nEpoch = std::random_device{}() | 1;
+    uint32_t m_nReadingsSequence = 0;
+    replay_buffer m_replayBuffer{ REPLAY_BUFFER_FRAMES };
+    std::unordered_set<uint32_t> m_sequencedClients;                    // By client id
+    std::unordered_map<uint32_t, replay> m_replays;                     // By client id, until caught up
+    std::unique_ptr<asio::steady_timer> m_pReplayTimer;
+    std::unique_ptr<asio::steady_timer> m_pResumeTimer;
+
+    // About a minute of frames at the default batching
+    static constexpr size_t REPLAY_BUFFER_FRAMES = 1024;
+    static constexpr asio::chrono::milliseconds REPLAY_PERIOD{ 10 };
+    // How long the session goes on without clients, waiting for one to resume
+    static constexpr asio::chrono::seconds RESUME_TIMEOUT{ 60 };
+
     bool m_bIsPinging = false;
     bool m_bIsUpdating = false;
 
     static constexpr asio::chrono::milliseconds PING_DELAY{ 1000 };
     asio::chrono::milliseconds m_nSamplingPeriodMilliseconds { 1000 };
 
+    // Counters of every connection printed periodically, with the rates since the previous print
+    std::unique_ptr<asio::steady_timer> m_pStatsTimer;
+    asio::chrono::seconds m_statsPeriod{ 0 };
+    std::unordered_map<uint32_t, connection_stats> m_lastStats;          // By client id
+
+    // Readings are packed into ServerReadingsBatch frames. With m_bBatchReadings false every sample is sent
+    // as a single ServerReadings message, as older desktop apps expect.
+    bool m_bBatchReadings = true;
+    readings_batch m_readingsBatch;
+    // Send batches as ServerReadingsPacked to the clients that can decode them, as told by ClientSetReadingsCodecs
+    bool m_bPackReadings = true;
+    std::unordered_set<uint32_t> m_packingClients;                      // By client id
+    std::chrono::time_point<std::chrono::steady_clock> m_startUpdateTime;
+
+    // Applied to every new client, so that a slow one cannot make the server memory grow without bound
+    tcp_connection::overflow_policy m_overflowPolicy = tcp_connection::overflow_policy::drop_oldest;
+    size_t m_nHighWaterMark = tcp_connection::DEFAULT_HIGH_WATER_MARK;
+
 public:
     explicit FRServer(asio::io_context &io_context, uint16_t port, std::function<void(FRServer *)> updateCallback) :
             server_interface(io_context, port),
             m_updateCallback{ std::move(updateCallback) },
-            m_pPingTimer{ std::make_unique<asio::steady_timer>(io_context) },
-            m_pUpdateTimer{std::make_unique<asio::steady_timer>(io_context) } {};
+            m_strand{ asio::make_strand(io_context) },
+            m_pPingTimer{ std::make_unique<asio::steady_timer>(m_strand) },
+            m_pUpdateTimer{std::make_unique<asio::steady_timer>(m_strand) },
+            m_datagramSender{ m_strand },
+            m_pReplayTimer{ std::make_unique<asio::steady_timer>(m_strand) },
+            m_pResumeTimer{ std::make_unique<asio::steady_timer>(m_strand) },
+            m_pStatsTimer{ std::make_unique<asio::steady_timer>(m_strand) } {};
 
 protected:
     bool onClientConnect(std::shared_ptr<tcp_connection> client) override;
@@ -52,6 +123,29 @@ public:
 
     void togglePingUpdate();
 
+    // Batch up to maxSamples samples per frame, or the samples collected in maxSpanMicros. Zero samples disables
+    // batching.
+    void setReadingsBatching(uint16_t maxSamples, uint32_t maxSpanMicros = DEFAULT_BATCH_SPAN_MICROS);
+
+    void setReadingsPacking(bool bPack);
+
+    // With datagrams disabled, ClientOpenDatagramChannel is ignored and all the readings go over TCP
+    void setDatagramsEnabled(bool bEnabled);
+
+    // With shared memory disabled, ClientOpenSharedMemoryChannel is ignored
+    void setSharedMemoryEnabled(bool bEnabled);
+
+    // Overflow policy and high-water mark of the outbound queue of the clients connecting from now on. Throws
+    // std::invalid_argument for the block policy.
+    void setOverflowPolicy(tcp_connection::overflow_policy policy,
+                           size_t highWaterMark = tcp_connection::DEFAULT_HIGH_WATER_MARK);
+
+    // Print the counters of the connections every period, while there are clients. Zero stops printing.
+    void printStatsEvery(asio::chrono::seconds period);
+
+    // Send a new sample to all clients. Called by the update callback.
+    void sendReadings(const RawReadings_t &readings);
+
 private:
 
     void pingAllHandler();
@@ -65,6 +159,35 @@ private:
     void startUpdating(message<MsgTypes> &msg);
 
     void stopUpdating();
+
+    void flushReadings();
+
+    // Send a readings message to every client, through shared memory, over UDP or TCP
+    void broadcastReadings(const message<MsgTypes> &msg);
+
+    // True if the readings of the client do not go over TCP
+    [[nodiscard]] bool hasReadingsChannel(uint32_t clientId) const;
+
+    void openDatagramChannel(const std::shared_ptr<tcp_connection> &client, uint16_t port);
+
+    void closeDatagramChannel(uint32_t clientId);
+
+    void openSharedMemoryChannel(const std::shared_ptr<tcp_connection> &client, const std::string &name);
+
+    void closeSharedMemoryChannel(uint32_t clientId);
+
+    // Numbered frames still queued on TCP would be overtaken by those of the new channel: keep sending over TCP
+    // until they are written, as at the end of a replay
+    void handOverReadings(const std::shared_ptr<tcp_connection> &client);
+
+    void resumeSession(const std::shared_ptr<tcp_connection> &client, const resume_payload &request);
+
+    // Send the frames to replay, no faster than the clients write them
+    void pumpReplays();
+
+    void waitForResume();
+
+    void printStats();
 };
 
 #endif //FORTRESS_FR_SERVER_H
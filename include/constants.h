@@ -9,10 +9,12 @@
 #ifndef FORTRESS_CONSTANTS_H
 #define FORTRESS_CONSTANTS_H
 
+#include <cstdint>
+
 namespace fortress {
     namespace consts {
         constexpr uint16_t WINDOW_SIZE_IN_POINT = 512;
-        constexpr uint8_t N_CHANNELS = 4;
+        constexpr uint8_t N_CHANNELS = 8;
     }
 
     namespace net {
@@ -34,8 +36,41 @@ namespace fortress {
             ClientSetSampleFrequency,
             ClientSetSensorHV,
 
+            // Messages added later are appended here to keep the ids above stable for older firmware
+            ServerReadingsBatch,
+            ServerReadingsPacked,
+            ClientOpenDatagramChannel,
+            ServerSequencedReadings,
+            ClientResumeSession,
+            ServerResumeSession,
+            ClientOpenSharedMemoryChannel,
+            ClientSetReadingsCodecs,
+
             MessageAll
         };
+
+        // Maximum body size of a text message, and the body size stored inside a message without heap allocations
+        constexpr uint32_t MAX_BODY_SIZE = 128;
+
+        // A single sample: one uint16_t reading per channel followed by the uint32_t timestamp in microseconds
+        constexpr uint32_t READINGS_SAMPLE_SIZE = consts::N_CHANNELS * sizeof(uint16_t) + sizeof(uint32_t);
+
+        // A ServerReadingsBatch body is a sequence of samples, flushed when one of the two limits is reached
+        constexpr uint16_t MAX_SAMPLES_PER_BATCH = 64;
+        constexpr uint32_t DEFAULT_BATCH_SPAN_MICROS = 50'000;
+        constexpr uint32_t MAX_BATCH_BODY_SIZE = MAX_SAMPLES_PER_BATCH * READINGS_SAMPLE_SIZE;
+
+        // A sequence number followed by the header of the readings message it numbers
+        constexpr uint32_t SEQUENCED_HEADER_SIZE = 3 * sizeof(uint32_t);
+
+        // Longest name of a shared memory channel, with the terminating null
+        constexpr uint32_t SHARED_MEMORY_NAME_SIZE = 32;
+
+        // Readings can be dropped or merged when a client falls behind, any other message is a control message
+        constexpr bool isReadings(uint32_t id) {
+            return id == ServerReadings || id == ServerReadingsBatch || id == ServerReadingsPacked ||
+                   id == ServerSequencedReadings;
+        }
     }
 }
 
@@ -6,14 +6,28 @@
 #define FORTRESS_CLIENT_INTERFACE_H
 
 #include "networking/tcp_connection.h"
+#include "networking/coro_connection.h"
+#include "networking/datagram_channel.h"
+#include "networking/shm_channel.h"
+#include "networking/io_backend.h"
 #include <functional>
+#include <optional>
 
 namespace fortress::net {
 
     class client_interface {
     private:
         asio::io_context &m_context;
-        std::unique_ptr<tcp_connection> m_connection;
+        // The connection and the readings channels share the strand, so their messages are never handled concurrently.
+        // Made by connect(): the context may be a member of the derived class, not constructed yet at this point.
+        std::optional<asio::strand<asio::io_context::executor_type>> m_strand;
+        std::shared_ptr<tcp_connection> m_connection;
+        connection_impl m_connectionImpl{ connection_impl::callbacks };
+        std::shared_ptr<datagram_receiver> m_datagrams;
+        // The datagram channel is opened by the caller and closed on the strand when the connection drops
+        std::mutex m_muxDatagrams;
+        std::shared_ptr<shm_receiver> m_sharedMemory;
+        std::mutex m_muxSharedMemory;
 
     public:
         explicit client_interface(asio::io_context &context) : m_context{ context } {}
@@ -30,13 +44,20 @@ namespace fortress::net {
             try {
                 asio::ip::tcp::resolver resolver{ m_context };
                 auto endpoints = resolver.resolve(host, std::to_string(port));
+                m_strand.emplace(asio::make_strand(m_context));
 
-                m_connection = std::make_unique<tcp_connection>(
+                m_connection = makeConnection(
+                        m_connectionImpl,
                         m_context,
-                        asio::ip::tcp::socket{ m_context },
+                        asio::ip::tcp::socket{ *m_strand },
                         tcp_connection::owner::client,
                         [this](owned_message<MsgTypes> &msg) { onMessage(msg.message); },
-                        [this](){ onServerDisconnected(); }
+                        [this]() {
+                            closeDatagramChannel();
+                            closeSharedMemoryChannel();
+                            onServerDisconnected();
+                        },
+                        tcp_connection::read_mode::stream
                 );
 
                 m_connection->connectToServer(endpoints);
@@ -48,6 +69,11 @@ namespace fortress::net {
             return true;
         }
 
+        // Used by the next connect()
+        void setConnectionImpl(connection_impl impl) {
+            m_connectionImpl = impl;
+        }
+
         bool isConnected() {
 
             if (m_connection) {
@@ -60,9 +86,110 @@ namespace fortress::net {
             m_connection->disconnect();
         }
 
-        void sendMessage(message<MsgTypes> &msg) {
+        // Counters of the TCP connection, empty before the first connect()
+        [[nodiscard]] std::optional<connection_stats> getConnectionStats() {
+            if (m_connection)
+                return m_connection->getStats();
+            return std::nullopt;
+        }
+
+        // Receive the readings over UDP too. Returns the local port to send to the server with
+        // ClientOpenDatagramChannel, or 0 if the channel cannot be opened. The readings are handled by onMessage, as
+        // ServerSequencedReadings messages.
+        // If the channel is already open, its counters start again.
+        uint16_t openDatagramChannel() {
+            std::scoped_lock lock(m_muxDatagrams);
+            if (m_datagrams) {
+                m_datagrams->resetCounters();
+                return m_datagrams->port();
+            }
+
+            auto serverAddress = m_connection ? m_connection->getRemoteAddress() : asio::ip::address{};
+            if (serverAddress.is_unspecified())
+                return 0;
+
+            try {
+                m_datagrams = std::make_shared<datagram_receiver>(
+                        *m_strand,
+                        serverAddress,
+                        [this](message<MsgTypes> &msg) { onMessage(msg); }
+                );
+                m_datagrams->start();
+            } catch (std::exception &e) {
+                std::cerr << "Cannot open datagram channel: " << e.what() << '\n';
+                m_datagrams.reset();
+                return 0;
+            }
+
+            return m_datagrams->port();
+        }
+
+        // Must be called before the context is destroyed, if the connection did not drop
+        void closeDatagramChannel() {
+            std::scoped_lock lock(m_muxDatagrams);
+            if (m_datagrams) {
+                m_datagrams->close();
+                m_datagrams.reset();
+            }
+        }
+
+        // Null if the datagram channel is not open
+        [[nodiscard]] std::shared_ptr<const datagram_receiver> getDatagramChannel() {
+            std::scoped_lock lock(m_muxDatagrams);
+            return m_datagrams;
+        }
+
+        // Receive the readings through shared memory, from a server on this host. Returns the name of the shared
+        // memory object to send to the server with ClientOpenSharedMemoryChannel, or an empty string if the channel
+        // cannot be opened. The readings are handled by onMessage, as ServerSequencedReadings messages.
+        // If the channel is already open, its counters start again.
+        std::string openSharedMemoryChannel() {
+            std::scoped_lock lock(m_muxSharedMemory);
+            if (m_sharedMemory) {
+                m_sharedMemory->resetCounters();
+                return m_sharedMemory->name();
+            }
+
+            if (!m_connection || !m_connection->getRemoteAddress().is_loopback())
+                return {};
+
+            try {
+                m_sharedMemory = std::make_shared<shm_receiver>(
+                        *m_strand,
+                        [this](message<MsgTypes> &msg) { onMessage(msg); }
+                );
+                m_sharedMemory->start();
+            } catch (std::exception &e) {
+                std::cerr << "Cannot open shared memory channel: " << e.what() << '\n';
+                m_sharedMemory.reset();
+                return {};
+            }
+
+            return m_sharedMemory->name();
+        }
+
+        // Must be called before the context is destroyed, if the connection did not drop
+        void closeSharedMemoryChannel() {
+            std::scoped_lock lock(m_muxSharedMemory);
+            if (m_sharedMemory) {
+                m_sharedMemory->close();
+                m_sharedMemory.reset();
+            }
+        }
+
+        // Null if the shared memory channel is not open
+        [[nodiscard]] std::shared_ptr<const shm_receiver> getSharedMemoryChannel() {
+            std::scoped_lock lock(m_muxSharedMemory);
+            return m_sharedMemory;
+        }
+
+        void sendMessage(const message<MsgTypes> &msg) {
+            sendMessage(message<MsgTypes>{ msg });
+        }
+
+        void sendMessage(message<MsgTypes> &&msg) {
             if (m_connection->isConnected()) {
-                m_connection->send(msg);
+                m_connection->send(std::move(msg));
             } else {
                 m_context.restart();
             }
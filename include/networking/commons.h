@@ -15,10 +15,13 @@
 #include <memory>
 #include <deque>
 #include <mutex>
+#include <condition_variable>
 #include <utility>
 #include <atomic>
 #include <cstring>
 #include <iomanip>
+#include <sstream>
+#include <stdexcept>
 
 #if !defined(ESP32 )
 #define ASIO_STANDALONE
@@ -0,0 +1,77 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_CONNECTION_STATS_H
+#define FORTRESS_CONNECTION_STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include "latency_histogram.h"
+
+namespace fortress::net {
+
+    // Snapshot of the counters of a connection, taken by tcp_connection::getStats() from any thread. The counters
+    // are read one by one while the connection keeps running, so they are not exactly of the same instant.
+    struct connection_stats {
+        uint32_t id;
+        std::chrono::steady_clock::time_point time;
+
+        // On the wire: message headers included
+        uint64_t bytesIn;
+        uint64_t bytesOut;
+        uint64_t framesIn;
+        uint64_t framesOut;
+        uint64_t reads;
+        uint64_t writes;
+
+        // Outbound queue: messages sent and not written yet, the maximum reached and the limit of the overflow policy
+        size_t queueDepth;
+        size_t peakQueueDepth;
+        size_t highWaterMark;
+        uint64_t framesDropped;
+        uint64_t framesCoalesced;
+
+        // From the start of a write to its completion, i.e. until the kernel took the bytes
+        latency_histogram::summary writeLatency;
+        // Messages whose bytes arrived in pieces more than READ_STALL_THRESHOLD apart
+        uint64_t readStalls;
+    };
+
+    // Per second rates between two snapshots of the same connection
+    struct connection_rates {
+        double bytesIn;
+        double bytesOut;
+        double framesIn;
+        double framesOut;
+
+        static connection_rates between(const connection_stats &earlier, const connection_stats &later) {
+            const double seconds = std::chrono::duration<double>(later.time - earlier.time).count();
+            if (seconds <= 0)
+                return {};
+
+            auto rate = [seconds](uint64_t from, uint64_t to) {
+                return to >= from ? static_cast<double>(to - from) / seconds : 0;
+            };
+            return { rate(earlier.bytesIn, later.bytesIn), rate(earlier.bytesOut, later.bytesOut),
+                     rate(earlier.framesIn, later.framesIn), rate(earlier.framesOut, later.framesOut) };
+        }
+    };
+
+    inline std::ostream &operator<<(std::ostream &os, const connection_stats &stats) {
+        os << "in " << stats.bytesIn << " B / " << stats.framesIn << " frames, out " << stats.bytesOut << " B / "
+           << stats.framesOut << " frames, queue " << stats.queueDepth << " (peak " << stats.peakQueueDepth << " of "
+           << stats.highWaterMark << "), dropped " << stats.framesDropped << ", coalesced " << stats.framesCoalesced
+           << ", read stalls " << stats.readStalls;
+        if (stats.writeLatency.count > 0)
+            os << ", write " << stats.writeLatency;
+        return os;
+    }
+}
+
+#endif //FORTRESS_CONNECTION_STATS_H
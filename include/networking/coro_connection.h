@@ -0,0 +1,191 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_CORO_CONNECTION_H
+#define FORTRESS_CORO_CONNECTION_H
+
+#include "tcp_connection.h"
+
+namespace fortress::net {
+
+    // A tcp_connection whose read and write loops are C++20 coroutines instead of chains of completion handlers.
+    // The queue, the overflow policies, the parsing and the statistics are those of tcp_connection, so it is a
+    // drop-in replacement behind client_interface and server_interface.
+    //
+    // Each loop is a single coroutine living as long as the connection: its frame is allocated once, from the
+    // memory asio recycles per thread for coroutine frames. The coroutines run on the strand of the socket, with
+    // its concrete type rather than a type-erased executor, so resuming them allocates nothing. The writer sleeps
+    // on a timer that never expires and is woken up by cancelling it.
+    //
+    // The socket must have been created on a strand, as client_interface and server_interface do.
+    class coro_connection : public tcp_connection {
+    public:
+        using strand_type = asio::strand<asio::io_context::executor_type>;
+
+    private:
+        template<typename T>
+        using awaitable = asio::awaitable<T, strand_type>;
+
+        static constexpr asio::use_awaitable_t<strand_type> use_awaitable{};
+
+        strand_type m_strand;
+        asio::basic_waitable_timer<std::chrono::steady_clock, asio::wait_traits<std::chrono::steady_clock>,
+                strand_type> m_writeSignal;
+        bool m_bWriterIdle{ false };
+
+    public:
+        coro_connection(asio::io_context &asioContext,
+                        asio::ip::tcp::socket socket,
+                        tcp_connection::owner owner,
+                        std::function<void(owned_message<MsgTypes> &)> callback,
+                        std::function<void()> onConnectionDropped = nullptr,
+                        read_mode readMode = read_mode::exact
+        ) :
+                tcp_connection{ asioContext, std::move(socket), owner, std::move(callback),
+                                std::move(onConnectionDropped), readMode },
+                m_strand{ socketStrand(m_socket) },
+                m_writeSignal{ m_strand, std::chrono::steady_clock::time_point::max() } {}
+
+    protected:
+        void startReading() override {
+            // The loops keep the connection alive until they return, after the socket is closed
+            if (m_readMode == read_mode::stream)
+                asio::co_spawn(m_strand, readStream(shared_from_this()), asio::detached);
+            else
+                asio::co_spawn(m_strand, readExact(shared_from_this()), asio::detached);
+            asio::co_spawn(m_strand, writeLoop(shared_from_this()), asio::detached);
+        }
+
+        void onMessageQueued() override {
+            if (m_bWriterIdle)
+                m_writeSignal.cancel();
+        }
+
+        void onSocketClosed() override {
+            m_writeSignal.cancel();
+        }
+
+    private:
+        static strand_type socketStrand(asio::ip::tcp::socket &socket) {
+            // The executor returned is a copy: keep it alive while reading the strand it holds
+            auto executor = socket.get_executor();
+            const auto *strand = executor.target<strand_type>();
+            if (strand == nullptr)
+                throw std::invalid_argument("coro_connection needs a socket created on a strand");
+            return *strand;
+        }
+
+        awaitable<void> writeLoop([[maybe_unused]] std::shared_ptr<tcp_connection> self) {
+            asio::error_code ec;
+
+            while (m_socket.is_open()) {
+                if (m_qMessagesOut.empty()) {
+                    m_bWriterIdle = true;
+                    co_await m_writeSignal.async_wait(asio::redirect_error(use_awaitable, ec));
+                    m_bWriterIdle = false;
+                    continue;
+                }
+
+                // Messages queued while writing are sent with the next write
+                takeMessagesInFlight();
+                size_t length = co_await asio::async_write(m_socket, m_vBuffersInFlight,
+                                                           asio::redirect_error(use_awaitable, ec));
+                if (ec) {
+                    onWriteFailed(ec);
+                    co_return;
+                }
+                onMessagesWritten(length);
+            }
+        }
+
+        awaitable<void> readStream([[maybe_unused]] std::shared_ptr<tcp_connection> self) {
+            m_vReadBuffer.resize(READ_BUFFER_SIZE);
+            m_nReadBegin = m_nReadEnd = 0;
+            asio::error_code ec;
+
+            for (;;) {
+                compactReadBuffer();
+                auto buffer = asio::buffer(m_vReadBuffer.data() + m_nReadEnd, m_vReadBuffer.size() - m_nReadEnd);
+                size_t length = co_await m_socket.async_read_some(buffer, asio::redirect_error(use_awaitable, ec));
+                if (ec)
+                    break;
+
+                ++m_nReads;
+                m_nBytesRead += length;
+                m_nReadEnd += length;
+
+                try {
+                    parseMessages();
+                } catch (std::exception const &e) {
+                    // Any byte received from now on could be parsed as a header
+                    std::cerr << "Caught exception: " << e.what() << '\n';
+                    closeSocket();
+                    co_return;
+                }
+            }
+
+            std::cout << "Read failed: " << ec.message() << '\n';
+            closeSocket();
+        }
+
+        awaitable<void> readExact([[maybe_unused]] std::shared_ptr<tcp_connection> self) {
+            asio::error_code ec;
+
+            for (;;) {
+                co_await asio::async_read(m_socket, asio::buffer(&m_tempInMessage.header, sizeof(message_header<MsgTypes>)),
+                                          asio::redirect_error(use_awaitable, ec));
+                if (ec)
+                    break;
+                ++m_nReads;
+                m_nBytesRead += sizeof(message_header<MsgTypes>);
+
+                // The body of a message that does not match its schema is read and discarded, to stay in step
+                const header_check check = checkHeader(m_tempInMessage.header);
+                if (check != header_check::valid)
+                    std::cerr << describeHeader(m_tempInMessage.header, check) << '\n';
+                if (check == header_check::corrupt) {
+                    closeSocket();
+                    co_return;
+                }
+
+                m_tempInMessage.body.resize(m_tempInMessage.header.size);
+                if (!m_tempInMessage.body.empty()) {
+                    onMessagePartlyRead();
+                    co_await asio::async_read(m_socket, asio::buffer(m_tempInMessage.body.data(), m_tempInMessage.body.size()),
+                                              asio::redirect_error(use_awaitable, ec));
+                    if (ec)
+                        break;
+                    ++m_nReads;
+                    m_nBytesRead += m_tempInMessage.body.size();
+                    onMessageComplete();
+                }
+
+                if (check == header_check::valid)
+                    onMessage();
+            }
+
+            std::cout << "Read failed: " << ec.message() << '\n';
+            closeSocket();
+        }
+    };
+
+    // Implementation of the connections created by client_interface and server_interface
+    enum class connection_impl {
+        callbacks,      // tcp_connection
+        coroutines      // coro_connection
+    };
+
+    template<typename... Args>
+    std::shared_ptr<tcp_connection> makeConnection(connection_impl impl, Args &&... args) {
+        if (impl == connection_impl::coroutines)
+            return std::make_shared<coro_connection>(std::forward<Args>(args)...);
+        return std::make_shared<tcp_connection>(std::forward<Args>(args)...);
+    }
+}
+
+#endif //FORTRESS_CORO_CONNECTION_H
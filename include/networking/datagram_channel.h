@@ -0,0 +1,176 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_DATAGRAM_CHANNEL_H
+#define FORTRESS_DATAGRAM_CHANNEL_H
+
+#include <array>
+#include <functional>
+#include "commons.h"
+#include "message.h"
+#include "message_schema.h"
+#include "shared_frame.h"
+#include "sequenced_readings.h"
+
+namespace fortress::net {
+
+    // Readings can also be sent over UDP, so that a frame lost on a noisy link does not hold back the following
+    // ones as a TCP retransmission would. Control messages always go over the TCP connection.
+    //
+    // The client opens a UDP socket and sends its port with ClientOpenDatagramChannel (port 0 closes the
+    // channel). From then on the server sends it every readings frame as a single datagram, holding the sequence
+    // number of the frame and the readings message as laid out in sequenced_readings.h.
+    //
+    // Frames are self-contained, so a lost datagram loses its samples only.
+
+    // Ethernet MTU minus the IPv4 and UDP headers: larger datagrams would be fragmented
+    constexpr size_t MAX_DATAGRAM_SIZE = 1472;
+
+    static_assert(SEQUENCED_HEADER_SIZE + MAX_BATCH_BODY_SIZE <= MAX_DATAGRAM_SIZE,
+                  "A readings frame must fit a single datagram");
+
+    template<typename Body>
+    shared_frame encodeDatagram(uint32_t sequence, const message<MsgTypes, Body> &msg) {
+        return std::make_shared<const std::vector<uint8_t>>(encodeSequenced(sequence, msg));
+    }
+
+    // Server side: sends encoded datagrams from a single socket bound to an ephemeral port. Must be used from the
+    // executor it was created with.
+    class datagram_sender {
+    private:
+        asio::ip::udp::socket m_socket;
+
+        std::atomic<uint64_t> m_nSent{ 0 };
+        std::atomic<uint64_t> m_nFailed{ 0 };
+
+    public:
+        template<typename Executor>
+        explicit datagram_sender(const Executor &executor) :
+                m_socket{ executor, asio::ip::udp::endpoint(asio::ip::udp::v4(), 0) } {}
+
+        // The datagram is shared, it can be sent to many endpoints at once
+        void send(const shared_frame &datagram, const asio::ip::udp::endpoint &endpoint) {
+            m_socket.async_send_to(asio::buffer(*datagram), endpoint,
+                                   [this, datagram](std::error_code ec, std::size_t) {
+                                       // UDP errors are not fatal, e.g. the receiver socket is gone for a moment
+                                       if (ec)
+                                           ++m_nFailed;
+                                       else
+                                           ++m_nSent;
+                                   });
+        }
+
+        [[nodiscard]] uint64_t getSentCount() const {
+            return m_nSent;
+        }
+
+        [[nodiscard]] uint64_t getFailedCount() const {
+            return m_nFailed;
+        }
+    };
+
+    // Client side: receives the datagrams sent by the server and delivers them in sequence order, as the
+    // ServerSequencedReadings messages they would be over TCP, so the client sees a single stream. Datagrams from
+    // other addresses or not matching the readings schemas are rejected. The receiver keeps itself alive while
+    // receiving: close() it before letting it go.
+    class datagram_receiver : public std::enable_shared_from_this<datagram_receiver> {
+    private:
+        asio::ip::udp::socket m_socket;
+        asio::ip::address m_serverAddress;
+        std::function<void(message<MsgTypes> &)> m_onMessageCallback;
+        uint16_t m_nPort;
+
+        asio::ip::udp::endpoint m_sender;
+        std::array<uint8_t, MAX_DATAGRAM_SIZE> m_buffer{};
+        message<MsgTypes> m_message;
+
+        sequence_tracker m_tracker;
+        std::atomic<uint64_t> m_nRejected{ 0 };
+
+        // Room for a burst of a few hundred frames while the callback is busy
+        static constexpr int RECEIVE_BUFFER_SIZE = 512 * 1024;
+
+    public:
+        template<typename Executor>
+        datagram_receiver(const Executor &executor, asio::ip::address serverAddress,
+                          std::function<void(message<MsgTypes> &)> callback) :
+                m_socket{ executor, asio::ip::udp::endpoint(
+                        serverAddress.is_v6() ? asio::ip::udp::v6() : asio::ip::udp::v4(), 0) },
+                m_serverAddress{ std::move(serverAddress) },
+                m_onMessageCallback{ std::move(callback) },
+                m_nPort{ m_socket.local_endpoint().port() } {
+            m_socket.set_option(asio::socket_base::receive_buffer_size(RECEIVE_BUFFER_SIZE));
+            m_message.body.reserve(MAX_DATAGRAM_SIZE);
+        }
+
+        [[nodiscard]] uint16_t port() const {
+            return m_nPort;
+        }
+
+        void start() {
+            asio::post(m_socket.get_executor(), [self = shared_from_this()]() { self->receive(); });
+        }
+
+        // Safe to call from any thread
+        void close() {
+            asio::post(m_socket.get_executor(), [self = shared_from_this()]() {
+                if (self->m_socket.is_open())
+                    self->m_socket.close();
+            });
+        }
+
+        // Start counting again, for a new acquisition session
+        void resetCounters() {
+            asio::post(m_socket.get_executor(), [self = shared_from_this()]() {
+                self->m_tracker.reset();
+                self->m_nRejected = 0;
+            });
+        }
+
+        [[nodiscard]] const sequence_tracker &tracker() const {
+            return m_tracker;
+        }
+
+        [[nodiscard]] uint64_t getRejectedCount() const {
+            return m_nRejected;
+        }
+
+    private:
+        void receive() {
+            m_socket.async_receive_from(asio::buffer(m_buffer), m_sender,
+                                        [self = shared_from_this()](asio::error_code ec, std::size_t length) {
+                                            if (ec == asio::error::operation_aborted)
+                                                return;
+
+                                            if (!ec)
+                                                self->onDatagram(length);
+
+                                            if (self->m_socket.is_open())
+                                                self->receive();
+                                        });
+        }
+
+        void onDatagram(size_t length) {
+            uint32_t sequence;
+            if (m_sender.address() != m_serverAddress || !isValidSequenced(m_buffer.data(), length, sequence)) {
+                ++m_nRejected;
+                return;
+            }
+
+            if (!m_tracker.accept(sequence))
+                return;
+
+            m_message.header = { ServerSequencedReadings, static_cast<uint32_t>(length) };
+            m_message.body.resize(length);
+            std::memcpy(m_message.body.data(), m_buffer.data(), length);
+            m_onMessageCallback(m_message);
+        }
+    };
+}
+
+#endif //FORTRESS_DATAGRAM_CHANNEL_H
@@ -0,0 +1,142 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_INLINE_BUFFER_H
+#define FORTRESS_INLINE_BUFFER_H
+
+#include <array>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#include <cinttypes>
+
+namespace fortress::net {
+
+    // Byte buffer with the subset of the std::vector<uint8_t> interface used for message bodies. Up to N bytes are
+    // stored inline, without any heap allocation; larger contents are moved to the heap.
+    template<size_t N>
+    class inline_buffer {
+    private:
+        std::unique_ptr<uint8_t[]> m_heap;
+        size_t m_size{ 0 };
+        size_t m_capacity{ N };
+        std::array<uint8_t, N> m_inline;
+
+    public:
+        using value_type = uint8_t;
+        using iterator = uint8_t *;
+        using const_iterator = const uint8_t *;
+
+        static constexpr size_t inline_capacity = N;
+
+        inline_buffer() = default;
+
+        inline_buffer(const inline_buffer &other) {
+            assign(other.data(), other.size());
+        }
+
+        inline_buffer(inline_buffer &&other) noexcept {
+            *this = std::move(other);
+        }
+
+        inline_buffer &operator=(const inline_buffer &other) {
+            if (this != &other)
+                assign(other.data(), other.size());
+            return *this;
+        }
+
+        inline_buffer &operator=(inline_buffer &&other) noexcept {
+            if (this == &other)
+                return *this;
+
+            if (other.m_heap) {
+                // Steal the heap storage
+                m_heap = std::move(other.m_heap);
+                m_capacity = other.m_capacity;
+                m_size = other.m_size;
+            } else {
+                assign(other.data(), other.size());
+            }
+
+            other.m_capacity = N;
+            other.m_size = 0;
+            return *this;
+        }
+
+        [[nodiscard]] uint8_t *data() {
+            return m_heap ? m_heap.get() : m_inline.data();
+        }
+
+        [[nodiscard]] const uint8_t *data() const {
+            return m_heap ? m_heap.get() : m_inline.data();
+        }
+
+        [[nodiscard]] size_t size() const {
+            return m_size;
+        }
+
+        [[nodiscard]] size_t capacity() const {
+            return m_capacity;
+        }
+
+        [[nodiscard]] bool empty() const {
+            return m_size == 0;
+        }
+
+        // True if the content is stored in place
+        [[nodiscard]] bool isInline() const {
+            return !m_heap;
+        }
+
+        iterator begin() { return data(); }
+
+        iterator end() { return data() + m_size; }
+
+        const_iterator begin() const { return data(); }
+
+        const_iterator end() const { return data() + m_size; }
+
+        uint8_t &operator[](size_t i) { return data()[i]; }
+
+        const uint8_t &operator[](size_t i) const { return data()[i]; }
+
+        void reserve(size_t capacity) {
+            if (capacity <= m_capacity)
+                return;
+
+            std::unique_ptr<uint8_t[]> heap{ new uint8_t[capacity] };
+            std::memcpy(heap.get(), data(), m_size);
+            m_heap = std::move(heap);
+            m_capacity = capacity;
+        }
+
+        // As std::vector, new elements are zero initialized
+        void resize(size_t size) {
+            if (size > m_capacity)
+                reserve(std::max(size, 2 * m_capacity));
+
+            if (size > m_size)
+                std::memset(data() + m_size, 0, size - m_size);
+
+            m_size = size;
+        }
+
+        void clear() {
+            m_size = 0;
+        }
+
+        void assign(const uint8_t *first, size_t count) {
+            m_size = 0;
+            reserve(count);
+            std::memcpy(data(), first, count);
+            m_size = count;
+        }
+    };
+}
+
+#endif //FORTRESS_INLINE_BUFFER_H
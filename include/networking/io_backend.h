@@ -0,0 +1,45 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_IO_BACKEND_H
+#define FORTRESS_IO_BACKEND_H
+
+#include <string>
+#include "commons.h"
+
+namespace fortress::net {
+
+    // The backend asio waits for the sockets with is chosen when building: epoll on Linux, unless the tree is
+    // configured with FORTRESS_IO_URING, which defines ASIO_HAS_IO_URING and ASIO_DISABLE_EPOLL. The io_uring
+    // backend needs a kernel allowing it: otherwise creating the io_context throws.
+    inline const char *ioBackendName() {
+#if defined(ASIO_HAS_IO_URING_AS_DEFAULT)
+        return "io_uring";
+#elif defined(ASIO_HAS_EPOLL)
+        return "epoll";
+#elif defined(ASIO_HAS_KQUEUE)
+        return "kqueue";
+#elif defined(ASIO_HAS_IOCP)
+        return "iocp";
+#else
+        return "select";
+#endif
+    }
+
+    // e.g. "io_uring, asio 1.28.0"
+    inline std::string ioBackendReport() {
+        std::stringstream out;
+        out << ioBackendName();
+#if defined(ASIO_VERSION)
+        out << ", asio " << ASIO_VERSION / 100000 << '.' << ASIO_VERSION / 100 % 1000 << '.' << ASIO_VERSION % 100;
+#endif
+        return out.str();
+    }
+}
+
+#endif //FORTRESS_IO_BACKEND_H
@@ -0,0 +1,131 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_LATENCY_HISTOGRAM_H
+#define FORTRESS_LATENCY_HISTOGRAM_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+namespace fortress::net {
+
+    // HDR-style histogram of durations in microseconds, from 1 us to about 71 minutes. Values below 128 us are
+    // counted exactly; above, each power of two is split into 64 linear buckets, so every value is known within
+    // 1/64 (1.6 %) whatever its magnitude. Recording is lock-free and constant time, and it can be read while
+    // another thread records: the percentiles are then off by the values being recorded.
+    class latency_histogram {
+    public:
+        using duration = std::chrono::microseconds;
+
+        struct summary {
+            uint64_t count;
+            duration p50;
+            duration p90;
+            duration p99;
+            duration max;
+        };
+
+    private:
+        static constexpr unsigned SUB_BUCKET_BITS = 7;
+        static constexpr uint64_t SUB_BUCKET_COUNT = uint64_t{ 1 } << SUB_BUCKET_BITS;
+        static constexpr uint64_t SUB_BUCKET_HALF = SUB_BUCKET_COUNT / 2;
+        static constexpr unsigned VALUE_BITS = 32;
+        static constexpr uint64_t MAX_VALUE = (uint64_t{ 1 } << VALUE_BITS) - 1;
+        static constexpr size_t BUCKET_COUNT = SUB_BUCKET_COUNT + (VALUE_BITS - SUB_BUCKET_BITS) * SUB_BUCKET_HALF;
+
+        std::array<std::atomic<uint64_t>, BUCKET_COUNT> m_counts{};
+        std::atomic<uint64_t> m_nCount{ 0 };
+        std::atomic<uint64_t> m_nMax{ 0 };
+
+    public:
+        void record(std::chrono::steady_clock::duration value) {
+            auto micros = std::chrono::duration_cast<duration>(value).count();
+            uint64_t clamped = micros <= 0 ? 0 : std::min(static_cast<uint64_t>(micros), MAX_VALUE);
+
+            m_counts[indexOf(clamped)].fetch_add(1, std::memory_order_relaxed);
+            m_nCount.fetch_add(1, std::memory_order_relaxed);
+
+            uint64_t max = m_nMax.load(std::memory_order_relaxed);
+            while (clamped > max && !m_nMax.compare_exchange_weak(max, clamped, std::memory_order_relaxed)) {}
+        }
+
+        // Smallest value such that a fraction q of the recorded values are not greater, rounded up to the top of
+        // its bucket. Zero if nothing has been recorded.
+        [[nodiscard]] duration quantile(double q) const {
+            uint64_t nCount = m_nCount.load(std::memory_order_relaxed);
+            if (nCount == 0)
+                return duration::zero();
+
+            auto rank = static_cast<uint64_t>(q * static_cast<double>(nCount) + 0.5);
+            rank = std::clamp<uint64_t>(rank, 1, nCount);
+
+            uint64_t nSeen = 0;
+            for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+                nSeen += m_counts[i].load(std::memory_order_relaxed);
+                if (nSeen >= rank)
+                    return duration{ static_cast<duration::rep>(std::min(highestValueOf(i), max().count())) };
+            }
+            return max();
+        }
+
+        [[nodiscard]] duration max() const {
+            return duration{ static_cast<duration::rep>(m_nMax.load(std::memory_order_relaxed)) };
+        }
+
+        [[nodiscard]] uint64_t count() const {
+            return m_nCount.load(std::memory_order_relaxed);
+        }
+
+        [[nodiscard]] summary getSummary() const {
+            return { count(), quantile(0.50), quantile(0.90), quantile(0.99), max() };
+        }
+
+        // Not atomic with respect to a concurrent record(), which may survive the reset
+        void reset() {
+            for (auto &bucket: m_counts)
+                bucket.store(0, std::memory_order_relaxed);
+            m_nCount.store(0, std::memory_order_relaxed);
+            m_nMax.store(0, std::memory_order_relaxed);
+        }
+
+    private:
+        static size_t indexOf(uint64_t value) {
+            if (value < SUB_BUCKET_COUNT)
+                return static_cast<size_t>(value);
+
+            // Keep the SUB_BUCKET_BITS most significant bits: the top one is always set, the others select one of
+            // SUB_BUCKET_HALF buckets
+            const unsigned shift = static_cast<unsigned>(std::bit_width(value)) - SUB_BUCKET_BITS;
+            const uint64_t subBucket = value >> shift;
+            return static_cast<size_t>(SUB_BUCKET_COUNT + (shift - 1) * SUB_BUCKET_HALF + (subBucket - SUB_BUCKET_HALF));
+        }
+
+        static int64_t highestValueOf(size_t index) {
+            if (index < SUB_BUCKET_COUNT)
+                return static_cast<int64_t>(index);
+
+            const uint64_t shift = (index - SUB_BUCKET_COUNT) / SUB_BUCKET_HALF + 1;
+            const uint64_t subBucket = (index - SUB_BUCKET_COUNT) % SUB_BUCKET_HALF + SUB_BUCKET_HALF;
+            return static_cast<int64_t>(((subBucket + 1) << shift) - 1);
+        }
+    };
+
+    inline std::ostream &operator<<(std::ostream &os, const latency_histogram::summary &summary) {
+        auto ms = [](latency_histogram::duration value) { return static_cast<double>(value.count()) / 1000; };
+        os << "p50 " << ms(summary.p50) << " ms, p90 " << ms(summary.p90) << " ms, p99 " << ms(summary.p99)
+           << " ms, max " << ms(summary.max) << " ms over " << summary.count;
+        return os;
+    }
+}
+
+#endif //FORTRESS_LATENCY_HISTOGRAM_H
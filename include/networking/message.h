@@ -10,6 +10,8 @@
 #define FORTRESS_MESSAGE_H
 
 #include "commons.h"
+#include "inline_buffer.h"
+#include "../constants.h"
 
 namespace fortress {
     namespace net {
@@ -30,12 +32,14 @@ namespace fortress {
             }
         };
 
-        template<typename T>
+        // Bodies up to MAX_BODY_SIZE bytes are stored inside the message, without heap allocations.
+        // Use message<T, std::vector<uint8_t>> to always store the body on the heap.
+        template<typename T, typename Body = inline_buffer<MAX_BODY_SIZE>>
         struct message {
         private:
         public:
             message_header<T> header{};
-            std::vector<uint8_t> body;
+            Body body;
 
 
             // The size of entire message packet in bytes
@@ -43,7 +47,7 @@ namespace fortress {
                 return body.size();
             }
 
-            friend std::ostream &operator<<(std::ostream &out, const message<T> &msg) {
+            friend std::ostream &operator<<(std::ostream &out, const message &msg) {
                 std::array<uint8_t, sizeof(message_header<T>)> _header;
                 std::vector<uint8_t> _body;
                 _body.resize(msg.size());
@@ -64,7 +68,7 @@ namespace fortress {
 
             // Push any DataType data into the message buffer
             template<typename DataType>
-            friend message<T> &operator<<(message<T> &msg, const DataType &data) {
+            friend message &operator<<(message &msg, const DataType &data) {
                 static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pushed in a vector");
 
                 // Cache current vector size
@@ -83,7 +87,7 @@ namespace fortress {
             }
 
             template<typename DataType>
-            friend message<T> &operator>>(message<T> &msg, DataType &data) {
+            friend message &operator>>(message &msg, DataType &data) {
                 static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pushed in a vector");
 
                 // Cache the location towards the end of the vector where the pulled data starts
@@ -102,6 +106,73 @@ namespace fortress {
             }
         };
 
+        // Non-owning view decoding the fields of a message body from front to back, in the same order they were
+        // pushed with operator<<. The body is neither copied nor modified, so the message must outlive the reader.
+        class message_reader {
+        private:
+            const uint8_t *m_data;
+            size_t m_size;
+            size_t m_offset{ 0 };
+
+        public:
+            message_reader(const uint8_t *data, size_t size) : m_data{ data }, m_size{ size } {}
+
+            template<typename T, typename Body>
+            explicit message_reader(const message<T, Body> &msg) : message_reader(msg.body.data(), msg.body.size()) {}
+
+            // Number of bytes not read yet
+            [[nodiscard]] size_t remaining() const {
+                return m_size - m_offset;
+            }
+
+            [[nodiscard]] bool empty() const {
+                return m_offset == m_size;
+            }
+
+            [[nodiscard]] size_t offset() const {
+                return m_offset;
+            }
+
+            // Pointer to the next size bytes, which are then skipped
+            const uint8_t *take(size_t size) {
+                if (size > remaining()) {
+                    std::stringstream out;
+                    out << "Cannot read " << size << " bytes at offset " << m_offset << " of a " << m_size
+                        << " bytes body";
+                    throw std::out_of_range(out.str());
+                }
+
+                const uint8_t *data = m_data + m_offset;
+                m_offset += size;
+                return data;
+            }
+
+            void skip(size_t size) {
+                take(size);
+            }
+
+            template<typename DataType>
+            DataType read() {
+                DataType data;
+                *this >> data;
+                return data;
+            }
+
+            template<typename DataType>
+            friend message_reader &operator>>(message_reader &reader, DataType &data) {
+                static_assert(std::is_standard_layout<DataType>::value, "Data is too complex to be pulled from a vector");
+
+                std::memcpy(&data, reader.take(sizeof(DataType)), sizeof(DataType));
+                return reader;
+            }
+
+            // Allow decoding from a temporary reader, as in message_reader(msg) >> value
+            template<typename DataType>
+            friend message_reader &operator>>(message_reader &&reader, DataType &data) {
+                return reader >> data;
+            }
+        };
+
         // Forward declare the connection
         class tcp_connection;
 
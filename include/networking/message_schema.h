@@ -0,0 +1,326 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_MESSAGE_SCHEMA_H
+#define FORTRESS_MESSAGE_SCHEMA_H
+
+#include <array>
+#include <chrono>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "message.h"
+#include "../constants.h"
+
+namespace fortress::net {
+
+    using RawReadings_t = std::array<uint16_t, consts::N_CHANNELS>;
+
+    // ---- Payloads ----
+    // Plain structs copied as they are to and from the message body
+
+    // Firmware that predates the schemas sends ServerAccept with an empty body: no client id
+    struct accept_payload {
+        uint32_t clientId;
+    };
+
+    // Time the ping was sent on the steady clock of the sender, bounced back by the remote as it is. Only the
+    // sender reads it, so the two clocks need not agree.
+    struct ping_payload {
+        std::chrono::steady_clock::time_point time;
+    };
+
+    // One uint16_t reading per channel followed by the timestamp in microseconds since the session started
+    struct readings_sample {
+        RawReadings_t readings;
+        uint32_t timestamp;
+    };
+
+    struct frequency_payload {
+        uint16_t frequency;
+    };
+
+    // The readings codecs the client can decode, as a mask of 1 << readings_codec. ClientStartUpdating keeps its
+    // 2 bytes body: firmware that predates the codecs reads the frequency from it, and ignores this message.
+    struct codecs_payload {
+        uint16_t codecs;
+    };
+
+    struct sensor_hv_payload {
+        uint16_t millivolts;
+    };
+
+    // UDP port the client receives readings on, 0 to receive them over TCP again
+    struct datagram_channel_payload {
+        uint16_t port;
+    };
+
+    // Null-terminated name of the shared memory object the client receives readings in, empty to receive them over
+    // TCP again
+    struct shared_memory_channel_payload {
+        char name[SHARED_MEMORY_NAME_SIZE];
+    };
+
+    // ClientResumeSession: the epoch of the server the last frame came from, 0 if none, and the sequence number of
+    // the next frame the client expects. ServerResumeSession: the epoch of the server and the sequence number of
+    // the first frame it is going to send, older frames are lost.
+    struct resume_payload {
+        uint32_t epoch;
+        uint32_t sequence;
+    };
+
+    static_assert(sizeof(readings_sample) == READINGS_SAMPLE_SIZE, "readings_sample must not be padded");
+    static_assert(sizeof(ping_payload) == sizeof(int64_t), "Pings are bounced by firmware that only knows the size");
+
+    // ---- Schemas ----
+
+    enum class payload_kind {
+        empty,      // No body
+        fixed,      // Exactly one payload
+        optional,   // One payload or none, for bodies that older peers send empty
+        repeated,   // One or more payloads, up to a maximum count
+        text,       // Free form bytes, up to MAX_BODY_SIZE
+        encoded     // Bytes with a layout of their own, within size limits
+    };
+
+    struct empty_schema {
+        static constexpr payload_kind kind = payload_kind::empty;
+        static constexpr uint32_t element_size = 1;
+        static constexpr uint32_t min_size = 0;
+        static constexpr uint32_t max_size = 0;
+    };
+
+    template<typename Payload>
+    struct fixed_schema {
+        static_assert(std::is_trivially_copyable_v<Payload>, "Payloads are copied with memcpy");
+
+        using payload_type = Payload;
+        static constexpr payload_kind kind = payload_kind::fixed;
+        static constexpr uint32_t element_size = sizeof(Payload);
+        static constexpr uint32_t min_size = sizeof(Payload);
+        static constexpr uint32_t max_size = sizeof(Payload);
+    };
+
+    template<typename Payload>
+    struct optional_schema {
+        static_assert(std::is_trivially_copyable_v<Payload>, "Payloads are copied with memcpy");
+
+        using payload_type = Payload;
+        static constexpr payload_kind kind = payload_kind::optional;
+        static constexpr uint32_t element_size = sizeof(Payload);
+        static constexpr uint32_t min_size = 0;
+        static constexpr uint32_t max_size = sizeof(Payload);
+    };
+
+    template<typename Element, uint32_t MaxCount>
+    struct repeated_schema {
+        static_assert(std::is_trivially_copyable_v<Element>, "Payloads are copied with memcpy");
+
+        using payload_type = Element;
+        static constexpr payload_kind kind = payload_kind::repeated;
+        static constexpr uint32_t element_size = sizeof(Element);
+        static constexpr uint32_t min_size = sizeof(Element);
+        static constexpr uint32_t max_size = sizeof(Element) * MaxCount;
+    };
+
+    struct text_schema {
+        static constexpr payload_kind kind = payload_kind::text;
+        static constexpr uint32_t element_size = 1;
+        static constexpr uint32_t min_size = 0;
+        static constexpr uint32_t max_size = MAX_BODY_SIZE;
+    };
+
+    template<uint32_t MinSize, uint32_t MaxSize>
+    struct encoded_schema {
+        static constexpr payload_kind kind = payload_kind::encoded;
+        static constexpr uint32_t element_size = 1;
+        static constexpr uint32_t min_size = MinSize;
+        static constexpr uint32_t max_size = MaxSize;
+    };
+
+    // Every message type must be registered here: using an unregistered one does not compile
+    template<MsgTypes Id>
+    struct message_schema;
+
+    template<> struct message_schema<ServerAccept> : optional_schema<accept_payload> {};
+    template<> struct message_schema<ServerDeny> : empty_schema {};
+    template<> struct message_schema<ServerMessage> : text_schema {};
+    template<> struct message_schema<ServerPing> : fixed_schema<ping_payload> {};
+    template<> struct message_schema<ServerReadings> : fixed_schema<readings_sample> {};
+    template<> struct message_schema<ServerFinishedUpload> : empty_schema {};
+    template<> struct message_schema<ClientPing> : fixed_schema<ping_payload> {};
+    template<> struct message_schema<ClientMessage> : text_schema {};
+    template<> struct message_schema<ClientDisconnect> : empty_schema {};
+    template<> struct message_schema<ClientStartUpdating> : fixed_schema<frequency_payload> {};
+    template<> struct message_schema<ClientStopUpdating> : empty_schema {};
+    template<> struct message_schema<ClientSetSampleFrequency> : fixed_schema<frequency_payload> {};
+    template<> struct message_schema<ClientSetSensorHV> : fixed_schema<sensor_hv_payload> {};
+    template<> struct message_schema<ServerReadingsBatch> : repeated_schema<readings_sample, MAX_SAMPLES_PER_BATCH> {};
+    // Layout in readings_codec.h. Never larger than the same samples sent as ServerReadingsBatch.
+    template<> struct message_schema<ServerReadingsPacked>
+            : encoded_schema<sizeof(uint16_t) + sizeof(readings_sample), MAX_BATCH_BODY_SIZE> {};
+    template<> struct message_schema<ClientOpenDatagramChannel> : fixed_schema<datagram_channel_payload> {};
+    // Layout in sequenced_readings.h
+    template<> struct message_schema<ServerSequencedReadings>
+            : encoded_schema<SEQUENCED_HEADER_SIZE + READINGS_SAMPLE_SIZE, SEQUENCED_HEADER_SIZE + MAX_BATCH_BODY_SIZE> {};
+    template<> struct message_schema<ClientResumeSession> : fixed_schema<resume_payload> {};
+    template<> struct message_schema<ServerResumeSession> : fixed_schema<resume_payload> {};
+    template<> struct message_schema<ClientOpenSharedMemoryChannel> : fixed_schema<shared_memory_channel_payload> {};
+    template<> struct message_schema<ClientSetReadingsCodecs> : fixed_schema<codecs_payload> {};
+
+    static_assert(message_schema<ServerReadingsBatch>::max_size == MAX_BATCH_BODY_SIZE);
+
+    // ---- Size checks on receive ----
+
+    struct body_size_limits {
+        uint32_t min;
+        uint32_t max;
+        uint32_t elementSize;
+    };
+
+    namespace detail {
+        template<size_t... Ids>
+        constexpr auto makeBodySizeLimits(std::index_sequence<Ids...>) {
+            return std::array<body_size_limits, sizeof...(Ids)>{
+                    body_size_limits{ message_schema<static_cast<MsgTypes>(Ids)>::min_size,
+                                      message_schema<static_cast<MsgTypes>(Ids)>::max_size,
+                                      message_schema<static_cast<MsgTypes>(Ids)>::element_size }...
+            };
+        }
+    }
+
+    // Indexed by message id
+    inline constexpr auto BODY_SIZE_LIMITS = detail::makeBodySizeLimits(std::make_index_sequence<MessageAll>{});
+
+    constexpr uint32_t maxBodySize(uint32_t id) {
+        return id < MessageAll ? BODY_SIZE_LIMITS[id].max : 0;
+    }
+
+    // True if a body of size bytes matches the schema of the message id
+    constexpr bool isValidBody(uint32_t id, uint32_t size) {
+        if (id >= MessageAll)
+            return false;
+
+        const auto &limits = BODY_SIZE_LIMITS[id];
+        return size >= limits.min && size <= limits.max && size % limits.elementSize == 0;
+    }
+
+    static_assert(isValidBody(ServerReadings, READINGS_SAMPLE_SIZE) && !isValidBody(ServerReadings, 4 * sizeof(double)));
+    static_assert(isValidBody(ServerReadingsBatch, 3 * READINGS_SAMPLE_SIZE) && !isValidBody(ServerReadingsBatch, 0));
+    static_assert(isValidBody(ServerAccept, 0) && isValidBody(ServerAccept, sizeof(accept_payload)) &&
+                  !isValidBody(ServerAccept, 2));
+
+    // ---- Encoding ----
+
+    // A message with no body
+    template<MsgTypes Id, typename Body = inline_buffer<MAX_BODY_SIZE>>
+    message<MsgTypes, Body> makeMessage() {
+        static_assert(message_schema<Id>::kind == payload_kind::empty, "This message has a payload");
+
+        message<MsgTypes, Body> msg;
+        msg.header.id = Id;
+        return msg;
+    }
+
+    // A message whose body is a single payload
+    template<MsgTypes Id, typename Body = inline_buffer<MAX_BODY_SIZE>>
+    message<MsgTypes, Body> makeMessage(const typename message_schema<Id>::payload_type &payload) {
+        static_assert(message_schema<Id>::kind != payload_kind::empty, "This message has no payload");
+
+        message<MsgTypes, Body> msg;
+        msg.header.id = Id;
+        msg.header.size = sizeof(payload);
+        msg.body.resize(sizeof(payload));
+        std::memcpy(msg.body.data(), &payload, sizeof(payload));
+        return msg;
+    }
+
+    // Append a payload to a repeated message
+    template<MsgTypes Id, typename Body>
+    void appendPayload(message<MsgTypes, Body> &msg, const typename message_schema<Id>::payload_type &payload) {
+        static_assert(message_schema<Id>::kind == payload_kind::repeated, "Only repeated payloads can be appended");
+
+        const size_t offset = msg.body.size();
+        msg.body.resize(offset + sizeof(payload));
+        std::memcpy(msg.body.data() + offset, &payload, sizeof(payload));
+        msg.header.size = static_cast<uint32_t>(msg.body.size());
+    }
+
+    // ---- Decoding ----
+
+    // Payloads of a repeated message. Elements are copied out on access, the body may not be suitably aligned.
+    template<typename Element>
+    class payload_array {
+    private:
+        const uint8_t *m_data;
+        size_t m_count;
+
+    public:
+        payload_array(const uint8_t *data, size_t count) : m_data{ data }, m_count{ count } {}
+
+        [[nodiscard]] size_t size() const {
+            return m_count;
+        }
+
+        [[nodiscard]] bool empty() const {
+            return m_count == 0;
+        }
+
+        Element operator[](size_t i) const {
+            Element element;
+            std::memcpy(&element, m_data + i * sizeof(Element), sizeof(Element));
+            return element;
+        }
+    };
+
+    template<MsgTypes Id, typename Body>
+    void checkBody(const message<MsgTypes, Body> &msg) {
+        if (msg.header.id != Id || !isValidBody(Id, msg.size())) {
+            std::stringstream out;
+            out << "Message with header " << msg.header << " does not match the schema of message " << int(Id);
+            throw std::length_error(out.str());
+        }
+    }
+
+    // Copy the payload out of a fixed message. Throws std::length_error if the message does not match the schema.
+    template<MsgTypes Id, typename Body>
+    typename message_schema<Id>::payload_type decodePayload(const message<MsgTypes, Body> &msg) {
+        static_assert(message_schema<Id>::kind == payload_kind::fixed, "Use decodePayloads for repeated payloads");
+        checkBody<Id>(msg);
+
+        typename message_schema<Id>::payload_type payload;
+        std::memcpy(&payload, msg.body.data(), sizeof(payload));
+        return payload;
+    }
+
+    // Copy the payload out of an optional message, empty if the body is. Throws std::length_error if the message does
+    // not match the schema.
+    template<MsgTypes Id, typename Body>
+    std::optional<typename message_schema<Id>::payload_type> decodeOptionalPayload(const message<MsgTypes, Body> &msg) {
+        static_assert(message_schema<Id>::kind == payload_kind::optional, "Use decodePayload for fixed payloads");
+        checkBody<Id>(msg);
+
+        if (msg.size() == 0)
+            return std::nullopt;
+
+        typename message_schema<Id>::payload_type payload;
+        std::memcpy(&payload, msg.body.data(), sizeof(payload));
+        return payload;
+    }
+
+    // View the payloads of a repeated message. The message must outlive the view.
+    template<MsgTypes Id, typename Body>
+    payload_array<typename message_schema<Id>::payload_type> decodePayloads(const message<MsgTypes, Body> &msg) {
+        static_assert(message_schema<Id>::kind == payload_kind::repeated, "Use decodePayload for fixed payloads");
+        checkBody<Id>(msg);
+
+        return { msg.body.data(), msg.size() / message_schema<Id>::element_size };
+    }
+}
+
+#endif //FORTRESS_MESSAGE_SCHEMA_H
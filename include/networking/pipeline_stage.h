@@ -0,0 +1,149 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_PIPELINE_STAGE_H
+#define FORTRESS_PIPELINE_STAGE_H
+
+#include <functional>
+#include <string>
+#include <thread>
+#include "spsc_queue.h"
+
+namespace fortress::net {
+
+    // A stage of a pipeline: a thread handing the items of a bounded spsc_queue to a handler, in order. Exactly one
+    // thread pushes. push() waits for room, so nothing is lost and a stage that falls behind holds back the previous
+    // one; tryPush() drops the item instead, for stages that may lose data.
+    template<typename T>
+    class pipeline_stage {
+
+    private:
+        std::string m_name;
+        spsc_queue<T> m_queue;
+        std::function<void(T &)> m_handler;
+        std::thread m_thread;
+
+        std::atomic<uint64_t> m_nPushed{ 0 };
+        std::atomic<uint64_t> m_nHandled{ 0 };
+        std::atomic<uint64_t> m_nDropped{ 0 };
+        std::atomic<size_t> m_nPeakDepth{ 0 };
+
+        static constexpr std::chrono::milliseconds FLUSH_POLL_PERIOD{ 1 };
+
+    public:
+        pipeline_stage(std::string name, size_t capacity, std::function<void(T &)> handler) :
+                m_name{ std::move(name) },
+                m_queue{ capacity },
+                m_handler{ std::move(handler) } {}
+
+        pipeline_stage(const pipeline_stage<T> &) = delete;
+
+        pipeline_stage &operator=(const pipeline_stage<T> &) = delete;
+
+        ~pipeline_stage() {
+            stop();
+        }
+
+        void start() {
+            if (!m_thread.joinable())
+                m_thread = std::thread([this]() { run(); });
+        }
+
+        // Handle the items queued so far and join the thread. A stopped stage cannot be started again, and pushing
+        // to it fails.
+        void stop() {
+            m_queue.stopWaiting();
+            if (m_thread.joinable())
+                m_thread.join();
+        }
+
+        // ---- Producer ----
+
+        // Wait for room. Returns false if the stage has been stopped.
+        template<typename U>
+        bool push(U &&item) {
+            if (!m_queue.wait_push(std::forward<U>(item)))
+                return false;
+            onPushed();
+            return true;
+        }
+
+        // Drop the item if the queue is full
+        template<typename U>
+        bool tryPush(U &&item) {
+            if (!m_queue.try_push(std::forward<U>(item))) {
+                ++m_nDropped;
+                return false;
+            }
+            onPushed();
+            return true;
+        }
+
+        // ---- Any thread ----
+
+        // Block until the items pushed before the call have been handled
+        void flush() const {
+            const uint64_t nPushed = m_nPushed;
+            while (m_thread.joinable() && m_nHandled < nPushed)
+                std::this_thread::sleep_for(FLUSH_POLL_PERIOD);
+        }
+
+        [[nodiscard]] const std::string &name() const {
+            return m_name;
+        }
+
+        // Items waiting to be handled. Approximate when called from a thread other than the two ends of the queue.
+        [[nodiscard]] size_t getQueueDepth() const {
+            return m_queue.count();
+        }
+
+        [[nodiscard]] size_t getPeakQueueDepth() const {
+            return m_nPeakDepth;
+        }
+
+        [[nodiscard]] size_t getCapacity() const {
+            return m_queue.capacity();
+        }
+
+        [[nodiscard]] uint64_t getHandledCount() const {
+            return m_nHandled;
+        }
+
+        [[nodiscard]] uint64_t getDroppedCount() const {
+            return m_nDropped;
+        }
+
+        // The peak queue depth and the items dropped
+        void resetCounters() {
+            m_nPeakDepth = 0;
+            m_nDropped = 0;
+        }
+
+    private:
+        void onPushed() {
+            ++m_nPushed;
+            const size_t depth = m_queue.count();
+            if (depth > m_nPeakDepth)
+                m_nPeakDepth = depth;
+        }
+
+        void run() {
+            T item;
+            while (m_queue.wait_pop(item)) {
+                try {
+                    m_handler(item);
+                } catch (std::exception const &e) {
+                    std::cerr << '[' << m_name << "] Caught exception: " << e.what() << '\n';
+                }
+                ++m_nHandled;
+            }
+        }
+    };
+}
+
+#endif //FORTRESS_PIPELINE_STAGE_H
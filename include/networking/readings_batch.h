@@ -0,0 +1,115 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_READINGS_BATCH_H
+#define FORTRESS_READINGS_BATCH_H
+
+#include <array>
+#include <algorithm>
+#include "message.h"
+#include "message_schema.h"
+#include "readings_codec.h"
+#include "../constants.h"
+
+namespace fortress::net {
+
+    // Accumulates consecutive samples into a single ServerReadingsBatch message. The batch is ready to be sent
+    // as soon as it holds maxSamples samples or waiting for the next sample would make it span more than
+    // maxSpanMicros.
+    class readings_batch {
+    private:
+        message<MsgTypes> m_message;
+        readings_codec m_codec{ readings_codec::raw };
+        uint16_t m_nSamples{ 0 };
+        uint32_t m_firstTimestamp{ 0 };
+        uint32_t m_lastTimestamp{ 0 };
+        uint32_t m_samplingPeriod{ 0 };
+
+        uint16_t m_maxSamples;
+        uint32_t m_maxSpanMicros;
+
+    public:
+        explicit readings_batch(uint16_t maxSamples = MAX_SAMPLES_PER_BATCH,
+                                uint32_t maxSpanMicros = DEFAULT_BATCH_SPAN_MICROS) {
+            configure(maxSamples, maxSpanMicros);
+            clear();
+        }
+
+        void configure(uint16_t maxSamples, uint32_t maxSpanMicros) {
+            m_maxSamples = std::clamp<uint16_t>(maxSamples, 1, MAX_SAMPLES_PER_BATCH);
+            m_maxSpanMicros = maxSpanMicros;
+        }
+
+        // With delta_packed, frames are sent as ServerReadingsPacked whenever that makes them smaller
+        void setCodec(readings_codec codec) {
+            m_codec = codec;
+        }
+
+        [[nodiscard]] readings_codec codec() const {
+            return m_codec;
+        }
+
+        void push(const RawReadings_t &readings, uint32_t timestamp) {
+            if (m_nSamples == 0)
+                m_firstTimestamp = timestamp;
+
+            // Estimate when the next sample will come
+            if (m_lastTimestamp > 0)
+                m_samplingPeriod = timestamp - m_lastTimestamp;
+            m_lastTimestamp = timestamp;
+
+            appendPayload<ServerReadingsBatch>(m_message, { readings, timestamp });
+
+            ++m_nSamples;
+        }
+
+        [[nodiscard]] bool empty() const {
+            return m_nSamples == 0;
+        }
+
+        [[nodiscard]] uint16_t count() const {
+            return m_nSamples;
+        }
+
+        // True when the batch should be flushed at time now (same clock of the pushed timestamps)
+        [[nodiscard]] bool isReady(uint32_t now) const {
+            return m_nSamples >= m_maxSamples ||
+                   (m_nSamples > 0 && now - m_firstTimestamp + m_samplingPeriod >= m_maxSpanMicros);
+        }
+
+        // Hand over the encoded message and start a new batch
+        message<MsgTypes> take() {
+            message<MsgTypes> msg = std::move(m_message);
+
+            if (m_codec == readings_codec::delta_packed) {
+                message<MsgTypes> packed;
+                if (encodePackedReadings(msg.body.data(), m_nSamples, packed))
+                    msg = std::move(packed);
+            }
+
+            restart();
+            return msg;
+        }
+
+        // Discard pending samples, for a new acquisition session
+        void clear() {
+            m_lastTimestamp = m_samplingPeriod = 0;
+            restart();
+        }
+
+    private:
+        void restart() {
+            m_message = {};
+            m_message.header.id = ServerReadingsBatch;
+            m_message.body.reserve(static_cast<size_t>(m_maxSamples) * READINGS_SAMPLE_SIZE);
+            m_nSamples = 0;
+        }
+    };
+}
+
+#endif //FORTRESS_READINGS_BATCH_H
@@ -0,0 +1,253 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_READINGS_CODEC_H
+#define FORTRESS_READINGS_CODEC_H
+
+#include <array>
+#include <vector>
+#include <utility>
+#include "message.h"
+#include "message_schema.h"
+
+namespace fortress::net {
+
+    // How the readings of a session are sent. The client lists the codecs it can decode in ClientSetReadingsCodecs,
+    // before starting a session. The server picks one, raw if the client never told, and every frame says how it
+    // is encoded by its message id.
+    enum class readings_codec : uint8_t {
+        raw,            // ServerReadings and ServerReadingsBatch
+        delta_packed    // ServerReadingsPacked
+    };
+
+    constexpr uint16_t codecMask(readings_codec codec) {
+        return static_cast<uint16_t>(1u << static_cast<uint8_t>(codec));
+    }
+
+    // ServerReadingsPacked body, lossless:
+    //
+    //   uint16_t         number of samples
+    //   readings_sample  first sample, as it is
+    //   blocks of PACKED_BLOCK_SIZE samples, the last one padded with zero deltas:
+    //     uint8_t        bit width of each channel and of the timestamp
+    //     for each channel, then the timestamp: the zig-zag encoded deltas to the previous sample, packed with
+    //                    the bit width of the block. Block size times bit width is a whole number of bytes.
+    //
+    // Every frame starts from a full sample, so frames can be dropped without breaking the following ones.
+    constexpr size_t PACKED_BLOCK_SIZE = 16;
+    constexpr size_t PACKED_FIELDS = consts::N_CHANNELS + 1;
+
+    namespace detail {
+        constexpr uint32_t zigzag16(uint16_t delta) {
+            auto value = static_cast<int16_t>(delta);
+            return static_cast<uint16_t>((value << 1) ^ (value >> 15));
+        }
+
+        constexpr uint16_t unzigzag16(uint32_t value) {
+            return static_cast<uint16_t>((value >> 1) ^ (~(value & 1) + 1));
+        }
+
+        constexpr uint32_t zigzag32(uint32_t delta) {
+            auto value = static_cast<int32_t>(delta);
+            return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+        }
+
+        constexpr uint32_t unzigzag32(uint32_t value) {
+            return (value >> 1) ^ (~(value & 1) + 1);
+        }
+
+        static_assert(unzigzag16(zigzag16(static_cast<uint16_t>(-3))) == static_cast<uint16_t>(-3));
+        static_assert(unzigzag32(zigzag32(static_cast<uint32_t>(-1000))) == static_cast<uint32_t>(-1000));
+
+        inline uint8_t bitWidth(uint32_t value) {
+            uint8_t width = 0;
+            while (value != 0) {
+                ++width;
+                value >>= 1;
+            }
+            return width;
+        }
+
+        inline void pack(const uint32_t *values, uint8_t width, uint8_t *out) {
+            uint64_t bits = 0;
+            unsigned nBits = 0;
+            for (size_t i = 0; i < PACKED_BLOCK_SIZE; ++i) {
+                bits |= static_cast<uint64_t>(values[i]) << nBits;
+                nBits += width;
+                while (nBits >= 8) {
+                    *out++ = static_cast<uint8_t>(bits);
+                    bits >>= 8;
+                    nBits -= 8;
+                }
+            }
+        }
+
+        // The width is a template parameter, so every shift and offset is a constant and the loop unrolls into
+        // straight-line code the compiler can vectorize. in must be readable for 8 bytes past the packed values.
+        template<uint8_t Width>
+        void unpack(const uint8_t *in, uint32_t *out) {
+            constexpr uint64_t mask = (uint64_t{ 1 } << Width) - 1;
+#pragma GCC unroll 16
+            for (size_t i = 0; i < PACKED_BLOCK_SIZE; ++i) {
+                uint64_t word;
+                std::memcpy(&word, in + i * Width / 8, sizeof(word));
+                out[i] = static_cast<uint32_t>((word >> (i * Width % 8)) & mask);
+            }
+        }
+
+        using unpack_fn = void (*)(const uint8_t *, uint32_t *);
+
+        template<size_t... Widths>
+        constexpr std::array<unpack_fn, sizeof...(Widths)> makeUnpackers(std::index_sequence<Widths...>) {
+            return { &unpack<static_cast<uint8_t>(Widths)>... };
+        }
+
+        inline constexpr auto UNPACKERS = makeUnpackers(std::make_index_sequence<33>{});
+    }
+
+    // Encode count samples, stored back to back as in a ServerReadingsBatch body, into msg. Returns false if
+    // packing would not make the frame smaller, and msg must not be sent.
+    template<typename Body>
+    bool encodePackedReadings(const uint8_t *samples, size_t count, message<MsgTypes, Body> &msg) {
+        if (count < 2 || count > MAX_SAMPLES_PER_BATCH)
+            return false;
+
+        const size_t rawSize = count * sizeof(readings_sample);
+        const size_t nBlocks = (count - 1 + PACKED_BLOCK_SIZE - 1) / PACKED_BLOCK_SIZE;
+
+        auto &out = msg.body;
+        out.reserve(rawSize);
+
+        auto nSamples = static_cast<uint16_t>(count);
+        out.resize(sizeof(nSamples) + sizeof(readings_sample));
+        std::memcpy(out.data(), &nSamples, sizeof(nSamples));
+        std::memcpy(out.data() + sizeof(nSamples), samples, sizeof(readings_sample));
+
+        readings_sample prev;
+        std::memcpy(&prev, samples, sizeof(prev));
+
+        std::array<std::array<uint32_t, PACKED_BLOCK_SIZE>, PACKED_FIELDS> deltas;
+
+        for (size_t block = 0; block < nBlocks; ++block) {
+            std::array<uint32_t, PACKED_FIELDS> orBits{};
+
+            for (size_t i = 0; i < PACKED_BLOCK_SIZE; ++i) {
+                const size_t index = 1 + block * PACKED_BLOCK_SIZE + i;
+                if (index >= count) {
+                    for (auto &field: deltas)
+                        field[i] = 0;
+                    continue;
+                }
+
+                readings_sample sample;
+                std::memcpy(&sample, samples + index * sizeof(sample), sizeof(sample));
+
+                for (size_t ch = 0; ch < consts::N_CHANNELS; ++ch) {
+                    deltas[ch][i] = detail::zigzag16(static_cast<uint16_t>(sample.readings[ch] - prev.readings[ch]));
+                    orBits[ch] |= deltas[ch][i];
+                }
+                deltas[consts::N_CHANNELS][i] = detail::zigzag32(sample.timestamp - prev.timestamp);
+                orBits[consts::N_CHANNELS] |= deltas[consts::N_CHANNELS][i];
+
+                prev = sample;
+            }
+
+            std::array<uint8_t, PACKED_FIELDS> widths;
+            size_t blockSize = widths.size();
+            for (size_t field = 0; field < PACKED_FIELDS; ++field) {
+                widths[field] = detail::bitWidth(orBits[field]);
+                blockSize += PACKED_BLOCK_SIZE * widths[field] / 8;
+            }
+
+            if (out.size() + blockSize >= rawSize)
+                return false;
+
+            size_t offset = out.size();
+            out.resize(offset + blockSize);
+            std::memcpy(out.data() + offset, widths.data(), widths.size());
+            offset += widths.size();
+
+            for (size_t field = 0; field < PACKED_FIELDS; ++field) {
+                detail::pack(deltas[field].data(), widths[field], out.data() + offset);
+                offset += PACKED_BLOCK_SIZE * widths[field] / 8;
+            }
+        }
+
+        msg.header.id = ServerReadingsPacked;
+        msg.header.size = static_cast<uint32_t>(out.size());
+        return true;
+    }
+
+    // Decode a ServerReadingsPacked message, replacing the content of samples. Throws std::length_error or
+    // std::out_of_range if the body is malformed.
+    template<typename Body>
+    void decodePackedReadings(const message<MsgTypes, Body> &msg, std::vector<readings_sample> &samples) {
+        checkBody<ServerReadingsPacked>(msg);
+        message_reader reader{ msg };
+
+        auto count = reader.read<uint16_t>();
+        if (count == 0 || count > MAX_SAMPLES_PER_BATCH)
+            throw std::length_error("Packed readings with " + std::to_string(count) + " samples");
+
+        samples.resize(count);
+        reader >> samples[0];
+
+        // Room for the unpackers to read past the packed values
+        std::array<uint8_t, PACKED_BLOCK_SIZE * 32 / 8 + sizeof(uint64_t)> packed{};
+        std::array<uint32_t, PACKED_BLOCK_SIZE> deltas;
+
+        for (size_t first = 1; first < count; first += PACKED_BLOCK_SIZE) {
+            const size_t n = std::min(PACKED_BLOCK_SIZE, count - first);
+            const uint8_t *widths = reader.take(PACKED_FIELDS);
+
+            for (size_t field = 0; field < PACKED_FIELDS; ++field) {
+                const uint8_t width = widths[field];
+                if (width > (field < consts::N_CHANNELS ? 16 : 32))
+                    throw std::length_error("Packed readings with bit width " + std::to_string(width));
+
+                const size_t packedSize = PACKED_BLOCK_SIZE * width / 8;
+                std::memcpy(packed.data(), reader.take(packedSize), packedSize);
+                detail::UNPACKERS[width](packed.data(), deltas.data());
+
+                // Prefix sum of the deltas
+                if (field < consts::N_CHANNELS) {
+                    uint16_t value = samples[first - 1].readings[field];
+                    for (size_t i = 0; i < n; ++i) {
+                        value += detail::unzigzag16(deltas[i]);
+                        samples[first + i].readings[field] = value;
+                    }
+                } else {
+                    uint32_t value = samples[first - 1].timestamp;
+                    for (size_t i = 0; i < n; ++i) {
+                        value += detail::unzigzag32(deltas[i]);
+                        samples[first + i].timestamp = value;
+                    }
+                }
+            }
+        }
+
+        if (!reader.empty())
+            throw std::length_error("Packed readings with " + std::to_string(reader.remaining()) + " extra bytes");
+    }
+
+    // The samples of a ServerReadingsPacked message as a ServerReadingsBatch, for the peers that cannot decode it
+    template<typename Body>
+    message<MsgTypes> unpackReadings(const message<MsgTypes, Body> &msg) {
+        std::vector<readings_sample> samples;
+        decodePackedReadings(msg, samples);
+
+        message<MsgTypes> batch;
+        batch.header.id = ServerReadingsBatch;
+        batch.body.reserve(samples.size() * READINGS_SAMPLE_SIZE);
+        for (const auto &sample: samples)
+            appendPayload<ServerReadingsBatch>(batch, sample);
+        return batch;
+    }
+}
+
+#endif //FORTRESS_READINGS_CODEC_H
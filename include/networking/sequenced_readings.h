@@ -0,0 +1,248 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_SEQUENCED_READINGS_H
+#define FORTRESS_SEQUENCED_READINGS_H
+
+#include <bit>
+#include <cstddef>
+#include <vector>
+#include "commons.h"
+#include "message.h"
+#include "message_schema.h"
+#include "shared_frame.h"
+
+namespace fortress::net {
+
+    // A readings frame numbered by the server: one sequence number per frame, shared by all the clients, so that
+    // a client can tell which frames it missed and ask for them again. Laid out as
+    //
+    //   uint32_t                  sequence number
+    //   message_header<MsgTypes>  a readings message id, but ServerSequencedReadings, and the body size
+    //   body
+    //
+    // It is the body of a ServerSequencedReadings message over TCP, and a whole datagram over UDP.
+    struct sequenced_header {
+        uint32_t sequence;
+        message_header<MsgTypes> message;
+    };
+
+    static_assert(sizeof(sequenced_header) == SEQUENCED_HEADER_SIZE, "sequenced_header must not be padded");
+
+    template<typename Body>
+    std::vector<uint8_t> encodeSequenced(uint32_t sequence, const message<MsgTypes, Body> &msg) {
+        sequenced_header header{ sequence, msg.header };
+
+        std::vector<uint8_t> bytes(sizeof(header) + msg.size());
+        std::memcpy(bytes.data(), &header, sizeof(header));
+        std::memcpy(bytes.data() + sizeof(header), msg.body.data(), msg.size());
+        return bytes;
+    }
+
+    template<typename Body>
+    message<MsgTypes> makeSequencedReadings(uint32_t sequence, const message<MsgTypes, Body> &msg) {
+        message<MsgTypes> sequenced;
+        sequenced.header.id = ServerSequencedReadings;
+        sequenced.header.size = static_cast<uint32_t>(sizeof(sequenced_header) + msg.size());
+        sequenced.body.resize(sequenced.header.size);
+
+        sequenced_header header{ sequence, msg.header };
+        std::memcpy(sequenced.body.data(), &header, sizeof(header));
+        std::memcpy(sequenced.body.data() + sizeof(header), msg.body.data(), msg.size());
+        return sequenced;
+    }
+
+    // Check that length bytes laid out as above hold a single readings message matching its schema, and read
+    // its sequence number
+    inline bool isValidSequenced(const uint8_t *data, size_t length, uint32_t &sequence) {
+        sequenced_header header{};
+        if (length < sizeof(header))
+            return false;
+
+        std::memcpy(&header, data, sizeof(header));
+        const uint32_t id = header.message.id;
+        const uint32_t bodySize = header.message.size;
+        if (!isReadings(id) || id == ServerSequencedReadings || bodySize != length - sizeof(header) ||
+            !isValidBody(id, bodySize))
+            return false;
+
+        sequence = header.sequence;
+        return true;
+    }
+
+    // Split length bytes laid out as above into the sequence number and the readings message. Returns false if
+    // they are not valid.
+    inline bool decodeSequenced(const uint8_t *data, size_t length, uint32_t &sequence, message<MsgTypes> &msg) {
+        if (!isValidSequenced(data, length, sequence))
+            return false;
+
+        std::memcpy(&msg.header, data + offsetof(sequenced_header, message), sizeof(msg.header));
+        msg.body.resize(msg.header.size);
+        std::memcpy(msg.body.data(), data + sizeof(sequenced_header), msg.header.size);
+        return true;
+    }
+
+    // Unwrap a ServerSequencedReadings message. Throws std::length_error if it is malformed.
+    template<typename Body>
+    uint32_t decodeSequencedReadings(const message<MsgTypes, Body> &sequenced, message<MsgTypes> &msg) {
+        checkBody<ServerSequencedReadings>(sequenced);
+
+        uint32_t sequence;
+        if (!decodeSequenced(sequenced.body.data(), sequenced.size(), sequence, msg)) {
+            std::stringstream out;
+            out << "Sequenced readings with header " << sequenced.header << " do not hold a readings message";
+            throw std::length_error(out.str());
+        }
+        return sequence;
+    }
+
+    // Loss accounting of a stream of sequenced frames. Frames arriving after a later one are discarded as late, the
+    // readings would be out of order, so a reordered frame is counted as lost and then as late. The last
+    // WINDOW_SIZE frames received are remembered, to tell a late frame received twice (a duplicate) from one that
+    // was overtaken (reordered); older late frames count as reordered. Losses before the first frame received
+    // cannot be seen.
+    // accept() and reset() must be called from a single thread. The getters can be called from any other, e.g. for a
+    // report.
+    class sequence_tracker {
+    public:
+        static constexpr uint32_t WINDOW_SIZE = 64;
+
+    private:
+        std::atomic<uint32_t> m_nExpected{ 0 };
+        std::atomic<bool> m_bStarted{ false };
+        // Bit i is set if frame m_nExpected - 1 - i was received. Only used by the thread calling accept().
+        uint64_t m_window{ 0 };
+
+        std::atomic<uint64_t> m_nReceived{ 0 };
+        std::atomic<uint64_t> m_nLost{ 0 };
+        std::atomic<uint64_t> m_nLate{ 0 };
+        std::atomic<uint64_t> m_nDuplicates{ 0 };
+
+    public:
+        // True if the frame must be delivered
+        bool accept(uint32_t sequence) {
+            if (m_bStarted) {
+                // Signed distance, correct across the wrap around
+                auto gap = static_cast<int32_t>(sequence - m_nExpected);
+                if (gap < 0) {
+                    ++m_nLate;
+                    const auto age = static_cast<uint32_t>(-(gap + 1));
+                    if (age < WINDOW_SIZE) {
+                        const uint64_t bit = uint64_t{ 1 } << age;
+                        if (m_window & bit)
+                            ++m_nDuplicates;
+                        m_window |= bit;
+                    }
+                    return false;
+                }
+                m_nLost += static_cast<uint64_t>(gap);
+                m_window = static_cast<uint32_t>(gap) + 1 < WINDOW_SIZE ? m_window << (gap + 1) : 0;
+            }
+
+            m_bStarted = true;
+            m_nExpected = sequence + 1;
+            m_window |= 1;
+            ++m_nReceived;
+            return true;
+        }
+
+        void reset() {
+            m_bStarted = false;
+            m_window = 0;
+            m_nReceived = m_nLost = m_nLate = m_nDuplicates = 0;
+        }
+
+        [[nodiscard]] bool hasStarted() const {
+            return m_bStarted;
+        }
+
+        // Sequence number of the frame following the last one accepted
+        [[nodiscard]] uint32_t getExpectedSequence() const {
+            return m_nExpected;
+        }
+
+        [[nodiscard]] uint64_t getReceivedCount() const {
+            return m_nReceived;
+        }
+
+        [[nodiscard]] uint64_t getLostCount() const {
+            return m_nLost;
+        }
+
+        // Duplicates and reordered frames
+        [[nodiscard]] uint64_t getLateCount() const {
+            return m_nLate;
+        }
+
+        [[nodiscard]] uint64_t getDuplicateCount() const {
+            return m_nDuplicates;
+        }
+
+        [[nodiscard]] uint64_t getReorderedCount() const {
+            return m_nLate - m_nDuplicates;
+        }
+
+        // Fraction of the frames sent since the first one received that never arrived
+        [[nodiscard]] double getLossRatio() const {
+            uint64_t nLost = m_nLost;
+            uint64_t nTotal = m_nReceived + nLost;
+            return nTotal > 0 ? static_cast<double>(nLost) / static_cast<double>(nTotal) : 0;
+        }
+    };
+
+    // The last frames sent, encoded as ServerSequencedReadings, to be sent again to a client resuming after a
+    // disconnection. Frames are pushed with consecutive sequence numbers; the oldest are overwritten once
+    // capacity frames are stored. The capacity is rounded up to a power of two, so that the slot of a sequence
+    // number stays the same across the wrap around. Not thread safe.
+    class replay_buffer {
+    private:
+        std::vector<shared_frame> m_vFrames;
+        uint32_t m_nNext{ 0 };
+        size_t m_nCount{ 0 };
+
+    public:
+        explicit replay_buffer(size_t capacity) : m_vFrames(std::bit_ceil(std::max<size_t>(capacity, 1))) {}
+
+        // A sequence number not following the last one starts the buffer again
+        void push(uint32_t sequence, shared_frame frame) {
+            if (m_nCount > 0 && sequence != m_nNext)
+                clear();
+
+            m_vFrames[sequence % m_vFrames.size()] = std::move(frame);
+            m_nNext = sequence + 1;
+            m_nCount = std::min(m_nCount + 1, m_vFrames.size());
+        }
+
+        // Sequence number of the oldest frame stored
+        [[nodiscard]] uint32_t oldest() const {
+            return m_nNext - static_cast<uint32_t>(m_nCount);
+        }
+
+        // Sequence number the next frame pushed will have
+        [[nodiscard]] uint32_t next() const {
+            return m_nNext;
+        }
+
+        [[nodiscard]] bool contains(uint32_t sequence) const {
+            return sequence - oldest() < m_nCount;
+        }
+
+        // The frame must be stored
+        [[nodiscard]] const shared_frame &at(uint32_t sequence) const {
+            return m_vFrames[sequence % m_vFrames.size()];
+        }
+
+        void clear() {
+            m_nCount = 0;
+            for (auto &frame: m_vFrames)
+                frame.reset();
+        }
+    };
+}
+
+#endif //FORTRESS_SEQUENCED_READINGS_H
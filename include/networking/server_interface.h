@@ -6,6 +6,8 @@
 #define FORTRESS_SERVER_INTERFACE_H
 
 #include "networking/tcp_connection.h"
+#include "networking/coro_connection.h"
+#include "networking/io_backend.h"
 
 namespace fortress::net {
     class server_interface {
@@ -14,6 +16,13 @@ namespace fortress::net {
         asio::io_context &m_context;
         asio::ip::tcp::acceptor m_acceptor;
         std::deque<std::shared_ptr<tcp_connection>> m_connections;
+        // Connections are accepted and messages sent from different threads
+        std::mutex m_muxConnections;
+
+        // Threads running the asio context
+        std::vector<std::thread> m_threads;
+
+        connection_impl m_connectionImpl{ connection_impl::callbacks };
 
         uint32_t m_id_counter{ 0 };
         uint16_t m_port;
@@ -34,39 +43,92 @@ namespace fortress::net {
 
         virtual ~server_interface() {
             stop();
+
+            // Threads started by run() would never return while the acceptor is waiting
+            if (!m_threads.empty()) {
+                m_context.stop();
+                join();
+            }
         }
 
         void sendMessage(std::shared_ptr<tcp_connection> client, const message<MsgTypes> &msg) {
+            sendMessage(std::move(client), message<MsgTypes>{ msg });
+        }
+
+        void sendMessage(std::shared_ptr<tcp_connection> client, message<MsgTypes> &&msg) {
             if (client && client->isConnected()) {
-                client->send(msg);
+                client->send(std::move(msg));
             } else {
-                onClientDisconnect(client);
-                client.reset();
-                m_connections.erase(std::remove(m_connections.begin(), m_connections.end(), client), m_connections.end());
+                removeClient(client);
             }
         }
 
         void sendMessageToAllClients(const message<MsgTypes> &msg, std::shared_ptr<tcp_connection> pIgnoreClient = nullptr) {
-            bool bInvalidClientExists = false;
+            // Encode the message once, all the clients share the same buffer
+            sendMessageToAllClients(encodeFrame(msg), std::move(pIgnoreClient));
+        }
 
-            // For each client_interface check if it is connected and, if it must be not ignored, send the message to it.
-            // If the client_interface is not
-            for (auto &client : m_connections)
-                if (client && client->isConnected()) {
-                    if (client != pIgnoreClient)
-                        client->send(msg);
-                } else {
+        void sendMessageToAllClients(const shared_frame &frame, std::shared_ptr<tcp_connection> pIgnoreClient = nullptr) {
+            sendMessageToClients(frame, [&pIgnoreClient](const std::shared_ptr<tcp_connection> &client) {
+                return client != pIgnoreClient;
+            });
+        }
+
+        // Send the frame to the connected clients for which bSend(client) is true. bSend is called with the
+        // connection list locked, the frame is sent after releasing it: with the block policy send() may wait for
+        // a slow client, and the other threads must still be able to accept and drop connections meanwhile.
+        template<typename Predicate>
+        void sendMessageToClients(const shared_frame &frame, Predicate bSend) {
+            std::vector<std::shared_ptr<tcp_connection>> selectedClients;
+            std::vector<std::shared_ptr<tcp_connection>> invalidClients;
+
+            {
+                std::scoped_lock lock(m_muxConnections);
+
+                // For each client_interface check if it is connected and if it is selected. Otherwise, collect it
+                // to be removed.
+                for (auto &client : m_connections)
+                    if (client && client->isConnected()) {
+                        if (bSend(client))
+                            selectedClients.push_back(client);
+                    } else {
+                        invalidClients.push_back(client);
+                    }
+
+                for (auto &client : invalidClients)
+                    m_connections.erase(std::remove(m_connections.begin(), m_connections.end(), client),
+                                        m_connections.end());
+            }
+
+            for (auto &client : selectedClients)
+                client->send(frame);
+
+            // Notify outside the lock, the handler may send other messages
+            for (auto &client : invalidClients)
+                if (client)
                     onClientDisconnect(client);
-                    client.reset();
-                    bInvalidClientExists = true;
-                }
+        }
 
-            if (bInvalidClientExists)
-                // Search for connections equal to nullptr e remove it from the connections queue
-                m_connections.erase(
-                        std::remove(m_connections.begin(), m_connections.end(), nullptr),
-                        m_connections.end()
-                );
+        // Used for the connections accepted from now on
+        void setConnectionImpl(connection_impl impl) {
+            m_connectionImpl = impl;
+        }
+
+        // Connections not known to be closed yet
+        size_t getClientsCount() {
+            std::scoped_lock lock(m_muxConnections);
+            return m_connections.size();
+        }
+
+        // Counters of each connection not known to be closed yet
+        std::vector<connection_stats> getConnectionStats() {
+            std::scoped_lock lock(m_muxConnections);
+            std::vector<connection_stats> stats;
+            stats.reserve(m_connections.size());
+            for (auto &client : m_connections)
+                if (client)
+                    stats.push_back(client->getStats());
+            return stats;
         }
 
         bool start() {
@@ -77,23 +139,54 @@ namespace fortress::net {
                 return false;
             }
 
-            std::cout << "[SERVER] Started at port " << m_port << "!\n";
+            std::cout << "[SERVER] Started at port " << m_port << " (" << ioBackendReport() << ")!\n";
             return true;
         }
 
+        // Run the asio context on nThreads threads. Returns immediately.
+        void run(unsigned nThreads = 1) {
+            nThreads = std::max(nThreads, 1u);
+            for (unsigned i = 0; i < nThreads; ++i)
+                m_threads.emplace_back([this]() { m_context.run(); });
+
+            std::cout << "[SERVER] Running on " << nThreads << " thread(s)\n";
+        }
+
+        // Wait for the threads started by run() to finish, i.e. after the context has been stopped
+        void join() {
+            for (auto &thread : m_threads)
+                if (thread.joinable())
+                    thread.join();
+            m_threads.clear();
+        }
+
         void stop() {
             std::cout << "Stopping server...\n";
+            std::scoped_lock lock(m_muxConnections);
             for (auto &conn : m_connections)
                 conn->disconnect();
         }
 
     private:
+        void removeClient(const std::shared_ptr<tcp_connection> &client) {
+            {
+                std::scoped_lock lock(m_muxConnections);
+                m_connections.erase(std::remove(m_connections.begin(), m_connections.end(), client),
+                                    m_connections.end());
+            }
+
+            if (client)
+                onClientDisconnect(client);
+        }
+
         void waitForClientToConnect() {
-            m_acceptor.template async_accept([this](std::error_code ec, asio::ip::tcp::socket socket) {
+            // Each new socket gets its own strand
+            m_acceptor.async_accept(asio::make_strand(m_context), [this](std::error_code ec, asio::ip::tcp::socket socket) {
                 if (!ec) {
                     std::cout << "[SERVER] New Connection from " << socket.remote_endpoint() << '\n';
 
-                    auto newConnection = std::make_shared<tcp_connection>(
+                    auto newConnection = makeConnection(
+                            m_connectionImpl,
                             m_context,
                             std::move(socket),
                             tcp_connection::owner::server,
@@ -101,9 +194,11 @@ namespace fortress::net {
                     );
 
                     if (onClientConnect(newConnection)) {
+                        newConnection->connectToClient(m_id_counter++);
+                        std::cout << "[" << newConnection->getID() << "] Connection Approved\n";
+
+                        std::scoped_lock lock(m_muxConnections);
                         m_connections.push_back(std::move(newConnection));
-                        m_connections.back()->connectToClient(m_id_counter++);
-                        std::cout << "[" << m_connections.back()->getID() << "] Connection Approved\n";
                     } else {
                         std::cout << "[-----] Connection Denied\n";
                     }
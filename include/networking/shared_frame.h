@@ -0,0 +1,54 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_SHARED_FRAME_H
+#define FORTRESS_SHARED_FRAME_H
+
+#include "commons.h"
+#include "message.h"
+
+namespace fortress::net {
+
+    // A message already encoded as it goes on the wire (header followed by body). It is immutable, so the same
+    // frame can be queued by any number of connections without copying it.
+    using shared_frame = std::shared_ptr<const std::vector<uint8_t>>;
+
+    template<typename T, typename Body>
+    shared_frame encodeFrame(const message<T, Body> &msg) {
+        std::vector<uint8_t> bytes(sizeof(message_header<T>) + msg.size());
+        std::memcpy(bytes.data(), &msg.header, sizeof(message_header<T>));
+        std::memcpy(bytes.data() + sizeof(message_header<T>), msg.body.data(), msg.size());
+        return std::make_shared<const std::vector<uint8_t>>(std::move(bytes));
+    }
+
+    // Element of a connection outbound queue: a message owned by the connection or, if frame is set, a frame
+    // shared with other connections
+    struct outbound_message {
+        message<MsgTypes> msg;
+        shared_frame frame;
+
+        [[nodiscard]] MsgTypes id() const {
+            if (!frame)
+                return msg.header.id;
+
+            message_header<MsgTypes> header;
+            std::memcpy(&header, frame->data(), sizeof(header));
+            return header.id;
+        }
+
+        [[nodiscard]] const uint8_t *bodyData() const {
+            return frame ? frame->data() + sizeof(message_header<MsgTypes>) : msg.body.data();
+        }
+
+        [[nodiscard]] size_t bodySize() const {
+            return frame ? frame->size() - sizeof(message_header<MsgTypes>) : msg.body.size();
+        }
+    };
+}
+
+#endif //FORTRESS_SHARED_FRAME_H
@@ -0,0 +1,453 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_SHM_CHANNEL_H
+#define FORTRESS_SHM_CHANNEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include "commons.h"
+#include "message.h"
+#include "message_schema.h"
+#include "shared_frame.h"
+
+namespace fortress::net {
+
+    // When the server runs on the same host as the client, the readings can be handed over through shared memory
+    // instead of the loopback socket. Control messages always go over the TCP connection.
+    //
+    // The client creates a ring buffer in a POSIX shared memory object and sends its name with
+    // ClientOpenSharedMemoryChannel (an empty name closes the channel). From then on the server writes every
+    // readings frame in the ring, framed as on TCP: the message header followed by the body. The frames are the
+    // ServerSequencedReadings messages the server would send over TCP.
+    //
+    // A single producer and a single consumer: the server writes from its strand and the client reads from its
+    // own. The consumer sleeps on a futex in the ring when it is empty, the producer only makes the system call
+    // when the consumer says it is waiting. A full ring drops the frame, as a full TCP queue would.
+
+    // Names are created by the client, under this prefix only, so the server cannot be made to open anything else
+    constexpr const char *SHM_NAME_PREFIX = "/fortress-";
+
+    // About a second of frames at 10 kHz with single-sample frames, many more when batched
+    constexpr size_t SHM_RING_CAPACITY = 1 << 20;
+
+    namespace detail {
+        inline void futexWait(std::atomic<uint32_t> &word, uint32_t expected, std::chrono::microseconds timeout) {
+#if defined(__linux__)
+            static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+            timespec ts{ static_cast<time_t>(timeout.count() / 1'000'000),
+                         static_cast<long>(timeout.count() % 1'000'000 * 1000) };
+            // Not FUTEX_PRIVATE_FLAG: the word is shared with another process
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+#else
+            // No cross-process futex: poll
+            if (word.load() == expected)
+                std::this_thread::sleep_for(std::min(timeout, std::chrono::microseconds(100)));
+#endif
+        }
+
+        inline void futexWakeAll(std::atomic<uint32_t> &word) {
+#if defined(__linux__)
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+        }
+    }
+
+    // The ring as laid out in the shared memory: this header, then the capacity bytes of the frames. Positions
+    // grow forever and are taken modulo the capacity.
+    struct shm_ring_header {
+        static constexpr uint32_t MAGIC = 0x46525348;  // "FRSH"
+        static constexpr uint32_t VERSION = 1;
+
+        uint32_t magic;
+        uint32_t version;
+        uint64_t capacity;
+
+        alignas(64) std::atomic<uint64_t> head{ 0 };    // Written by the producer
+        alignas(64) std::atomic<uint64_t> tail{ 0 };    // Written by the consumer
+        alignas(64) std::atomic<uint32_t> signal{ 0 };  // Futex word, bumped to wake the consumer
+        std::atomic<uint32_t> bWaiting{ 0 };           // The consumer is about to sleep or sleeping
+        std::atomic<uint32_t> bClosed{ 0 };
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+                  "The ring positions are shared between processes, they cannot be guarded by a lock");
+
+    class shm_ring {
+    private:
+        std::string m_name;
+        bool m_bOwner;
+        void *m_pMapping{ nullptr };
+        size_t m_nMappingSize{ 0 };
+        shm_ring_header *m_pHeader{ nullptr };
+        uint8_t *m_pData{ nullptr };
+        uint64_t m_nMask{ 0 };
+
+        // A microsecond or so of polling before sleeping on the futex
+        static constexpr int SPIN_ITERATIONS = 1000;
+
+        shm_ring(std::string name, bool bOwner) : m_name{ std::move(name) }, m_bOwner{ bOwner } {}
+
+    public:
+        shm_ring(const shm_ring &) = delete;
+
+        shm_ring &operator=(const shm_ring &) = delete;
+
+        ~shm_ring() {
+            if (m_pMapping != nullptr)
+                munmap(m_pMapping, m_nMappingSize);
+            if (m_bOwner)
+                shm_unlink(m_name.c_str());
+        }
+
+        // Consumer side: the object is removed when the ring is destroyed. Capacity must be a power of two.
+        static std::unique_ptr<shm_ring> create(const std::string &name, size_t capacity = SHM_RING_CAPACITY) {
+            if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+                throw std::invalid_argument("Shared memory ring capacity must be a power of two");
+
+            int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd < 0)
+                throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+
+            std::unique_ptr<shm_ring> ring{ new shm_ring(name, true) };
+            const size_t size = sizeof(shm_ring_header) + capacity;
+            if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+                int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "ftruncate " + name);
+            }
+
+            ring->map(fd, size);
+            auto *header = new(ring->m_pMapping) shm_ring_header{};
+            header->magic = shm_ring_header::MAGIC;
+            header->version = shm_ring_header::VERSION;
+            header->capacity = capacity;
+            ring->attach();
+            return ring;
+        }
+
+        // Producer side: opens a ring created by create()
+        static std::unique_ptr<shm_ring> open(const std::string &name) {
+            int fd = shm_open(name.c_str(), O_RDWR, 0);
+            if (fd < 0)
+                throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+
+            struct stat st{};
+            if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(shm_ring_header)) {
+                ::close(fd);
+                throw std::runtime_error("Not a shared memory ring: " + name);
+            }
+
+            std::unique_ptr<shm_ring> ring{ new shm_ring(name, false) };
+            ring->map(fd, static_cast<size_t>(st.st_size));
+
+            const auto *header = static_cast<const shm_ring_header *>(ring->m_pMapping);
+            const uint64_t capacity = header->capacity;
+            if (header->magic != shm_ring_header::MAGIC || header->version != shm_ring_header::VERSION ||
+                capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+                sizeof(shm_ring_header) + capacity != ring->m_nMappingSize)
+                throw std::runtime_error("Not a shared memory ring: " + name);
+
+            ring->attach();
+            return ring;
+        }
+
+        [[nodiscard]] const std::string &name() const {
+            return m_name;
+        }
+
+        [[nodiscard]] size_t capacity() const {
+            return m_nMask + 1;
+        }
+
+        // ---- Producer ----
+
+        // Writes the whole frame or nothing. Returns false if the ring has no room for it.
+        bool tryWrite(const uint8_t *data, size_t size) {
+            const uint64_t head = m_pHeader->head.load(std::memory_order_relaxed);
+            const uint64_t tail = m_pHeader->tail.load(std::memory_order_acquire);
+            if (size > capacity() - (head - tail))
+                return false;
+
+            copyIn(head, data, size);
+            // Sequentially consistent with the load of bWaiting, which the consumer stores before checking head
+            m_pHeader->head.store(head + size, std::memory_order_seq_cst);
+            if (m_pHeader->bWaiting.load(std::memory_order_seq_cst)) {
+                m_pHeader->signal.fetch_add(1, std::memory_order_seq_cst);
+                detail::futexWakeAll(m_pHeader->signal);
+            }
+            return true;
+        }
+
+        // ---- Consumer ----
+
+        [[nodiscard]] bool empty() const {
+            return m_pHeader->head.load(std::memory_order_acquire) ==
+                   m_pHeader->tail.load(std::memory_order_relaxed);
+        }
+
+        // Reads the next frame into msg. Returns false if the ring is empty, throws if the producer wrote something
+        // that is not a valid frame, after which the ring cannot be read any more.
+        bool tryRead(message<MsgTypes> &msg) {
+            const uint64_t tail = m_pHeader->tail.load(std::memory_order_relaxed);
+            const uint64_t head = m_pHeader->head.load(std::memory_order_acquire);
+            if (head == tail)
+                return false;
+
+            const uint64_t available = head - tail;
+            if (available < sizeof(msg.header) || available > capacity())
+                throw std::length_error("Corrupted shared memory ring");
+
+            copyOut(tail, &msg.header, sizeof(msg.header));
+            if (!isValidBody(msg.header.id, msg.header.size) || sizeof(msg.header) + msg.header.size > available)
+                throw std::length_error("Invalid frame in shared memory ring");
+
+            msg.body.resize(msg.header.size);
+            copyOut(tail + sizeof(msg.header), msg.body.data(), msg.header.size);
+            m_pHeader->tail.store(tail + sizeof(msg.header) + msg.header.size, std::memory_order_release);
+            return true;
+        }
+
+        // Sleep until the ring is not empty, closed or the timeout expires. Returns true if there is something to
+        // read.
+        bool wait(std::chrono::microseconds timeout) {
+            // A frame following closely the previous one is picked up without the cost of sleeping
+            for (int i = 0; i < SPIN_ITERATIONS; ++i)
+                if (!empty())
+                    return true;
+
+            const uint32_t signal = m_pHeader->signal.load(std::memory_order_seq_cst);
+            m_pHeader->bWaiting.store(1, std::memory_order_seq_cst);
+            // Either the producer sees bWaiting and bumps the signal, or we see its head here
+            if (empty() && !isClosed())
+                detail::futexWait(m_pHeader->signal, signal, timeout);
+            m_pHeader->bWaiting.store(0, std::memory_order_relaxed);
+            return !empty();
+        }
+
+        // Wake up the consumer for good
+        void close() {
+            m_pHeader->bClosed.store(1, std::memory_order_seq_cst);
+            m_pHeader->signal.fetch_add(1, std::memory_order_seq_cst);
+            detail::futexWakeAll(m_pHeader->signal);
+        }
+
+        [[nodiscard]] bool isClosed() const {
+            return m_pHeader->bClosed.load(std::memory_order_acquire) != 0;
+        }
+
+    private:
+        void map(int fd, size_t size) {
+            m_pMapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            int error = errno;
+            ::close(fd);
+            if (m_pMapping == MAP_FAILED) {
+                m_pMapping = nullptr;
+                throw std::system_error(error, std::generic_category(), "mmap " + m_name);
+            }
+            m_nMappingSize = size;
+        }
+
+        void attach() {
+            m_pHeader = static_cast<shm_ring_header *>(m_pMapping);
+            m_pData = static_cast<uint8_t *>(m_pMapping) + sizeof(shm_ring_header);
+            m_nMask = m_pHeader->capacity - 1;
+        }
+
+        // A frame wrapping around the end of the ring is copied in two parts
+        void copyIn(uint64_t position, const void *data, size_t size) {
+            const size_t offset = position & m_nMask;
+            const size_t first = std::min(size, capacity() - offset);
+            std::memcpy(m_pData + offset, data, first);
+            std::memcpy(m_pData, static_cast<const uint8_t *>(data) + first, size - first);
+        }
+
+        void copyOut(uint64_t position, void *data, size_t size) const {
+            const size_t offset = position & m_nMask;
+            const size_t first = std::min(size, capacity() - offset);
+            std::memcpy(data, m_pData + offset, first);
+            std::memcpy(static_cast<uint8_t *>(data) + first, m_pData, size - first);
+        }
+    };
+
+    // Server side: writes the encoded frames in the ring of one client. Must be used from a single thread at a
+    // time, the server strand.
+    class shm_sender {
+    private:
+        std::unique_ptr<shm_ring> m_ring;
+
+        uint64_t m_nSent{ 0 };
+        uint64_t m_nDropped{ 0 };
+
+    public:
+        explicit shm_sender(const std::string &name) {
+            if (name.rfind(SHM_NAME_PREFIX, 0) != 0 || name.find('/', 1) != std::string::npos)
+                throw std::invalid_argument("Not a fortress shared memory name: " + name);
+            m_ring = shm_ring::open(name);
+        }
+
+        // The frame is shared, it can be written in many rings at once
+        void send(const shared_frame &frame) {
+            if (m_ring->tryWrite(frame->data(), frame->size()))
+                ++m_nSent;
+            else
+                ++m_nDropped;
+        }
+
+        [[nodiscard]] const std::string &name() const {
+            return m_ring->name();
+        }
+
+        [[nodiscard]] uint64_t getSentCount() const {
+            return m_nSent;
+        }
+
+        // Frames that found the ring full: the client is not reading fast enough
+        [[nodiscard]] uint64_t getDroppedCount() const {
+            return m_nDropped;
+        }
+    };
+
+    // Client side: creates the ring and delivers its frames as the ServerSequencedReadings messages they would be over
+    // TCP. A thread sleeps on the ring and posts a drain to the executor when frames arrive, so onMessage runs on
+    // the strand of the connection as for the other channels. Frames that are not sequenced readings are rejected.
+    // Close it before letting it go, and before the executor is destroyed.
+    class shm_receiver : public std::enable_shared_from_this<shm_receiver> {
+    private:
+        using executor_type = asio::strand<asio::io_context::executor_type>;
+
+        executor_type m_executor;
+        std::unique_ptr<shm_ring> m_ring;
+        std::function<void(message<MsgTypes> &)> m_onMessageCallback;
+        message<MsgTypes> m_message;
+
+        std::thread m_thread;
+        std::atomic<bool> m_bStop{ false };
+        // One drain in flight at a time: the thread waits for it before sleeping on the ring again
+        std::mutex m_muxDrain;
+        std::condition_variable m_cvDrain;
+        bool m_bDraining{ false };
+
+        std::atomic<uint64_t> m_nReceived{ 0 };
+        std::atomic<uint64_t> m_nRejected{ 0 };
+
+        // Short enough to notice close() if a wake-up is missed, long enough to cost nothing while idle
+        static constexpr std::chrono::microseconds WAIT_TIMEOUT{ 50'000 };
+        // Frames per drain, so that a busy ring does not hold back the TCP connection sharing the strand
+        static constexpr size_t MAX_FRAMES_PER_DRAIN = 256;
+
+    public:
+        shm_receiver(const executor_type &executor, std::function<void(message<MsgTypes> &)> callback) :
+                m_executor{ executor },
+                m_ring{ shm_ring::create(makeName()) },
+                m_onMessageCallback{ std::move(callback) } {
+            m_message.body.reserve(SEQUENCED_HEADER_SIZE + MAX_BATCH_BODY_SIZE);
+        }
+
+        ~shm_receiver() {
+            close();
+            if (m_thread.joinable())
+                m_thread.join();
+        }
+
+        // To send to the server with ClientOpenSharedMemoryChannel
+        [[nodiscard]] const std::string &name() const {
+            return m_ring->name();
+        }
+
+        void start() {
+            m_thread = std::thread([this]() { waitLoop(); });
+        }
+
+        // Safe to call from any thread, including the executor
+        void close() {
+            if (!m_bStop.exchange(true)) {
+                m_ring->close();
+                std::scoped_lock lock(m_muxDrain);
+                m_cvDrain.notify_all();
+            }
+        }
+
+        // Start counting again, for a new acquisition session
+        void resetCounters() {
+            m_nReceived = 0;
+            m_nRejected = 0;
+        }
+
+        [[nodiscard]] uint64_t getReceivedCount() const {
+            return m_nReceived;
+        }
+
+        [[nodiscard]] uint64_t getRejectedCount() const {
+            return m_nRejected;
+        }
+
+    private:
+        static std::string makeName() {
+            static std::atomic<uint32_t> nRings{ 0 };
+            return SHM_NAME_PREFIX + std::to_string(getpid()) + '-' + std::to_string(nRings++);
+        }
+
+        void waitLoop() {
+            while (!m_bStop) {
+                if (!m_ring->wait(WAIT_TIMEOUT))
+                    continue;
+
+                {
+                    std::scoped_lock lock(m_muxDrain);
+                    m_bDraining = true;
+                }
+                // The thread never owns the receiver, so the destructor can always join it
+                asio::post(m_executor, [weak = weak_from_this()]() {
+                    if (auto self = weak.lock())
+                        self->drain();
+                });
+
+                std::unique_lock lock(m_muxDrain);
+                m_cvDrain.wait(lock, [this]() { return !m_bDraining || m_bStop; });
+            }
+        }
+
+        void drain() {
+            try {
+                for (size_t i = 0; i < MAX_FRAMES_PER_DRAIN && !m_bStop && m_ring->tryRead(m_message); ++i) {
+                    if (m_message.header.id != ServerSequencedReadings) {
+                        ++m_nRejected;
+                        continue;
+                    }
+                    ++m_nReceived;
+                    m_onMessageCallback(m_message);
+                }
+            } catch (std::exception const &e) {
+                // The frame boundaries are lost, nothing more can be read from the ring
+                std::cerr << "Shared memory channel: " << e.what() << '\n';
+                close();
+            }
+
+            std::scoped_lock lock(m_muxDrain);
+            m_bDraining = false;
+            m_cvDrain.notify_all();
+        }
+    };
+}
+
+#endif //FORTRESS_SHM_CHANNEL_H
@@ -0,0 +1,191 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_SPSC_QUEUE_H
+#define FORTRESS_SPSC_QUEUE_H
+
+#include <algorithm>
+#include "commons.h"
+
+namespace fortress::net {
+
+    // Bounded lock-free queue for exactly one producer thread and one consumer thread.
+    // Items live in a preallocated ring of slots, so pushing and popping never allocate. The capacity is rounded up
+    // to a power of two. Besides the non-blocking try_push/try_pop, wait_push/wait_pop block the calling thread until
+    // there is room or an item is available, or until stopWaiting() is called.
+    template<typename T>
+    class spsc_queue {
+
+    private:
+        // Keep the indices written by different threads on different cache lines
+        static constexpr size_t CACHE_LINE_SIZE = 64;
+
+        const size_t m_capacity;
+        const size_t m_mask;
+        std::unique_ptr<T[]> m_slots;
+
+        // Written by the consumer only
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_head{ 0 };
+        size_t m_cachedTail{ 0 };
+
+        // Written by the producer only
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_tail{ 0 };
+        size_t m_cachedHead{ 0 };
+
+        // Blocking waits sleep on a wake-up counter, bumped by the other side only if a thread announced it is waiting
+        alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> m_nProducerWakeups{ 0 };
+        std::atomic<bool> m_bProducerWaiting{ false };
+        std::atomic<uint32_t> m_nConsumerWakeups{ 0 };
+        std::atomic<bool> m_bConsumerWaiting{ false };
+        std::atomic<bool> m_bForceAwake{ false };
+
+    public:
+        explicit spsc_queue(size_t capacity) :
+                m_capacity{ roundUpToPowerOfTwo(capacity) },
+                m_mask{ m_capacity - 1 },
+                m_slots{ std::make_unique<T[]>(m_capacity) } {}
+
+        spsc_queue(const spsc_queue<T> &) = delete;
+
+        spsc_queue &operator=(const spsc_queue<T> &) = delete;
+
+        // ---- Producer ----
+
+        template<typename U>
+        bool try_push(U &&item) {
+            const size_t tail = m_tail.load(std::memory_order_relaxed);
+
+            if (tail - m_cachedHead == m_capacity) {
+                // Looks full, refresh the consumer position
+                m_cachedHead = m_head.load(std::memory_order_acquire);
+                if (tail - m_cachedHead == m_capacity)
+                    return false;
+            }
+
+            m_slots[tail & m_mask] = std::forward<U>(item);
+            m_tail.store(tail + 1, std::memory_order_release);
+            wake(m_nConsumerWakeups, m_bConsumerWaiting);
+            return true;
+        }
+
+        // Block until there is room for the item. Returns false if stopWaiting() has been called.
+        template<typename U>
+        bool wait_push(U &&item) {
+            return waitUntil([&]() { return try_push(std::forward<U>(item)); }, m_nProducerWakeups, m_bProducerWaiting);
+        }
+
+        // ---- Consumer ----
+
+        // Pointer to the oldest item, or nullptr if the queue is empty. Valid until pop_front().
+        T *front() {
+            const size_t head = m_head.load(std::memory_order_relaxed);
+
+            if (head == m_cachedTail) {
+                m_cachedTail = m_tail.load(std::memory_order_acquire);
+                if (head == m_cachedTail)
+                    return nullptr;
+            }
+
+            return &m_slots[head & m_mask];
+        }
+
+        // Remove the oldest item. The queue must not be empty.
+        void pop_front() {
+            const size_t head = m_head.load(std::memory_order_relaxed);
+            // Release the resources held by the item now rather than when the slot is reused
+            m_slots[head & m_mask] = T{};
+            m_head.store(head + 1, std::memory_order_release);
+            wake(m_nProducerWakeups, m_bProducerWaiting);
+        }
+
+        bool try_pop(T &item) {
+            T *pItem = front();
+            if (pItem == nullptr)
+                return false;
+
+            item = std::move(*pItem);
+            pop_front();
+            return true;
+        }
+
+        // Block until an item is available. Returns false if stopWaiting() has been called.
+        bool wait_pop(T &item) {
+            return waitUntil([&]() { return try_pop(item); }, m_nConsumerWakeups, m_bConsumerWaiting);
+        }
+
+        // ---- Both ----
+
+        // Exact when called by the producer or the consumer while the other is idle. Approximate otherwise, and from
+        // any other thread, e.g. for a report: the head is read first so that the tail read after it is never behind,
+        // and the result is clamped to the capacity the consumer may have freed in between.
+        [[nodiscard]] size_t count() const {
+            const size_t head = m_head.load(std::memory_order_acquire);
+            const size_t tail = m_tail.load(std::memory_order_acquire);
+            return std::min(tail - head, m_capacity);
+        }
+
+        [[nodiscard]] bool empty() const {
+            return count() == 0;
+        }
+
+        [[nodiscard]] size_t capacity() const {
+            return m_capacity;
+        }
+
+        // Wake up and return from any blocking wait, and make the following ones fail
+        void stopWaiting() {
+            m_bForceAwake.store(true, std::memory_order_release);
+
+            m_nProducerWakeups.fetch_add(1, std::memory_order_release);
+            m_nProducerWakeups.notify_all();
+            m_nConsumerWakeups.fetch_add(1, std::memory_order_release);
+            m_nConsumerWakeups.notify_all();
+        }
+
+    private:
+        // The fences order the index update against the check of the waiting flag here, and the flag update against
+        // the last attempt in waitUntil, so that either the waiter sees the new index or we see it waiting
+        static void wake(std::atomic<uint32_t> &wakeups, std::atomic<bool> &waiting) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiting.load(std::memory_order_relaxed)) {
+                wakeups.fetch_add(1, std::memory_order_release);
+                wakeups.notify_one();
+            }
+        }
+
+        template<typename Attempt>
+        bool waitUntil(Attempt attempt, std::atomic<uint32_t> &wakeups, std::atomic<bool> &waiting) {
+            while (!attempt()) {
+                uint32_t nWakeups = wakeups.load(std::memory_order_acquire);
+                if (m_bForceAwake.load(std::memory_order_acquire))
+                    return false;
+
+                waiting.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                if (attempt()) {
+                    waiting.store(false, std::memory_order_relaxed);
+                    return true;
+                }
+
+                wakeups.wait(nWakeups, std::memory_order_acquire);
+                waiting.store(false, std::memory_order_relaxed);
+            }
+            return true;
+        }
+
+        static size_t roundUpToPowerOfTwo(size_t n) {
+            size_t capacity = 1;
+            while (capacity < n)
+                capacity <<= 1;
+            return capacity;
+        }
+    };
+}
+
+#endif //FORTRESS_SPSC_QUEUE_H
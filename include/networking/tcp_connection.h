@@ -6,10 +6,16 @@
 #define FORTRESS_TCP_CONNECTION_H
 
 #include <utility>
+#include <optional>
+#include <algorithm>
 
 #include "commons.h"
 #include "message.h"
-#include "threadsafe_queue.h"
+#include "message_schema.h"
+#include "spsc_queue.h"
+#include "shared_frame.h"
+#include "latency_histogram.h"
+#include "connection_stats.h"
 #include "constants.h"
 
 namespace fortress::net {
@@ -23,46 +29,152 @@ namespace fortress::net {
             client
         };
 
+        // How inbound messages are read from the socket:
+        // - exact: one async_read for the header and one for the body of each message
+        // - stream: async_read_some into a receive buffer, then every complete message in the buffer is parsed
+        enum class read_mode {
+            exact,
+            stream
+        };
+
+        // Must fit the largest message
+        static constexpr size_t READ_BUFFER_SIZE = 16 * 1024;
+
+        // A message that does not match the schema of its id, e.g. one added by a newer version of the remote, is
+        // skipped as long as its body is no larger than this. A larger one means that we lost track of the message
+        // boundaries, and the connection is closed.
+        static constexpr uint32_t MAX_SKIPPED_BODY_SIZE = READ_BUFFER_SIZE - sizeof(message_header<MsgTypes>);
+
+        // A message whose bytes arrive further apart than this counts as a read stall
+        static constexpr std::chrono::milliseconds READ_STALL_THRESHOLD{ 1 };
+
+        // What to do with readings when the outbound queue reaches the high-water mark because the remote is not
+        // keeping up. Control messages are never dropped.
+        // - block: send() blocks the caller until the messages pending drop below the mark. Only for producers of
+        //   their own: a caller running on a thread of the io_context could be holding back the very writer it waits
+        //   for, so it falls back to drop_oldest.
+        // - drop_oldest: the oldest queued readings are dropped, down to half the mark
+        // - coalesce: queued ServerReadings and ServerReadingsBatch messages are merged into batches of up to
+        //   MAX_SAMPLES_PER_BATCH samples; if the queue is still above the mark, the oldest readings are dropped.
+        //   Batches are far from full at the usual rates (5 samples per 50 ms at 100 Hz), so merging them frees most
+        //   of the queue. ServerSequencedReadings and ServerReadingsPacked cannot be merged without decoding them:
+        //   they are only dropped, as with drop_oldest.
+        enum class overflow_policy {
+            block,
+            drop_oldest,
+            coalesce
+        };
+
+        // Maximum number of messages waiting to be written
+        static constexpr size_t OUT_QUEUE_CAPACITY = 1024;
+
+        // The high-water mark is at most half the capacity, so above it there is always room for control messages
+        static constexpr size_t DEFAULT_HIGH_WATER_MARK = 256;
+
     protected:
         // This context is shared with the whole asio instance
         asio::io_context &m_asioContext;
 
-        // Each connection has a unique socket to a remote
+        // Each connection has a unique socket to a remote. The socket is created on a strand, so that all the
+        // handlers of the connection are serialized even when the context runs on many threads.
         asio::ip::tcp::socket m_socket;
         owner m_owner;
         std::function<void(owned_message<MsgTypes> &)> m_onMessageCallback;
         std::function<void()> m_onConnectionDropped;
+        read_mode m_readMode;
+        // Mirrors the socket state for the threads other than the strand, which must not touch the socket
+        std::atomic<bool> m_bConnected{ false };
 
         message<MsgTypes> m_tempInMessage;
-        ts_queue<message<MsgTypes>> m_qMessagesOut;
+        // Only accessed from the connection strand, by send() and by the writer
+        spsc_queue<outbound_message> m_qMessagesOut{ OUT_QUEUE_CAPACITY };
         uint32_t m_id{ 0 };
-
+        // Written once when connected, then published by m_bRemoteKnown to the other threads
+        asio::ip::address m_remoteAddress;
+        std::atomic<bool> m_bRemoteKnown{ false };
+
+        // Messages being written by the pending async_write and the buffers pointing to their header and body
+        std::vector<outbound_message> m_vMessagesInFlight;
+        std::vector<asio::const_buffer> m_vBuffersInFlight;
+
+        // Number of async_write issued and messages written, to measure how many messages a write coalesces
+        std::atomic<uint64_t> m_nWrites{ 0 };
+        std::atomic<uint64_t> m_nMessagesWritten{ 0 };
+        std::atomic<uint64_t> m_nBytesWritten{ 0 };
+        // Time from issuing each write to its completion
+        std::chrono::steady_clock::time_point m_writeStart;
+        latency_histogram m_writeTimes;
+        // Readings dropped and merged by the overflow policy
+        std::atomic<uint64_t> m_nMessagesDropped{ 0 };
+        std::atomic<uint64_t> m_nMessagesCoalesced{ 0 };
+
+        std::atomic<overflow_policy> m_overflowPolicy{ overflow_policy::drop_oldest };
+        std::atomic<size_t> m_nHighWaterMark{ DEFAULT_HIGH_WATER_MARK };
+
+        // Messages sent and not written yet, either posted to the strand, queued or in flight, and the maximum reached
+        std::atomic<size_t> m_nPending{ 0 };
+        std::atomic<size_t> m_nPeakPending{ 0 };
+
+        // Producers blocked by the block policy wait for the writer to make room
+        std::mutex m_muxBlocked;
+        std::condition_variable m_cvBlocked;
+        std::atomic<uint32_t> m_nBlockedProducers{ 0 };
+
+        // Used to rebuild the outbound queue when shedding readings
+        std::vector<outbound_message> m_vShedScratch;
+
+        // Receive buffer of the stream mode. Bytes in [m_nReadBegin, m_nReadEnd) are not parsed yet.
+        std::vector<uint8_t> m_vReadBuffer;
+        size_t m_nReadBegin{ 0 };
+        size_t m_nReadEnd{ 0 };
+
+        // Number of completed reads and messages read
+        std::atomic<uint64_t> m_nReads{ 0 };
+        std::atomic<uint64_t> m_nMessagesRead{ 0 };
+        std::atomic<uint64_t> m_nBytesRead{ 0 };
+        // Set while a message has been partly read
+        std::optional<std::chrono::steady_clock::time_point> m_partialReadStart;
+        std::atomic<uint64_t> m_nReadStalls{ 0 };
+
+        // Round trip times of the pings to the remote, recorded by the owner of the connection
+        latency_histogram m_roundTripTimes;
 
     public:
         tcp_connection(asio::io_context &asioContext,
                        asio::ip::tcp::socket socket,
                        tcp_connection::owner owner,
                        std::function<void(owned_message<MsgTypes> &)> callback,
-                       std::function<void()> onConnectionDropped = nullptr
+                       std::function<void()> onConnectionDropped = nullptr,
+                       read_mode readMode = read_mode::exact
         ) :
                 m_asioContext{ asioContext },
                 m_socket{ std::move(socket) },
                 m_owner{ owner },
                 m_onMessageCallback(std::move(callback)),
-                m_onConnectionDropped(std::move(onConnectionDropped)) {}
+                m_onConnectionDropped(std::move(onConnectionDropped)),
+                m_readMode{ readMode },
+                m_bConnected{ m_socket.is_open() } {}
+
+        virtual ~tcp_connection() = default;
 
         [[nodiscard]] bool isConnected() const {
-            return m_socket.is_open();
+            return m_bConnected.load(std::memory_order_acquire);
         }
 
         void connectToServer(const asio::ip::tcp::resolver::results_type &endpoints) {
+            m_bConnected = true;
             asio::async_connect(m_socket, endpoints,
-                                [this](std::error_code ec, const asio::ip::tcp::endpoint &endpoint) {
+                                [this, self = shared_from_this()](std::error_code ec,
+                                                                  const asio::ip::tcp::endpoint &endpoint) {
                                     if (!ec) {
                                         std::cout << "Connected to: " << endpoint.address().to_string() << '\n';
-                                        readHeader();
+                                        m_remoteAddress = endpoint.address();
+                                        m_bRemoteKnown.store(true, std::memory_order_release);
+                                        disableNagle();
+                                        startReading();
                                     } else {
                                         std::cout << "Failed to connected with error: " << ec.message() << std::endl;
+                                        m_bConnected = false;
                                         m_socket.close();
                                     }
                                 });
@@ -71,24 +183,37 @@ namespace fortress::net {
         void connectToClient(uint32_t nID) {
             if (m_socket.is_open()) {
                 m_id = nID;
-                readHeader();
+                asio::error_code ec;
+                m_remoteAddress = m_socket.remote_endpoint(ec).address();
+                m_bRemoteKnown.store(true, std::memory_order_release);
+                m_bConnected = true;
+                disableNagle();
+                startReading();
             }
         }
 
+        // Safe to call from any thread: the shutdown runs on the connection strand, after the messages already sent
         void disconnect() {
-            if (isConnected()) {
-                // https://stackoverflow.com/a/3068106/6882933
-                m_socket.shutdown(asio::socket_base::shutdown_both);
-                std::cout << "Shutdown socket\n";
-            }
+            asio::post(m_socket.get_executor(), [this, self = shared_from_this()]() {
+                if (m_socket.is_open()) {
+                    // https://stackoverflow.com/a/3068106/6882933
+                    m_socket.shutdown(asio::socket_base::shutdown_both);
+                    std::cout << "Shutdown socket\n";
+                }
+            });
         }
 
+        // Once m_bConnected is false the owner may drop the connection from another thread: every handler and posted
+        // lambda holds self, so that this and the handlers still queued run on a live object
         void closeSocket() {
             if (m_socket.is_open()) {
+                m_bConnected = false;
                 m_socket.close();
+                notifyBlockedProducers();
 
                 assert(!m_socket.is_open());
                 std::cout << "Close socket\n";
+                onSocketClosed();
                 if (m_onConnectionDropped != nullptr)
                     m_onConnectionDropped();
             }
@@ -96,96 +221,503 @@ namespace fortress::net {
 
     public:
         void send(const message<MsgTypes> &msg) {
-            // Post the message to the asio context
-            asio::post(m_asioContext, [this, msg]() {
+            send(message<MsgTypes>{ msg });
+        }
 
-                bool isWritingMessage = !m_qMessagesOut.empty();
-                m_qMessagesOut.push_back(msg);
+        void send(message<MsgTypes> &&msg) {
+            if (!admit(msg.header.id))
+                return;
 
-                // If the queue was not empty before inserting a new message, asio is still busy to finish sending
-                // previous messages
-                if (!isWritingMessage)
-                    writeHeader();
+            // Post the message to the connection strand
+            asio::post(m_socket.get_executor(), [this, self = shared_from_this(), msg = std::move(msg)]() mutable {
+                enqueue(outbound_message{ std::move(msg), nullptr });
             });
         }
 
+        // Send a frame encoded once and shared with other connections
+        void send(shared_frame frame) {
+            outbound_message outMsg{ {}, std::move(frame) };
+            if (!admit(outMsg.id()))
+                return;
+
+            asio::post(m_socket.get_executor(),
+                       [this, self = shared_from_this(), outMsg = std::move(outMsg)]() mutable {
+                           enqueue(std::move(outMsg));
+                       });
+        }
+
+        // The high-water mark is clamped to [2, OUT_QUEUE_CAPACITY / 2]
+        void setOverflowPolicy(overflow_policy policy, size_t highWaterMark = DEFAULT_HIGH_WATER_MARK) {
+            m_overflowPolicy = policy;
+            m_nHighWaterMark = std::clamp<size_t>(highWaterMark, 2, OUT_QUEUE_CAPACITY / 2);
+            notifyBlockedProducers();
+        }
+
+        [[nodiscard]] overflow_policy getOverflowPolicy() const {
+            return m_overflowPolicy;
+        }
+
+        [[nodiscard]] size_t getHighWaterMark() const {
+            return m_nHighWaterMark;
+        }
+
         uint32_t getID() const {
             return m_id;
         }
 
+        // Unspecified until connected
+        [[nodiscard]] asio::ip::address getRemoteAddress() const {
+            return m_bRemoteKnown.load(std::memory_order_acquire) ? m_remoteAddress : asio::ip::address{};
+        }
+
+        [[nodiscard]] uint64_t getWritesCount() const {
+            return m_nWrites;
+        }
+
+        [[nodiscard]] uint64_t getMessagesWrittenCount() const {
+            return m_nMessagesWritten;
+        }
+
+        // Average number of messages coalesced by a single write
+        [[nodiscard]] double getMessagesPerWrite() const {
+            uint64_t nWrites = m_nWrites;
+            return nWrites > 0 ? static_cast<double>(m_nMessagesWritten) / static_cast<double>(nWrites) : 0;
+        }
+
+        [[nodiscard]] uint64_t getMessagesDroppedCount() const {
+            return m_nMessagesDropped;
+        }
+
+        [[nodiscard]] uint64_t getMessagesCoalescedCount() const {
+            return m_nMessagesCoalesced;
+        }
+
+        latency_histogram &getRoundTripTimes() {
+            return m_roundTripTimes;
+        }
+
+        [[nodiscard]] const latency_histogram &getRoundTripTimes() const {
+            return m_roundTripTimes;
+        }
+
+        // Messages sent and not written yet
+        [[nodiscard]] size_t getQueueDepth() const {
+            return m_nPending;
+        }
+
+        [[nodiscard]] size_t getPeakQueueDepth() const {
+            return m_nPeakPending;
+        }
+
+        [[nodiscard]] uint64_t getReadsCount() const {
+            return m_nReads;
+        }
+
+        [[nodiscard]] uint64_t getMessagesReadCount() const {
+            return m_nMessagesRead;
+        }
+
+        // Safe to call from any thread
+        [[nodiscard]] connection_stats getStats() const {
+            return { m_id, std::chrono::steady_clock::now(),
+                     m_nBytesRead, m_nBytesWritten, m_nMessagesRead, m_nMessagesWritten, m_nReads, m_nWrites,
+                     m_nPending, m_nPeakPending, m_nHighWaterMark, m_nMessagesDropped, m_nMessagesCoalesced,
+                     m_writeTimes.getSummary(), m_nReadStalls };
+        }
+
+    private:
+        // A write already gathers all the queued messages: holding the last segment back until the previous ones
+        // are acknowledged would only delay the readings, by up to the remote delayed ACK timeout
+        void disableNagle() {
+            asio::error_code ec;
+            m_socket.set_option(asio::ip::tcp::no_delay(true), ec);
+        }
+
+        [[nodiscard]] bool isOnContextThread() const {
+            return m_asioContext.get_executor().running_in_this_thread();
+        }
+
+        // Account for a message about to be posted. With the block policy, wait for room before posting readings.
+        // Otherwise readings are refused if the strand is so far behind that the messages posted to it alone would
+        // fill the queue: the policy only applies once they are queued.
+        bool admit(MsgTypes id) {
+            if (isReadings(id)) {
+                if (m_overflowPolicy == overflow_policy::block && !isOnContextThread()) {
+                    waitForRoom();
+                } else if (m_nPending >= OUT_QUEUE_CAPACITY) {
+                    countDropped(1);
+                    return false;
+                }
+            }
+
+            size_t nPending = ++m_nPending;
+            size_t nPeak = m_nPeakPending.load(std::memory_order_relaxed);
+            while (nPending > nPeak && !m_nPeakPending.compare_exchange_weak(nPeak, nPending, std::memory_order_relaxed));
+            return true;
+        }
+
+        void waitForRoom() {
+            if (m_nPending < m_nHighWaterMark)
+                return;
+
+            // Announce the wait before checking again under the lock, so that release() either sees us waiting or we
+            // see the room it made
+            ++m_nBlockedProducers;
+            {
+                std::unique_lock lock(m_muxBlocked);
+                m_cvBlocked.wait(lock, [this]() { return m_nPending < m_nHighWaterMark || !isConnected(); });
+            }
+            --m_nBlockedProducers;
+        }
+
+        // Called when nMessages messages leave the connection: written, dropped or merged into another one
+        void release(size_t nMessages) {
+            m_nPending -= nMessages;
+            if (m_nBlockedProducers > 0)
+                notifyBlockedProducers();
+        }
+
+        void notifyBlockedProducers() {
+            std::scoped_lock lock(m_muxBlocked);
+            m_cvBlocked.notify_all();
+        }
+
+        void enqueue(outbound_message &&outMsg) {
+            if (m_qMessagesOut.count() >= m_nHighWaterMark)
+                shedReadings();
+
+            if (!m_qMessagesOut.try_push(std::move(outMsg))) {
+                // Nothing left to shed: the remote is not even reading the control messages
+                std::cout << '[' << m_id << "] Outbound queue full of control messages, closing connection\n";
+                release(1);
+                closeSocket();
+                return;
+            }
+
+            onMessageQueued();
+        }
+
+    protected:
+        // The read and write loops. Derived classes can replace them, using the helpers below to share the queue,
+        // the overflow policies and the parsing with this implementation.
+
+        virtual void startReading() {
+            if (m_readMode == read_mode::stream) {
+                m_vReadBuffer.resize(READ_BUFFER_SIZE);
+                m_nReadBegin = m_nReadEnd = 0;
+                readSome();
+            } else {
+                readHeader();
+            }
+        }
+
+        // Called on the strand after a message has been queued
+        virtual void onMessageQueued() {
+            // If there are messages in flight, asio is still busy to finish sending previous messages and the
+            // new one will be written right after
+            if (m_vMessagesInFlight.empty())
+                write();
+        }
+
+        // Called on the strand when the socket has been closed
+        virtual void onSocketClosed() {}
+
+        // Move all the queued messages in flight and point the write buffers to their headers and bodies
+        void takeMessagesInFlight() {
+            while (auto *msg = m_qMessagesOut.front()) {
+                m_vMessagesInFlight.push_back(std::move(*msg));
+                m_qMessagesOut.pop_front();
+            }
+
+            m_writeStart = std::chrono::steady_clock::now();
+            m_vBuffersInFlight.clear();
+            for (const auto &[msg, frame]: m_vMessagesInFlight) {
+                if (frame) {
+                    m_vBuffersInFlight.push_back(asio::buffer(*frame));
+                    continue;
+                }
+
+                m_vBuffersInFlight.push_back(asio::buffer(&msg.header, sizeof(message_header<MsgTypes>)));
+                if (!msg.body.empty())
+                    m_vBuffersInFlight.push_back(asio::buffer(msg.body.data(), msg.body.size()));
+            }
+        }
+
+        void onMessagesWritten(size_t length) {
+            m_writeTimes.record(std::chrono::steady_clock::now() - m_writeStart);
+            ++m_nWrites;
+            m_nMessagesWritten += m_vMessagesInFlight.size();
+            m_nBytesWritten += length;
+            release(m_vMessagesInFlight.size());
+            m_vMessagesInFlight.clear();
+        }
+
+        void onWriteFailed(const asio::error_code &ec) {
+            switch (ec.value()) {
+                case asio::error::broken_pipe:
+                    std::cout << "Pipe closed\n";
+                    break;
+                default:
+                    std::cout << '[' << m_id << "] Write failed: " << ec.message() << '\n';
+                    break;
+            }
+            // FIXME: Here should turn off the client in case of connection drop
+            closeSocket();
+        }
+
+        // Move the partial message left by the previous read at the beginning of the buffer, so that every
+        // message is contiguous and there is always room for a whole one
+        void compactReadBuffer() {
+            if (m_nReadBegin > 0) {
+                std::memmove(m_vReadBuffer.data(), m_vReadBuffer.data() + m_nReadBegin, m_nReadEnd - m_nReadBegin);
+                m_nReadEnd -= m_nReadBegin;
+                m_nReadBegin = 0;
+            }
+        }
+
+        // Dispatch all the complete messages in the receive buffer. Throws std::length_error if the stream is
+        // corrupt: nothing after that can be parsed.
+        void parseMessages() {
+            constexpr size_t headerSize = sizeof(message_header<MsgTypes>);
+
+            while (m_nReadEnd - m_nReadBegin >= headerSize) {
+                const uint8_t *data = m_vReadBuffer.data() + m_nReadBegin;
+
+                std::memcpy(&m_tempInMessage.header, data, headerSize);
+                const header_check check = checkHeader(m_tempInMessage.header);
+                if (check == header_check::corrupt)
+                    throw std::length_error(describeHeader(m_tempInMessage.header, check));
+
+                // Wait for the rest of the body
+                if (m_nReadEnd - m_nReadBegin < headerSize + m_tempInMessage.header.size)
+                    break;
+                onMessageComplete();
+
+                if (check == header_check::skip) {
+                    std::cerr << describeHeader(m_tempInMessage.header, check) << '\n';
+                    m_nReadBegin += headerSize + m_tempInMessage.header.size;
+                    continue;
+                }
+
+                m_tempInMessage.body.resize(m_tempInMessage.header.size);
+                std::memcpy(m_tempInMessage.body.data(), data + headerSize, m_tempInMessage.header.size);
+                m_nReadBegin += headerSize + m_tempInMessage.header.size;
+
+                onMessage();
+            }
+
+            if (m_nReadEnd > m_nReadBegin)
+                onMessagePartlyRead();
+        }
+
+        // Called when a read ends inside a message, and when the message is complete
+        void onMessagePartlyRead() {
+            if (!m_partialReadStart)
+                m_partialReadStart = std::chrono::steady_clock::now();
+        }
+
+        void onMessageComplete() {
+            if (m_partialReadStart) {
+                if (std::chrono::steady_clock::now() - *m_partialReadStart > READ_STALL_THRESHOLD)
+                    ++m_nReadStalls;
+                m_partialReadStart.reset();
+            }
+        }
+
+        enum class header_check {
+            valid,      // Matches the schema of the message
+            skip,       // Does not, the body is read and discarded to stay in step with the stream
+            corrupt     // Cannot be the header of a message
+        };
+
+        static header_check checkHeader(const message_header<MsgTypes> &header) {
+            if (isValidBody(header.id, header.size))
+                return header_check::valid;
+            return header.size <= MAX_SKIPPED_BODY_SIZE ? header_check::skip : header_check::corrupt;
+        }
+
+        static std::string describeHeader(const message_header<MsgTypes> &header, header_check check) {
+            std::stringstream out;
+            out << "Message with header " << header
+                << (check == header_check::corrupt ? " is corrupt, lost track of the message boundaries."
+                                                   : " discarded.");
+            return out.str();
+        }
+
+        void onMessage() {
+            owned_message<MsgTypes> message;
+            if (m_owner == owner::server) {
+                message.remote = this->shared_from_this();
+            }
+
+            message.message = m_tempInMessage;
+            ++m_nMessagesRead;
+            m_onMessageCallback(message);
+        }
+
     private:
-        void writeHeader() {
-            asio::async_write(m_socket, asio::buffer(&m_qMessagesOut.front().header, sizeof(message_header<MsgTypes>)),
-                              [this](std::error_code ec, std::size_t length) {
+        // Take all the queued messages and write headers and bodies with a single scatter/gather operation
+        void write() {
+            takeMessagesInFlight();
+
+            asio::async_write(m_socket, m_vBuffersInFlight,
+                              [this, self = shared_from_this()](asio::error_code ec, std::size_t length) {
                                   if (!ec) {
-                                      if (!m_qMessagesOut.front().body.empty())
-                                          writeBody();
-                                      else {
-                                          // If the message is empty pop it out from the queue
-                                          m_qMessagesOut.pop_front();
-
-                                          // If the queue is not empty, there are other messages to send
-                                          // and issue the task sending the next header
-                                          if (!m_qMessagesOut.empty())
-                                              writeHeader();
-                                      }
+                                      onMessagesWritten(length);
+
+                                      // Messages queued while writing are sent with the next write
+                                      if (!m_qMessagesOut.empty())
+                                          write();
                                       return;
                                   }
 
-                                  switch (ec.value()) {
-                                      case asio::error::broken_pipe:
-                                          std::cout << "Pipe closed\n";
-                                          break;
-                                      default:
-                                          std::cout << '[' << m_id << "] Write header failed: " << ec.message() << '\n';
-                                          break;
-                                  }
-                                  // FIXME: Here should turn off the client in case of connection drop
-                                  closeSocket();
+                                  onWriteFailed(ec);
                               });
         }
 
-        void writeBody() {
-            asio::async_write(
-                    m_socket, asio::buffer(m_qMessagesOut.front().body.data(), m_qMessagesOut.front().body.size()),
-                    [this](std::error_code ec, std::size_t length) {
-                        if (!ec) {
-                            // If the message body has been successfully written into the socket,
-                            // pop it out from the queue
-                            m_qMessagesOut.pop_front();
+        // Make room in the outbound queue according to the overflow policy. The strand owns both ends of the queue,
+        // so it can be rebuilt in place.
+        void shedReadings() {
+            m_vShedScratch.clear();
+            while (auto *msg = m_qMessagesOut.front()) {
+                m_vShedScratch.push_back(std::move(*msg));
+                m_qMessagesOut.pop_front();
+            }
+
+            if (m_overflowPolicy == overflow_policy::coalesce)
+                coalesceReadings(m_vShedScratch);
+
+            // Drop the oldest readings down to the low-water mark
+            const size_t highWaterMark = m_nHighWaterMark;
+            size_t nToDrop = m_vShedScratch.size() >= highWaterMark ? m_vShedScratch.size() - highWaterMark / 2 : 0;
+            size_t nDropped = 0;
+
+            for (auto &msg: m_vShedScratch) {
+                if (nDropped < nToDrop && isReadings(msg.id())) {
+                    ++nDropped;
+                    continue;
+                }
+                // Always fits, there are fewer messages than before
+                m_qMessagesOut.try_push(std::move(msg));
+            }
+            m_vShedScratch.clear();
+
+            if (nDropped > 0) {
+                countDropped(nDropped);
+                release(nDropped);
+            }
+        }
+
+        void countDropped(size_t nDropped) {
+            if (m_nMessagesDropped.fetch_add(nDropped) == 0)
+                std::cout << '[' << m_id << "] Remote not keeping up, dropping readings\n";
+        }
+
+        // Merge runs of consecutive raw readings into ServerReadingsBatch messages, as long as the body size allows.
+        // Numbered and packed readings are left as they are.
+        void coalesceReadings(std::vector<outbound_message> &messages) {
+            size_t nOut = 0;
+            size_t nMerged = 0;
+            // Index of the readings message the next ones can be appended to, if any
+            std::optional<size_t> batchIndex;
+
+            for (size_t i = 0; i < messages.size(); ++i) {
+                auto &msg = messages[i];
+
+                if (msg.id() != ServerReadings && msg.id() != ServerReadingsBatch) {
+                    batchIndex.reset();
+                } else if (batchIndex && messages[*batchIndex].bodySize() + msg.bodySize() <= MAX_BATCH_BODY_SIZE) {
+                    appendReadings(messages[*batchIndex], msg);
+                    ++nMerged;
+                    continue;
+                } else {
+                    batchIndex = nOut;
+                }
+
+                if (i != nOut)
+                    messages[nOut] = std::move(msg);
+                ++nOut;
+            }
+
+            messages.resize(nOut);
 
-                            // If the queue is still not empty, write the next message header
-                            if (!m_qMessagesOut.empty())
-                                writeHeader();
+            if (nMerged > 0) {
+                m_nMessagesCoalesced += nMerged;
+                release(nMerged);
+            }
+        }
 
-                        } else {
-                            std::cout << '[' << m_id << "] Write body failed: " << ec.message() << '\n';
-                            // FIXME: Here should turn off the client in case of connection drop
-                            closeSocket();
-                        }
-                    });
+        static void appendReadings(outbound_message &batch, const outbound_message &readings) {
+            // A shared frame cannot be modified, and a single sample must become a batch: make an owned copy
+            if (batch.frame || batch.msg.header.id != ServerReadingsBatch) {
+                message<MsgTypes> msg;
+                msg.header.id = ServerReadingsBatch;
+                msg.body.reserve(MAX_BATCH_BODY_SIZE);
+                msg.body.assign(batch.bodyData(), batch.bodySize());
+                batch = outbound_message{ std::move(msg), nullptr };
+            }
+
+            auto &body = batch.msg.body;
+            const size_t offset = body.size();
+            body.resize(offset + readings.bodySize());
+            std::memcpy(body.data() + offset, readings.bodyData(), readings.bodySize());
+            batch.msg.header.size = static_cast<uint32_t>(body.size());
         }
 
+        void readSome() {
+            compactReadBuffer();
+
+            m_socket.async_read_some(asio::buffer(m_vReadBuffer.data() + m_nReadEnd, m_vReadBuffer.size() - m_nReadEnd),
+                                     [this, self = shared_from_this()](std::error_code ec, std::size_t length) {
+                                         if (!ec) {
+                                             ++m_nReads;
+                                             m_nBytesRead += length;
+                                             m_nReadEnd += length;
+
+                                             try {
+                                                 parseMessages();
+                                             } catch (std::exception const &e) {
+                                                 // Any byte received from now on could be parsed as a header
+                                                 std::cerr << "Caught exception: " << e.what() << '\n';
+                                                 closeSocket();
+                                                 return;
+                                             }
+
+                                             readSome();
+                                         } else {
+                                             std::cout << "Read failed: " << ec.message() << '\n';
+                                             // FIXME: Here should turn off the client in case of connection drop
+                                             closeSocket();
+                                         }
+                                     });
+        }
 
         void readHeader() {
             asio::async_read(m_socket, asio::buffer(&m_tempInMessage.header, sizeof(message_header<MsgTypes>)),
-                             [this](std::error_code ec, std::size_t length) {
+                             [this, self = shared_from_this()](std::error_code ec, std::size_t length) {
 
                                  try {
                                      if (!ec) {
-                                         if (m_tempInMessage.header.id > fortress::net::MsgTypes::MessageAll ||
-                                             m_tempInMessage.header.size > 128) {
-                                             std::stringstream out;
-                                             out << "Message with header " << m_tempInMessage.header
-                                                 << " discarded.";
-                                             throw std::length_error(out.str());
+                                         ++m_nReads;
+                                         m_nBytesRead += length;
+                                         const header_check check = checkHeader(m_tempInMessage.header);
+                                         if (check == header_check::corrupt) {
+                                             std::cerr << describeHeader(m_tempInMessage.header, check) << '\n';
+                                             closeSocket();
+                                             return;
                                          }
 
+                                         const bool bValid = check == header_check::valid;
+                                         if (!bValid)
+                                             std::cerr << describeHeader(m_tempInMessage.header, check) << '\n';
+
                                          if (m_tempInMessage.header.size > 0) {
                                              m_tempInMessage.body.resize(m_tempInMessage.header.size);
-                                             readBody();
+                                             onMessagePartlyRead();
+                                             readBody(bValid);
                                          } else {
-                                             onMessage();
+                                             if (bValid)
+                                                 onMessage();
                                              readHeader();
                                              m_tempInMessage.body.clear();
                                          }
@@ -204,11 +736,15 @@ namespace fortress::net {
 
         }
 
-        void readBody() {
+        void readBody(bool bDispatch = true) {
             asio::async_read(m_socket, asio::buffer(m_tempInMessage.body.data(), m_tempInMessage.body.size()),
-                             [this](std::error_code ec, std::size_t length) {
+                             [this, self = shared_from_this(), bDispatch](std::error_code ec, std::size_t length) {
                                  if (!ec) {
-                                     onMessage();
+                                     ++m_nReads;
+                                     m_nBytesRead += length;
+                                     onMessageComplete();
+                                     if (bDispatch)
+                                         onMessage();
                                      readHeader();
                                      m_tempInMessage.body.clear();
                                  } else {
@@ -218,17 +754,6 @@ namespace fortress::net {
                                  }
                              });
         }
-
-        void onMessage() {
-            owned_message<MsgTypes> message;
-            if (m_owner == owner::server) {
-                message.remote = this->shared_from_this();
-            }
-
-            message.message = m_tempInMessage;
-            m_onMessageCallback(message);
-        }
-
     };
 
 }
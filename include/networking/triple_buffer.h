@@ -0,0 +1,76 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#ifndef FORTRESS_TRIPLE_BUFFER_H
+#define FORTRESS_TRIPLE_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace fortress::net {
+
+    // Hands the latest value from one producer thread to one consumer thread without locks. The producer fills the
+    // back slot and publishes it, the consumer reads the front slot and picks the latest one published with
+    // update(). Each side only ever touches its own slot, and the third one is swapped in with a single exchange, so
+    // neither waits for the other. Values published while the consumer does not look are skipped.
+    template<typename T>
+    class triple_buffer {
+
+    private:
+        static constexpr size_t CACHE_LINE_SIZE = 64;
+        static constexpr uint8_t INDEX_MASK = 0x3;
+        static constexpr uint8_t FRESH = 0x4;       // Published and not picked yet
+
+        std::array<T, 3> m_slots{};
+
+        // Index of the slot between the two sides, with the FRESH bit
+        alignas(CACHE_LINE_SIZE) std::atomic<uint8_t> m_middle{ 1 };
+        alignas(CACHE_LINE_SIZE) uint8_t m_back{ 0 };     // Producer only
+        alignas(CACHE_LINE_SIZE) uint8_t m_front{ 2 };    // Consumer only
+
+    public:
+        triple_buffer() = default;
+
+        triple_buffer(const triple_buffer<T> &) = delete;
+
+        triple_buffer &operator=(const triple_buffer<T> &) = delete;
+
+        // ---- Producer ----
+
+        // The slot to fill. It holds an older value, not the one last published.
+        T &back() {
+            return m_slots[m_back];
+        }
+
+        void publish() {
+            m_back = m_middle.exchange(m_back | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+        }
+
+        // ---- Consumer ----
+
+        // Pick the latest value published, if any since the last call. Returns true if the front slot changed.
+        bool update() {
+            if (!(m_middle.load(std::memory_order_relaxed) & FRESH))
+                return false;
+
+            m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & INDEX_MASK;
+            return true;
+        }
+
+        [[nodiscard]] T &front() {
+            return m_slots[m_front];
+        }
+
+        [[nodiscard]] const T &front() const {
+            return m_slots[m_front];
+        }
+    };
+}
+
+#endif //FORTRESS_TRIPLE_BUFFER_H
@@ -21,11 +21,7 @@ public:
             m_pPingTimer{ std::make_unique<asio::steady_timer>(io_context, PING_DELAY) } {};
 
     void sendPing() {
-        message<MsgTypes> msg;
-        msg.header.id = ServerPing;
-        auto now = std::chrono::system_clock::now();
-        msg << now;
-        sendMessage(msg);
+        sendMessage(makeMessage<ServerPing>({ std::chrono::steady_clock::now() }));
     }
 
     void togglePing() {
@@ -51,10 +47,8 @@ public:
         std::cout << "New message: " << msg << '\n';
         switch (msg.header.id) {
             case ::ServerPing: {
-                std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
-                std::chrono::system_clock::time_point timeThen;
-
-                msg >> timeThen;
+                std::chrono::steady_clock::time_point timeNow = std::chrono::steady_clock::now();
+                std::chrono::steady_clock::time_point timeThen = decodePayload<ServerPing>(msg).time;
                 auto ping = std::chrono::duration<double>(timeNow - timeThen).count() * 1000;
                 std::cout << "Ping: " << ping << '\n';
             }
@@ -17,6 +17,7 @@ ToolBar {
     property bool bIpIsValid: false
     property bool bIsPortValid: true    // Workaround for default port
     property bool bIsConnecting: false
+    property bool bIsReconnecting: false    // The session goes on across the reconnection
     property bool bIsReceiving: false
     property bool bIsSaveEnabled: false
     property bool bHasSaved: true
@@ -37,22 +38,44 @@ ToolBar {
 
         function onConnectionStatusChanged(bIsConnected) {
             console.log(bIsConnected ? "Connected to host" : "Disconnected from host")
-            changeStatus(bIsConnected ? "connected" : "disconnected")
-            bIsConnecting = false
-            bIsReceiving = false
-            if (!bHasSaved) {
-                saveAlert.show();
+            if (bIsReconnecting) {
+                if (bIsConnected) {
+                    bIsReconnecting = false
+                    changeStatus("connected")
+                }
+                return
             }
+            updateConnectionStatus(bIsConnected)
+        }
+
+        function onReconnecting(attempt, delay) {
+            console.log(`Reconnecting in ${delay} ms, attempt ${attempt}`)
+            bIsReconnecting = true
+            statusLabel.text = `Status: Reconnecting (attempt ${attempt})...`
+            statusIcon.color = "orange"
         }
 
         function onConnectionLost() {
             console.log("Connection lost!")
+            if (bIsReconnecting) {
+                bIsReconnecting = false
+                updateConnectionStatus(false)
+            }
             statusBar.text = "Connection to ESP32 lost"
             bIsSaveEnabled = true;
 
         }
     }
 
+    function updateConnectionStatus(bIsConnected) {
+        changeStatus(bIsConnected ? "connected" : "disconnected")
+        bIsConnecting = false
+        bIsReceiving = false
+        if (!bHasSaved) {
+            saveAlert.show();
+        }
+    }
+
     height: 150
     RowLayout {
         anchors.fill: parent
@@ -168,6 +191,26 @@ ToolBar {
                     console.log(`Show ADC values: ${ChartModel.showADCValues}`)
                 }
             }
+
+            CheckBox {
+                text: qsTr("Readings over UDP")
+                checkState: Qt.Unchecked
+                enabled: !bIsReceiving
+                onCheckStateChanged: {
+                    Backend.bUseDatagrams = this.checkState === Qt.Checked
+                    console.log(`Readings over UDP: ${Backend.bUseDatagrams}`)
+                }
+            }
+
+            CheckBox {
+                text: qsTr("Readings over shared memory")
+                checkState: Qt.Unchecked
+                enabled: !bIsReceiving
+                onCheckStateChanged: {
+                    Backend.bUseSharedMemory = this.checkState === Qt.Checked
+                    console.log(`Readings over shared memory: ${Backend.bUseSharedMemory}`)
+                }
+            }
         }
         ColumnLayout {
             Layout.fillWidth: true
@@ -300,6 +343,7 @@ ToolBar {
 
     function connect() {
         bIsConnecting = true
+        bIsReconnecting = false
         console.log("Attempting to connect...")
         changeStatus("connecting")
 
@@ -25,6 +25,7 @@ ApplicationWindow {
 //    property double threshold: 1024
 //    property double thresholdIntegral: 100 * 1024
     property double ping: -1.0
+    property var pingPercentiles: null
     property bool isShowingADC: false;
 
 
@@ -169,6 +170,20 @@ ApplicationWindow {
                     id: pingLabel
                     text: ping > 0 ? `Ping: ${ping.toFixed(3)} ms` : "Ping: -- ms"
                     color: "lightgray"
+
+                    // Tail latency of the session, a click starts counting again
+                    ToolTip.visible: pingMouseArea.containsMouse && pingPercentiles !== null
+                    ToolTip.text: pingPercentiles ? `p50 ${pingPercentiles.p50.toFixed(3)} ms\n`
+                                                    + `p90 ${pingPercentiles.p90.toFixed(3)} ms\n`
+                                                    + `p99 ${pingPercentiles.p99.toFixed(3)} ms\n`
+                                                    + `max ${pingPercentiles.max.toFixed(3)} ms` : ""
+
+                    MouseArea {
+                        id: pingMouseArea
+                        anchors.fill: parent
+                        hoverEnabled: true
+                        onClicked: Backend.resetPingStatistics()
+                    }
                 }
             }
             Layout.fillWidth: true
@@ -182,6 +197,12 @@ ApplicationWindow {
         repeat: true
         onTriggered: {
             ping = Backend.dPingValue
+            pingPercentiles = isFinite(Backend.dPingP50) ? {
+                p50: Backend.dPingP50,
+                p90: Backend.dPingP90,
+                p99: Backend.dPingP99,
+                max: Backend.dPingMax
+            } : null
         }
     }
 
@@ -200,9 +221,11 @@ ApplicationWindow {
         target: Backend
         function onConnectionStatusChanged(bIsConnected) {
             if (bIsConnected){
+                Backend.resetPingStatistics()
                 Backend.togglePingUpdate()
             } else {
                 ping = -1.0
+                pingPercentiles = null
             }
         }
 
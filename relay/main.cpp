@@ -0,0 +1,62 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#include <iostream>
+#include <map>
+#include "FRRelay.h"
+#include "argparse.h"
+
+
+using namespace fortress::net;
+
+int main(int argc, char *argv[]) {
+    ArgumentParser parser(argc, argv);
+    parser.addArgument<int>("port", 60001);                                 // Port the viewers connect to
+    parser.addArgument<std::string>("device", "127.0.0.1");                 // Address of the device
+    parser.addArgument<int>("device_port", 60000);
+    parser.addArgument<int>("threads", 2);                                  // Threads running the asio context
+    parser.addArgument<int>("coro", 0);                                     // Coroutine connections, 1 to enable
+    parser.addArgument<std::string>("policy", "drop");                      // Slow viewers: drop or coalesce
+    parser.addArgument<int>("hwm", tcp_connection::DEFAULT_HIGH_WATER_MARK); // Outbound queue high-water mark
+    parser.parseArguments();
+
+    const std::map<std::string, tcp_connection::overflow_policy> policies{
+            { "drop",     tcp_connection::overflow_policy::drop_oldest },
+            { "coalesce", tcp_connection::overflow_policy::coalesce }
+    };
+    auto policy = policies.find(parser.getValue<std::string>("policy"));
+    if (policy == policies.end()) {
+        std::cerr << "Unknown policy " << parser.getValue<std::string>("policy") << '\n';
+        return 1;
+    }
+
+    // ---- ASIO Context ----
+    asio::io_context ioContext;
+
+    FRRelay relay(ioContext, parser.getValue<int>("port"), parser.getValue<std::string>("device"),
+                  parser.getValue<int>("device_port"));
+    relay.setOverflowPolicy(policy->second, parser.getValue<int>("hwm"));
+    relay.setConnectionImpl(parser.getValue<int>("coro") != 0 ? connection_impl::coroutines
+                                                               : connection_impl::callbacks);
+
+    if (!relay.start())
+        return 1;
+    relay.run(parser.getValue<int>("threads"));
+
+    char ch{};
+
+    while (ch != 'q') {
+        std::cout << "Press q to quit.\n";
+        std::cin >> ch;
+    }
+
+    ioContext.stop();
+    relay.join();
+
+    return 0;
+}
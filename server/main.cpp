@@ -8,6 +8,7 @@
 
 #include <iostream>
 #include <array>
+#include <map>
 #include "FRServer.h"
 #include "argparse.h"
 #include "ValueNoise1D.h"
@@ -22,33 +23,70 @@ std::atomic_bool bRunPingThread;
 
 ValueNoise1D valueNoise1D;
 
+// Emulate the charge integrators: readings ramp up and are reset when crossing the threshold
+constexpr uint16_t kIntegratorThreshold = 65500;
+RawReadings_t readings{};
+
 
 void update(FRServer *server) {
     static int t;
-    message<MsgTypes> msg;
-    msg.header.id = ServerReadings;
-    msg << valueNoise1D.eval(static_cast<double>(t))
-    << valueNoise1D.eval(static_cast<double>(t + 42))
-    << valueNoise1D.eval(static_cast<double>(t + 666) + 0.3)
-    << valueNoise1D.eval(static_cast<double>(t - 123) + 0.1);
-
-    server->sendMessageToAllClients(msg);
+
+    for (size_t ch = 0; ch < readings.size(); ++ch) {
+        readings[ch] += static_cast<uint16_t>(valueNoise1D.eval(static_cast<double>(t) + 42.3 * ch) * 30);
+        if (readings[ch] > kIntegratorThreshold)
+            readings[ch] -= kIntegratorThreshold;
+    }
+
+    server->sendReadings(readings);
     ++t;
 }
 
 int main(int argc, char *argv[]) {
     ArgumentParser parser(argc, argv);
     parser.addArgument<int>("port", 60000);
+    parser.addArgument<int>("threads", 1);                                  // Threads running the asio context
+    parser.addArgument<int>("batch", MAX_SAMPLES_PER_BATCH);                // Max samples per frame, 0 to disable
+    parser.addArgument<int>("batch_ms", DEFAULT_BATCH_SPAN_MICROS / 1000);  // Max time span of a frame
+    parser.addArgument<int>("pack", 1);                                     // Delta + bit-pack batches, 0 to disable
+    parser.addArgument<int>("udp", 1);                                      // Readings over UDP on request, 0 to disable
+    parser.addArgument<int>("shm", 1);                                      // Readings through shared memory on request
+    parser.addArgument<int>("ping", 0);                                     // Ping the clients every second, 1 to enable
+    parser.addArgument<int>("stats", 10);                                   // Print connection counters every n s, 0 never
+    parser.addArgument<int>("coro", 0);                                     // Coroutine connections, 1 to enable
+    parser.addArgument<std::string>("policy", "drop");                      // Slow clients: drop or coalesce
+    parser.addArgument<int>("hwm", tcp_connection::DEFAULT_HIGH_WATER_MARK); // Outbound queue high-water mark
     parser.parseArguments();
 
+    const std::map<std::string, tcp_connection::overflow_policy> policies{
+            { "drop",     tcp_connection::overflow_policy::drop_oldest },
+            { "coalesce", tcp_connection::overflow_policy::coalesce }
+    };
+    auto policy = policies.find(parser.getValue<std::string>("policy"));
+    if (policy == policies.end()) {
+        std::cerr << "Unknown policy " << parser.getValue<std::string>("policy") << '\n';
+        return 1;
+    }
+
     // ---- ASIO Context ----
     asio::io_context ioContext;
 
     FRServer server(ioContext, parser.getValue<int>("port"), &update);
+    server.setReadingsBatching(parser.getValue<int>("batch"), parser.getValue<int>("batch_ms") * 1000);
+    server.setReadingsPacking(parser.getValue<int>("pack") != 0);
+    server.setDatagramsEnabled(parser.getValue<int>("udp") != 0);
+    server.setSharedMemoryEnabled(parser.getValue<int>("shm") != 0);
+    server.setOverflowPolicy(policy->second, parser.getValue<int>("hwm"));
+    server.setConnectionImpl(parser.getValue<int>("coro") != 0 ? connection_impl::coroutines
+                                                                : connection_impl::callbacks);
 
     server.start();
+    server.run(parser.getValue<int>("threads"));
+
+    // The round trip percentiles are printed with every ping and when a client disconnects
+    if (parser.getValue<int>("ping") != 0)
+        server.togglePingUpdate();
 
-    std::thread t([&ioContext]() { ioContext.run(); });
+    server.printStatsEvery(asio::chrono::seconds(parser.getValue<int>("stats")));
 
     char ch{};
 
@@ -58,7 +96,7 @@ int main(int argc, char *argv[]) {
     }
 
     ioContext.stop();
-    t.join();
+    server.join();
 
     return 0;
 };
\ No newline at end of file
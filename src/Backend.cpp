@@ -15,24 +15,52 @@ Backend::Backend(ChartModel *chartModel, QObject *parent)
         m_chartModel{ chartModel },
         m_pPingTimer{ std::make_unique<asio::steady_timer>(m_context, PING_DELAY) } {
 
+    m_reconnectTimer.setSingleShot(true);
+    QObject::connect(&m_reconnectTimer, &QTimer::timeout, this, [this]() { openConnection(true); });
+    QObject::connect(&m_statsTimer, &QTimer::timeout, this, &Backend::showConnectionStats);
+    m_statsTimer.start(STATS_PERIOD);
+
+    m_convertStage.start();
+    m_recordStage.start();
+    m_displayStage.start();
+
     // m_file.setAutoRemove(true);
-    std::cout << "Instantiated backend helper\n";
+    std::cout << "Instantiated backend helper, networking on " << ioBackendReport() << '\n';
 }
 
 Backend::~Backend() {
+    m_reconnectTimer.stop();
+    m_statsTimer.stop();
     m_pPingTimer->cancel();
     disconnectFromHost();
+    closeDatagramChannel();
+    closeSharedMemoryChannel();
 
     // Join any dangling thread before exit
     if (m_threadContext.joinable())
         m_threadContext.join();
 
+    // In order, each one handles what the previous one left
+    m_convertStage.stop();
+    m_recordStage.stop();
+    m_displayStage.stop();
+
     closeFile();
     std::cout << "[BACKEND] Closing. Bye.\n";
 }
 
 
 void Backend::connectToHost(const QString &host, uint16_t port) {
+    m_host = host;
+    m_port = port;
+    m_reconnectTimer.stop();
+    m_nReconnectAttempts = 0;
+    m_bWasAccepted = false;
+
+    openConnection(false);
+}
+
+void Backend::openConnection(bool bResume) {
     m_askDisconnect = false;
     // Prepare the context for consecutive use
     m_context.restart();
@@ -41,33 +69,57 @@ void Backend::connectToHost(const QString &host, uint16_t port) {
     if (m_threadContext.joinable())
         m_threadContext.join();
 
+    // A new connection does not resume the previous one
+    if (!bResume) {
+        m_nServerEpoch = 0;
+        m_readingsSequence.reset();
+    }
+
     // This returns immediately
-    connect(host.toStdString(), port);
+    connect(m_host.toStdString(), m_port);
 
     // Start the threadContext
     m_threadContext = std::thread([&]() {
         m_context.run();
         assert(m_context.stopped() == true);
         std::cout << "[BACKEND] Asio context stopped\n";
+
+        const bool bReconnect = !m_askDisconnect && m_bWasAccepted && m_nReconnectAttempts < MAX_RECONNECT_ATTEMPTS;
+        if (bReconnect)
+            QMetaObject::invokeMethod(this, &Backend::scheduleReconnect, Qt::QueuedConnection);
+
         emit connectionStatusChanged(isConnected());
 
-        if (!m_askDisconnect) {
+        if (!m_askDisconnect && !bReconnect) {
             std::cerr << "[BACKEND] Connection to ESP 32 lost\n";
             emit connectionLost();
         }
     });
 }
 
+void Backend::scheduleReconnect() {
+    if (m_askDisconnect)
+        return;
+
+    const int attempt = m_nReconnectAttempts++;
+    auto delay = std::min(RECONNECT_DELAY * (1 << attempt), MAX_RECONNECT_DELAY);
+
+    std::cout << "[BACKEND] Reconnecting in " << delay.count() << " ms, attempt " << attempt + 1
+              << " of " << MAX_RECONNECT_ATTEMPTS << '\n';
+    emit reconnecting(attempt + 1, static_cast<int>(delay.count()));
+
+    m_reconnectTimer.start(delay);
+}
+
 void Backend::disconnectFromHost() {
     m_askDisconnect = true;
+    m_reconnectTimer.stop();
     if (!client_interface::isConnected())
         return;
 
     std::cout << "[BACKEND] Disconnecting... \n";
 
-    message<MsgTypes> disconnectMsg;
-    disconnectMsg.header.id = ClientDisconnect;
-    sendMessage(disconnectMsg);
+    sendMessage(makeMessage<ClientDisconnect>());
 
     client_interface::disconnect();
 }
@@ -90,9 +142,44 @@ void Backend::onServerDisconnected() {
 void Backend::onMessage(message<MsgTypes> &msg) {
     switch (msg.header.id) {
         case MsgTypes::ServerAccept: {
-            std::cout << "[BACKEND] Server accepted\n";
+            // Older firmware sends no client id
+            if (auto accept = decodeOptionalPayload<ServerAccept>(msg))
+                std::cout << "[BACKEND] Server accepted as client " << accept->clientId << '\n';
+            else
+                std::cout << "[BACKEND] Server accepted\n";
+            const bool bReconnected = m_nReconnectAttempts.exchange(0) > 0;
+            m_bWasAccepted = true;
+
+            // Ask for numbered frames, starting after the last one received if this is the same server. A server
+            // without replay support ignores it and sends plain frames.
+            sendMessage(makeMessage<ClientResumeSession>({ m_nServerEpoch, m_readingsSequence.getExpectedSequence() }));
+            // Same for packed readings, older servers keep sending raw ones
+            sendMessage(makeMessage<ClientSetReadingsCodecs>({ codecMask(readings_codec::delta_packed) }));
+
+            // The server stops a session when its last client leaves for good: start it again if it did
+            if (m_nSessionFrequency > 0) {
+                updateReadingsChannels();
+                sendMessage(makeMessage<ClientStartUpdating>({ m_nSessionFrequency }));
+            }
+
             emit connectionStatusChanged(true);
-            emit statusBarMessageArrived("ESP32 accepted connection");
+            emit statusBarMessageArrived(bReconnected ? "Reconnected to ESP32" : "ESP32 accepted connection");
+            break;
+        }
+
+        case MsgTypes::ServerResumeSession: {
+            onResumeSession(decodePayload<ServerResumeSession>(msg));
+            break;
+        }
+
+        case MsgTypes::ServerSequencedReadings: {
+            try {
+                uint32_t sequence = decodeSequencedReadings(msg, m_sequencedReadings);
+                if (acceptFrame(sequence))
+                    acquire(acquired_frame::kind::readings, std::move(m_sequencedReadings));
+            } catch (std::exception const &e) {
+                std::cout << "Caught exception parsing sequenced readings: " << e.what() << '\n';
+            }
             break;
         }
 
@@ -108,27 +195,32 @@ void Backend::onMessage(message<MsgTypes> &msg) {
         }
 
         case MsgTypes::ServerPing: {
-            std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
-            std::chrono::system_clock::time_point timeThen;
+            auto roundTrip = std::chrono::steady_clock::now() - decodePayload<ServerPing>(msg).time;
 
-            msg >> timeThen;
-            m_lastPingValue = std::chrono::duration<double>(timeNow - timeThen).count() * 1000;
+            m_lastPingValue = std::chrono::duration<double>(roundTrip).count() * 1000;
+            m_pingHistogram.record(roundTrip);
             break;
         }
 
         case MsgTypes::ClientPing: {
-            sendMessage(msg);
+            sendMessage(std::move(msg));
             break;
         }
 
-        case MsgTypes::ServerReadings: {
-            onReadingsReceived(msg);
+        case MsgTypes::ServerReadings:
+        case MsgTypes::ServerReadingsBatch:
+        case MsgTypes::ServerReadingsPacked: {
+            // Once resuming, the server sends numbered frames only. Plain frames sent before it got the request are
+            // replayed numbered.
+            if (m_nServerEpoch == 0)
+                acquire(acquired_frame::kind::readings, std::move(msg));
             break;
         }
 
         case MsgTypes::ServerFinishedUpload: {
             std::cout << "[BACKEND] Server finished upload\n";
-            onServerFinishedUpload();
+            m_nSessionFrequency = 0;
+            acquire(acquired_frame::kind::session_end);
             break;
         }
 
@@ -139,46 +231,117 @@ void Backend::onMessage(message<MsgTypes> &msg) {
 
 // Helpers
 
-void Backend::onReadingsReceived(message<MsgTypes> &msg) {
-    try {
-        // Get channels values
-        uint32_t time;
-        uint32_t deltaTime;
-        CurrentReadings_t currentReadings{};
-
-        msg >> time;
-        deltaTime = time - m_prevReadingTimestamp;
-
-        for (int i = 0; i < SharedParams::n_channels; ++i) {
-            // Note: channels are flipped in respect of ESP 32 order
-            uint16_t newReading;
-            msg >> newReading;
-            auto lastReading = m_ADCReadings[i];
-
-            // The integrator has been reset.
-            if (lastReading - newReading > SharedParams::integratorThreshold * 0.9)
-                lastReading -= SharedParams::integratorThreshold;
-
-            // Compute current in Ampere
-            currentReadings[i] = computeCurrentFromADC(newReading, lastReading, deltaTime);
-            m_ADCReadings[i] = newReading;
+void Backend::onResumeSession(const resume_payload &resume) {
+    if (resume.epoch != m_nServerEpoch) {
+        // Another server, or the first connection: the frames received so far cannot be resumed
+        if (m_nServerEpoch != 0) {
+            std::cout << "[BACKEND] Server restarted, cannot resume the session\n";
+            if (m_nSessionFrequency > 0)
+                acquire(acquired_frame::kind::gap, {}, "# Server restarted, frames after " +
+                                                       std::to_string(m_readingsSequence.getExpectedSequence()) +
+                                                       " lost");
         }
+        m_nServerEpoch = resume.epoch;
+        m_readingsSequence.reset();
+        return;
+    }
 
-        // Count the amount of data received
-        m_bytesRead += sizeof(msg);
-        ++m_readingsReceived;
+    if (m_readingsSequence.hasStarted()) {
+        uint32_t nMissed = resume.sequence - m_readingsSequence.getExpectedSequence();
+        std::cout << "[BACKEND] Resuming from frame " << resume.sequence << ", " << nMissed
+                  << " frames no longer available\n";
+    }
+}
+
+bool Backend::acceptFrame(uint32_t sequence) {
+    const uint32_t nExpected = m_readingsSequence.getExpectedSequence();
+    const uint64_t nLost = m_readingsSequence.getLostCount();
+    const uint64_t nDuplicates = m_readingsSequence.getDuplicateCount();
+
+    if (m_readingsSequence.accept(sequence)) {
+        if (m_readingsSequence.getLostCount() != nLost)
+            acquire(acquired_frame::kind::gap, {}, "# Frames " + std::to_string(nExpected) + " to " +
+                                                   std::to_string(sequence - 1) + " lost");
+        return true;
+    }
+
+    const bool bDuplicate = m_readingsSequence.getDuplicateCount() != nDuplicates;
+    acquire(acquired_frame::kind::note, {}, "# Frame " + std::to_string(sequence) +
+                                            (bDuplicate ? " duplicated, discarded" : " out of order, discarded"));
+    return false;
+}
+
+void Backend::acquire(acquired_frame::kind type, message<MsgTypes> msg, std::string note) {
+    m_convertStage.push(acquired_frame{ type, std::move(msg), std::move(note) });
+}
+
+void Backend::onFrameAcquired(acquired_frame &frame) {
+    switch (frame.type) {
+        case acquired_frame::kind::readings:
+            onReadingsReceived(frame.msg);
+            break;
+        case acquired_frame::kind::gap:
+            m_bAfterGap = true;
+            m_recordStage.push(converted_frame{ nullptr, std::move(frame.note) });
+            break;
+        case acquired_frame::kind::note:
+            m_recordStage.push(converted_frame{ nullptr, std::move(frame.note) });
+            break;
+        case acquired_frame::kind::session_start:
+            m_readingsReceived = 0;
+            m_bytesRead = 0;
+            m_integrators.readings = {};
+            m_nLateSamples = 0;
+            m_bAfterGap = false;
+            m_convertStage.resetCounters();
+            m_recordStage.resetCounters();
+            m_displayStage.resetCounters();
+            break;
+        case acquired_frame::kind::session_end:
+            onServerFinishedUpload();
+            break;
+    }
+}
+
+void Backend::onFrameConverted(converted_frame &frame) {
+    std::scoped_lock lock(m_muxRecording);
+    if (frame.samples) {
+        for (const auto &sample: *frame.samples)
+            writeSample(sample);
+    } else {
+        m_textStream << frame.note.c_str() << '\n';
+    }
+}
 
-        // Write data to disk
-        m_textStream << time << ',' << deltaTime;
-        for (int i = 0; i < SharedParams::n_channels; ++i) {
-            m_textStream << ',' << m_ADCReadings[i] << ',' << currentReadings[i];
+void Backend::displaySamples(const converted_samples &samples) {
+    for (const auto &sample: *samples)
+        m_chartModel->insertReadings(sample.adcReadings, sample.currentReadings);
+    m_chartModel->publishSnapshot();
+}
+
+void Backend::onReadingsReceived(message<MsgTypes> &msg) {
+    try {
+        if (msg.header.id == ServerReadings) {
+            m_vUnpackedSamples.assign(1, decodePayload<ServerReadings>(msg));
+        } else if (msg.header.id == ServerReadingsBatch) {
+            auto samples = decodePayloads<ServerReadingsBatch>(msg);
+            m_vUnpackedSamples.resize(samples.size());
+            for (size_t i = 0; i < samples.size(); ++i)
+                m_vUnpackedSamples[i] = samples[i];
+        } else {
+            decodePackedReadings(msg, m_vUnpackedSamples);
         }
-        m_textStream << '\n';
 
-        // Draw
-        m_chartModel->insertReadings(m_ADCReadings, currentReadings);
+        auto converted = std::make_shared<std::vector<converted_sample>>();
+        convertSamples(m_vUnpackedSamples, *converted);
 
-        m_prevReadingTimestamp = time;
+        // The chart may lose frames, the recording may not
+        converted_samples samples = std::move(converted);
+        m_displayStage.tryPush(samples);
+        m_recordStage.push(converted_frame{ std::move(samples), {}});
+
+        // Count the amount of data received
+        m_bytesRead += sizeof(msg.header) + msg.size();
     } catch (std::exception const &e) {
         std::cout << "Caught exception parsing new reading: " << e.what() << '\n';
     } catch (...) {
@@ -186,6 +349,37 @@ void Backend::onReadingsReceived(message<MsgTypes> &msg) {
     }
 }
 
+void Backend::convertSamples(const std::vector<readings_sample> &samples, std::vector<converted_sample> &converted) {
+    m_vCurrents.resize(samples.size());
+    m_vDeltaTimes.resize(samples.size());
+    fortress::convertCurrents(CURRENT_CONVERSION, samples.data(), samples.size(), m_integrators, m_vCurrents.data(),
+                              m_vDeltaTimes.data());
+
+    converted.reserve(samples.size());
+    for (size_t i = 0; i < samples.size(); ++i) {
+        const uint32_t deltaTime = m_vDeltaTimes[i];
+        if (m_readingsReceived > 0 && !m_bAfterGap && m_nSessionFrequency > 0 &&
+            deltaTime > LATE_SAMPLE_FACTOR * 1e6 / m_nSessionFrequency)
+            ++m_nLateSamples;
+        m_bAfterGap = false;
+
+        ++m_readingsReceived;
+
+        // To record and draw
+        ADCReadings_t adcReadings;
+        std::copy(samples[i].readings.begin(), samples[i].readings.end(), adcReadings.begin());
+        converted.push_back({ samples[i].timestamp, deltaTime, adcReadings, m_vCurrents[i] });
+    }
+}
+
+void Backend::writeSample(const converted_sample &sample) {
+    m_textStream << sample.time << ',' << sample.deltaTime;
+    for (int i = 0; i < SharedParams::n_channels; ++i) {
+        m_textStream << ',' << sample.adcReadings[i] << ',' << sample.currentReadings[i];
+    }
+    m_textStream << '\n';
+}
+
 void Backend::onServerFinishedUpload() {
     // How long the session was
     std::chrono::duration<double> elapsedTime = std::chrono::steady_clock::now() - m_startUpdateTime;
@@ -197,17 +391,67 @@ void Backend::onServerFinishedUpload() {
       << kilobytes << " KB in " << elapsedTime.count() << " s - "
       << kilobytes / elapsedTime.count() << " KB/s";
 
+    if (m_readingsSequence.hasStarted())
+        report << ". Frames: " << m_readingsSequence.getReceivedCount() << " received, "
+               << m_readingsSequence.getLostCount() << " lost, " << m_readingsSequence.getDuplicateCount()
+               << " duplicated, " << m_readingsSequence.getReorderedCount() << " reordered";
+    report << ". Late samples: " << m_nLateSamples;
+
+    if (auto datagrams = getDatagramChannel()) {
+        const auto &tracker = datagrams->tracker();
+        report << ". Datagrams: " << tracker.getReceivedCount() << " received, " << tracker.getLostCount()
+               << " lost (" << tracker.getLossRatio() * 100 << " %), " << tracker.getDuplicateCount() << " duplicated, "
+               << tracker.getReorderedCount() << " reordered";
+    }
+
+    if (auto sharedMemory = getSharedMemoryChannel())
+        report << ". Shared memory: " << sharedMemory->getReceivedCount() << " frames received";
+
+    report << ". " << pipelineReport();
+
+    // Closes the recording
+    m_recordStage.push(converted_frame{ nullptr, "# " + report.str() });
+
     emit statusBarMessageArrived(QString::fromStdString(report.str()));
     std::cout << report.str() << std::endl;
 }
 
+void Backend::showConnectionStats() {
+    auto stats = getConnectionStats();
+    if (!stats || !isConnected() || m_nSessionFrequency == 0) {
+        m_lastConnectionStats.reset();
+        return;
+    }
+
+    if (m_lastConnectionStats) {
+        auto rates = connection_rates::between(*m_lastConnectionStats, *stats);
+        std::stringstream status;
+        status << std::fixed << std::setprecision(1) << "In " << rates.bytesIn / 1000 << " kB/s, "
+               << rates.framesIn << " frames/s. Out queue " << stats->queueDepth << " (peak "
+               << stats->peakQueueDepth << "), write p99 " << stats->writeLatency.p99.count() << " us, "
+               << stats->readStalls << " read stalls. " << pipelineReport();
+        emit statusBarMessageArrived(QString::fromStdString(status.str()));
+    }
+    m_lastConnectionStats = stats;
+}
+
+std::string Backend::pipelineReport() const {
+    std::stringstream report;
+    auto addStage = [&report](const char *name, const auto &stage) {
+        report << ' ' << name << ' ' << stage.getQueueDepth() << " (peak " << stage.getPeakQueueDepth() << ')';
+    };
+
+    report << "Pipeline queues:";
+    addStage("convert", m_convertStage);
+    addStage("record", m_recordStage);
+    addStage("display", m_displayStage);
+    report << ", " << m_displayStage.getDroppedCount() << " frames not displayed";
+    return report.str();
+}
+
 void Backend::pingHandler() {
     if (m_bIsPinging) {
-        message<MsgTypes> pingMsg;
-        pingMsg.header.id = ServerPing;
-        pingMsg << std::chrono::system_clock::now();
-
-        sendMessage(pingMsg);
+        sendMessage(makeMessage<ServerPing>({ std::chrono::steady_clock::now() }));
 
         m_pPingTimer->expires_from_now(PING_DELAY);
         m_pPingTimer->async_wait([this](asio::error_code ec) {
@@ -228,6 +472,7 @@ void Backend::togglePingUpdate() {
 }
 
 void Backend::openFile(uint16_t frequency) {
+    std::scoped_lock lock(m_muxRecording);
     m_file = std::make_unique<QTemporaryFile>(m_filename);
     m_textStream.setDevice(m_file.get());
     m_file->open();
@@ -254,9 +499,15 @@ void Backend::openFile(uint16_t frequency) {
 }
 
 void Backend::closeFile() {
+    // What was received so far goes in the file
+    m_convertStage.flush();
+    m_recordStage.flush();
+
+    std::scoped_lock lock(m_muxRecording);
     m_textStream.flush();
 
-    if (m_file->isOpen())
+    // No file before the first session
+    if (m_file && m_file->isOpen())
         m_file->close();
 
     m_textStream.setDevice(nullptr);
@@ -266,10 +517,52 @@ double Backend::getLastPingValue() const {
     return m_lastPingValue;
 }
 
+double Backend::getPingPercentile(double q) const {
+    if (m_pingHistogram.count() == 0)
+        return std::numeric_limits<double>::infinity();
+    return static_cast<double>(m_pingHistogram.quantile(q).count()) / 1000;
+}
+
+double Backend::getPingP50() const {
+    return getPingPercentile(0.50);
+}
+
+double Backend::getPingP90() const {
+    return getPingPercentile(0.90);
+}
+
+double Backend::getPingP99() const {
+    return getPingPercentile(0.99);
+}
+
+double Backend::getPingMax() const {
+    return getPingPercentile(1.0);
+}
+
+void Backend::resetPingStatistics() {
+    m_pingHistogram.reset();
+}
+
 QString Backend::getStatusBarMessage() const {
     return m_statusBarMessage;
 }
 
+bool Backend::isUsingDatagrams() const {
+    return m_bUseDatagrams;
+}
+
+void Backend::setUseDatagrams(bool bUseDatagrams) {
+    m_bUseDatagrams = bUseDatagrams;
+}
+
+bool Backend::isUsingSharedMemory() const {
+    return m_bUseSharedMemory;
+}
+
+void Backend::setUseSharedMemory(bool bUseSharedMemory) {
+    m_bUseSharedMemory = bUseSharedMemory;
+}
+
 // Accessors
 
 void Backend::sendStartUpdateCommand(uint16_t frequency) {
@@ -277,29 +570,49 @@ void Backend::sendStartUpdateCommand(uint16_t frequency) {
     // Clear the status bar
     emit statusBarMessageArrived("");
 
-    message<MsgTypes> msg;
-    msg.header.id = ClientStartUpdating;
-    msg << frequency;
+    auto msg = makeMessage<ClientStartUpdating>({ frequency });
     m_startUpdateTime = std::chrono::steady_clock::now();
-    m_readingsReceived = 0;
-    m_bytesRead = 0;
-    m_ADCReadings = {};
-    sendMessage(msg);
+    m_nSessionFrequency = frequency;
+    // The tracker and the channels are used by the context thread, the counters of the session by the convert stage
+    asio::post(m_context, [this, msg = std::move(msg)]() mutable {
+        m_readingsSequence.reset();
+        acquire(acquired_frame::kind::session_start);
+        updateReadingsChannels();
+        sendMessage(std::move(msg));
+    });
 }
 
 void Backend::sendStopUpdateCommand() {
-
-    message<MsgTypes> msg;
-    msg.header.id = ClientStopUpdating;
-    sendMessage(msg);
+    m_nSessionFrequency = 0;
+    sendMessage(makeMessage<ClientStopUpdating>());
 }
 
 
+void Backend::updateReadingsChannels() {
+    // Only a server on this host can open the ring: the others ignore the request and the readings go over UDP or TCP
+    if (m_bUseSharedMemory) {
+        if (auto name = openSharedMemoryChannel(); !name.empty()) {
+            shared_memory_channel_payload payload{};
+            std::strncpy(payload.name, name.c_str(), sizeof(payload.name) - 1);
+            sendMessage(makeMessage<ClientOpenSharedMemoryChannel>(payload));
+        }
+    } else if (getSharedMemoryChannel()) {
+        sendMessage(makeMessage<ClientOpenSharedMemoryChannel>({}));
+        closeSharedMemoryChannel();
+    }
+
+    if (m_bUseDatagrams) {
+        // A server without UDP support ignores the request and keeps sending the readings over TCP
+        if (uint16_t port = openDatagramChannel(); port != 0)
+            sendMessage(makeMessage<ClientOpenDatagramChannel>({ port }));
+    } else if (getDatagramChannel()) {
+        sendMessage(makeMessage<ClientOpenDatagramChannel>({ 0 }));
+        closeDatagramChannel();
+    }
+}
+
 void Backend::sendHVValue(uint16_t value) {
-    message<MsgTypes> msg;
-    msg.header.id = fortress::net::ClientSetSensorHV;
-    msg << value;
-    sendMessage(msg);
+    sendMessage(makeMessage<ClientSetSensorHV>({ value }));
 }
 
 bool Backend::saveFile(QUrl &destinationPath) {
@@ -5,34 +5,19 @@
 #include <ChartModel.h>
 #include <iostream>
 
-ChartModel::ChartModel(QObject *parent) : QObject(parent) {
-    generatePlotSeries(SharedParams::n_channels, SharedParams::plotWindowSizeInPoint);
-}
+ChartModel::ChartModel(QObject *parent) : QObject(parent) {}
 
 void ChartModel::clearData() {
-    for (auto &ch: m_chartData)
-        ch.clear();
-
-    for (int ch = 0; ch < SharedParams::n_channels; ++ch) {
-        m_chartData[ch].clear();
-        m_chartCurrentData[ch].clear();
-    }
-
-    m_t = m_dataXIndex = 0;
-    m_chartData.clear();
-    m_chartCurrentData.clear();
-    m_chLastValues = {};
-    m_chLastCurrentValues = {};
-    m_chMinCurrentValues = {};
-    m_chMaxValues = {};
-    m_chMaxCurrentValues = {};
-    m_chTotalSums = {};
-    m_chTotalCurrentSums = {};
-    generatePlotSeries(SharedParams::n_channels, SharedParams::plotWindowSizeInPoint);
+    // The inserting side drops its data at the next reading, the snapshots published until then are ignored
+    const uint32_t nClears = ++m_nClears;
+    auto &front = m_snapshots.front();
+    front = {};
+    front.nClears = nClears;
 }
 
 QList<QPointF> ChartModel::getSeries() const {
-    return m_chartData.at(0);
+    const auto &data = snapshot();
+    return makePoints(data, data.chartData[0], 0, SharedParams::plotWindowSizeInPoint);
 }
 
 int ChartModel::plotWindowSize() {
@@ -50,70 +35,65 @@ void ChartModel::showADCValues(bool show) {
 
 
 void ChartModel::insertReadings(const ADCReadings_t &rawReadings, const CurrentReadings_t &currentReadings) {
-    m_dataXIndex = m_t % SharedParams::plotWindowSizeInPoint;
+    applyClear();
 
-    for (int ch = 0; ch < SharedParams::n_channels; ++ch) {
-        auto chSeries = &m_chartData[ch];
-        auto chSeriesDiff = &m_chartCurrentData[ch];
+    m_data.dataXIndex = m_data.t % SharedParams::plotWindowSizeInPoint;
 
-        int lastReading = m_chLastValues[ch];
+    for (int ch = 0; ch < SharedParams::n_channels; ++ch) {
         int newReading = rawReadings[ch];
 
-        // The integrator has been reset.
-        if (lastReading - newReading > SharedParams::integratorThreshold * 0.9)
-            lastReading -= SharedParams::integratorThreshold;
-
-        auto newCurrentReading = currentReadings[ch];
         // Set the current readings as last the last value
-        m_chLastValues[ch] = newReading;
-        m_chLastCurrentValues[ch] = currentReadings[ch];
+        m_data.chLastValues[ch] = newReading;
+        m_data.chLastCurrentValues[ch] = currentReadings[ch];
 
         // Swipe from left to right and refresh the circular buffer at current position
-        double x{ static_cast<double>(m_dataXIndex) };
-        chSeries->replace(m_dataXIndex, QPointF{ x, static_cast<double>(newReading) });
-        chSeriesDiff->replace(m_dataXIndex, QPointF{ x, static_cast<double>(newCurrentReading) });
-
-        // Adjust the min/max values to auto-scale the plot
-        auto maxValue = *std::max_element(chSeries->begin(), chSeries->end(), compareFunction);
-        auto minMaxDiffValues = std::minmax_element(chSeriesDiff->begin(), chSeriesDiff->end(), compareFunction);
-
-        m_chMaxValues[ch] = static_cast<int>(maxValue.y());
-        m_chMinCurrentValues[ch] = minMaxDiffValues.first->y();
-        m_chMaxCurrentValues[ch] = minMaxDiffValues.second->y();
-        m_chTotalSums[ch] += newReading;
-        m_chTotalCurrentSums[ch] += currentReadings[ch];
+        m_data.chartData[ch][m_data.dataXIndex] = static_cast<double>(newReading);
+        m_data.chartCurrentData[ch][m_data.dataXIndex] = currentReadings[ch];
+
+        m_data.chTotalSums[ch] += newReading;
+        m_data.chTotalCurrentSums[ch] += currentReadings[ch];
     }
-    ++m_t;
+    ++m_data.t;
 }
 
-// Slots
-void ChartModel::generatePlotSeries(int n_channels, int length) {
-    for (int ch = 0; ch < n_channels; ++ch) {
-        QList<QPointF> points{};
-        points.reserve(length);
+void ChartModel::publishSnapshot() {
+    applyClear();
 
-        for (int i = 0; i < length; ++i)
-            points.push_front(QPointF{});
+    // Adjust the min/max values to auto-scale the plot, once per frame rather than at every reading
+    for (int ch = 0; ch < SharedParams::n_channels; ++ch) {
+        const auto &chSeries = m_data.chartData[ch];
+        const auto &chSeriesDiff = m_data.chartCurrentData[ch];
+
+        auto maxValue = *std::max_element(chSeries.begin(), chSeries.end());
+        auto minMaxDiffValues = std::minmax_element(chSeriesDiff.begin(), chSeriesDiff.end());
 
-        m_chartData.append(points);
-        m_chartCurrentData.append(points);
+        m_data.chMaxValues[ch] = static_cast<int>(maxValue);
+        m_data.chMinCurrentValues[ch] = *minMaxDiffValues.first;
+        m_data.chMaxCurrentValues[ch] = *minMaxDiffValues.second;
     }
+
+    m_snapshots.back() = m_data;
+    m_snapshots.publish();
 }
 
 double ChartModel::getLastChannelValue(int channel) const {
-    return m_showADCValues ? m_chLastValues[channel] : m_chLastCurrentValues[channel];
+    const auto &data = snapshot();
+    return m_showADCValues ? data.chLastValues[channel] : data.chLastCurrentValues[channel];
 }
 
 double ChartModel::getMinChannelValue(int channel) const {
-    return m_showADCValues ? m_chMinValues[channel] : m_chMinCurrentValues[channel];
+    const auto &data = snapshot();
+    return m_showADCValues ? data.chMinValues[channel] : data.chMinCurrentValues[channel];
 }
 
 double ChartModel::getMaxChannelValue(int channel) const {
-    return m_showADCValues ? m_chMaxValues[channel]: m_chMaxCurrentValues[channel];
+    const auto &data = snapshot();
+    return m_showADCValues ? data.chMaxValues[channel] : data.chMaxCurrentValues[channel];
 }
 
 double ChartModel::getChannelTotalSum(uint8_t channel) const {
-    return m_showADCValues ? m_chTotalSums[channel] : m_chTotalCurrentSums[channel];
+    const auto &data = snapshot();
+    return m_showADCValues ? data.chTotalSums[channel] : data.chTotalCurrentSums[channel];
 }
 
 
@@ -125,19 +105,48 @@ void ChartModel::updatePlotSeries(
     if (qtQuickLeftSeries && qtQuickRightSeries) {
         auto *xyQtQuickLeftSeries = dynamic_cast<QXYSeries *>(qtQuickLeftSeries);
         auto *xyQtQuickRightSeries = dynamic_cast<QXYSeries *>(qtQuickRightSeries);
-        auto channelData = m_showADCValues ? &m_chartData[channel] : &m_chartCurrentData[channel];
+        const auto &data = snapshot();
+        const auto &channelData = m_showADCValues ? data.chartData[channel] : data.chartCurrentData[channel];
 
-        assert(channelData->length() == SharedParams::plotWindowSizeInPoint);
-
-        auto leftSeries = QList(channelData->begin(), channelData->begin() + m_dataXIndex);
-        xyQtQuickLeftSeries->replace(leftSeries);
+        xyQtQuickLeftSeries->replace(makePoints(data, channelData, 0, data.dataXIndex));
 
         // FIXME: to prevent glitches the first time the we span from left to right (right series is empty) we use
         // as workaround m_data_idx + 1, thus we need a sanity check to prevent out of bound. This check is heavy and
         // should be removed
-        if (m_dataXIndex < SharedParams::plotWindowSizeInPoint - 2) {
-            auto rightSeries = QList(channelData->begin() + m_dataXIndex + 1, channelData->end());
-            xyQtQuickRightSeries->replace(rightSeries);
+        if (data.dataXIndex < SharedParams::plotWindowSizeInPoint - 2) {
+            xyQtQuickRightSeries->replace(
+                    makePoints(data, channelData, data.dataXIndex + 1, SharedParams::plotWindowSizeInPoint));
         }
     }
 }
+
+// Private
+
+void ChartModel::applyClear() {
+    const uint32_t nClears = m_nClears.load(std::memory_order_acquire);
+    if (nClears != m_data.nClears) {
+        m_data = {};
+        m_data.nClears = nClears;
+    }
+}
+
+const ChartModel::chart_snapshot &ChartModel::snapshot() const {
+    // A snapshot of data cleared since: keep showing the cleared one
+    const uint32_t nClears = m_nClears.load(std::memory_order_relaxed);
+    if (m_snapshots.update() && m_snapshots.front().nClears != nClears) {
+        auto &front = m_snapshots.front();
+        front = {};
+        front.nClears = nClears;
+    }
+    return m_snapshots.front();
+}
+
+QList<QPointF> ChartModel::makePoints(const chart_snapshot &data, const PlotWindow_t &window, int begin, int end) {
+    QList<QPointF> points;
+    points.reserve(end - begin);
+
+    // Points not written since the data was cleared stay at the origin
+    for (int x = begin; x < end; ++x)
+        points.append(x < data.t ? QPointF{ static_cast<double>(x), window[x] } : QPointF{});
+    return points;
+}
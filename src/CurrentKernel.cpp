@@ -0,0 +1,237 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#include "CurrentKernel.h"
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FORTRESS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace fortress {
+
+    static_assert(consts::N_CHANNELS == 8, "The vector kernels convert 8 channels at a time");
+
+    // An int exceeds threshold * 0.9 exactly when it exceeds its floor
+    static int resetLimit(const current_conversion &conversion) {
+        return static_cast<int>(std::floor(conversion.integratorThreshold * 0.9));
+    }
+
+    // ---- Scalar reference ----
+
+    static void convertScalar(const current_conversion &conversion, const net::readings_sample *samples,
+                              size_t count, integrator_state &state, ChannelCurrents_t *currents,
+                              uint32_t *deltaTimes) {
+        const int limit = resetLimit(conversion);
+
+        for (size_t i = 0; i < count; ++i) {
+            const auto &sample = samples[i];
+            const uint32_t deltaTime = sample.timestamp - state.time;
+
+            for (size_t ch = 0; ch < consts::N_CHANNELS; ++ch) {
+                const int newReading = sample.readings[ch];
+                int lastReading = state.readings[ch];
+
+                // The integrator has been reset
+                lastReading -= (lastReading - newReading > limit) * conversion.integratorThreshold;
+
+                currents[i][ch] = -static_cast<double>(newReading - lastReading) / conversion.adcMaxValue *
+                                  conversion.adcVref * conversion.amplifierFeedback *
+                                  conversion.integratorCapacitance / static_cast<double>(deltaTime / 1e6);
+                state.readings[ch] = newReading;
+            }
+
+            deltaTimes[i] = deltaTime;
+            state.time = sample.timestamp;
+        }
+    }
+
+#ifdef FORTRESS_X86_KERNELS
+
+    // ---- SSE2: 4 channels as 2 x 2 doubles, part of x86-64 ----
+
+    // The change of 4 integrators, with the last readings lowered by the threshold where they have been reset
+    static inline __m128i integratorChange(__m128i now, __m128i last, __m128i limit, __m128i threshold) {
+        const __m128i reset = _mm_and_si128(_mm_cmpgt_epi32(_mm_sub_epi32(last, now), limit), threshold);
+        return _mm_sub_epi32(now, _mm_sub_epi32(last, reset));
+    }
+
+    // The operations of the scalar reference, in its order. Flipping the sign bit is the scalar negation, -0.0 too.
+    static inline __m128d toCurrents(__m128d change, __m128d sign, __m128d adcMax, __m128d vref, __m128d feedback,
+                                     __m128d capacitance, __m128d seconds) {
+        __m128d current = _mm_xor_pd(change, sign);
+        current = _mm_div_pd(current, adcMax);
+        current = _mm_mul_pd(current, vref);
+        current = _mm_mul_pd(current, feedback);
+        current = _mm_mul_pd(current, capacitance);
+        return _mm_div_pd(current, seconds);
+    }
+
+    static void convertSse2(const current_conversion &conversion, const net::readings_sample *samples,
+                            size_t count, integrator_state &state, ChannelCurrents_t *currents,
+                            uint32_t *deltaTimes) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i limit = _mm_set1_epi32(resetLimit(conversion));
+        const __m128i threshold = _mm_set1_epi32(conversion.integratorThreshold);
+        const __m128d sign = _mm_set1_pd(-0.0);
+        const __m128d adcMax = _mm_set1_pd(conversion.adcMaxValue);
+        const __m128d vref = _mm_set1_pd(conversion.adcVref);
+        const __m128d feedback = _mm_set1_pd(conversion.amplifierFeedback);
+        const __m128d capacitance = _mm_set1_pd(conversion.integratorCapacitance);
+
+        __m128i lastLow = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state.readings.data()));
+        __m128i lastHigh = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state.readings.data() + 4));
+        uint32_t time = state.time;
+
+        for (size_t i = 0; i < count; ++i) {
+            const __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i *>(samples[i].readings.data()));
+            const __m128i nowLow = _mm_unpacklo_epi16(raw, zero);
+            const __m128i nowHigh = _mm_unpackhi_epi16(raw, zero);
+
+            const uint32_t deltaTime = samples[i].timestamp - time;
+            const __m128d seconds = _mm_set1_pd(deltaTime / 1e6);
+
+            const __m128i changeLow = integratorChange(nowLow, lastLow, limit, threshold);
+            const __m128i changeHigh = integratorChange(nowHigh, lastHigh, limit, threshold);
+
+            double *out = currents[i].data();
+            _mm_storeu_pd(out, toCurrents(_mm_cvtepi32_pd(changeLow), sign, adcMax, vref, feedback, capacitance,
+                                          seconds));
+            _mm_storeu_pd(out + 2, toCurrents(_mm_cvtepi32_pd(_mm_unpackhi_epi64(changeLow, changeLow)), sign,
+                                              adcMax, vref, feedback, capacitance, seconds));
+            _mm_storeu_pd(out + 4, toCurrents(_mm_cvtepi32_pd(changeHigh), sign, adcMax, vref, feedback,
+                                              capacitance, seconds));
+            _mm_storeu_pd(out + 6, toCurrents(_mm_cvtepi32_pd(_mm_unpackhi_epi64(changeHigh, changeHigh)), sign,
+                                              adcMax, vref, feedback, capacitance, seconds));
+
+            deltaTimes[i] = deltaTime;
+            time = samples[i].timestamp;
+            lastLow = nowLow;
+            lastHigh = nowHigh;
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(state.readings.data()), lastLow);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(state.readings.data() + 4), lastHigh);
+        state.time = time;
+    }
+
+    // ---- AVX2: 8 channels as 2 x 4 doubles ----
+
+    __attribute__((target("avx2")))
+    static inline __m256d toCurrents(__m256d change, __m256d sign, __m256d adcMax, __m256d vref, __m256d feedback,
+                                     __m256d capacitance, __m256d seconds) {
+        __m256d current = _mm256_xor_pd(change, sign);
+        current = _mm256_div_pd(current, adcMax);
+        current = _mm256_mul_pd(current, vref);
+        current = _mm256_mul_pd(current, feedback);
+        current = _mm256_mul_pd(current, capacitance);
+        return _mm256_div_pd(current, seconds);
+    }
+
+    __attribute__((target("avx2")))
+    static void convertAvx2(const current_conversion &conversion, const net::readings_sample *samples,
+                            size_t count, integrator_state &state, ChannelCurrents_t *currents,
+                            uint32_t *deltaTimes) {
+        const __m256i limit = _mm256_set1_epi32(resetLimit(conversion));
+        const __m256i threshold = _mm256_set1_epi32(conversion.integratorThreshold);
+        const __m256d sign = _mm256_set1_pd(-0.0);
+        const __m256d adcMax = _mm256_set1_pd(conversion.adcMaxValue);
+        const __m256d vref = _mm256_set1_pd(conversion.adcVref);
+        const __m256d feedback = _mm256_set1_pd(conversion.amplifierFeedback);
+        const __m256d capacitance = _mm256_set1_pd(conversion.integratorCapacitance);
+
+        __m256i last = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(state.readings.data()));
+        uint32_t time = state.time;
+
+        for (size_t i = 0; i < count; ++i) {
+            const __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i *>(samples[i].readings.data()));
+            const __m256i now = _mm256_cvtepu16_epi32(raw);
+
+            const uint32_t deltaTime = samples[i].timestamp - time;
+            const __m256d seconds = _mm256_set1_pd(deltaTime / 1e6);
+
+            // Branchless reset: lower the last reading by the threshold where it dropped by more than the limit
+            const __m256i reset = _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_sub_epi32(last, now), limit),
+                                                   threshold);
+            const __m256i change = _mm256_sub_epi32(now, _mm256_sub_epi32(last, reset));
+
+            double *out = currents[i].data();
+            _mm256_storeu_pd(out, toCurrents(_mm256_cvtepi32_pd(_mm256_castsi256_si128(change)), sign, adcMax,
+                                             vref, feedback, capacitance, seconds));
+            _mm256_storeu_pd(out + 4, toCurrents(_mm256_cvtepi32_pd(_mm256_extracti128_si256(change, 1)), sign,
+                                                 adcMax, vref, feedback, capacitance, seconds));
+
+            deltaTimes[i] = deltaTime;
+            time = samples[i].timestamp;
+            last = now;
+        }
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(state.readings.data()), last);
+        state.time = time;
+    }
+
+#endif
+
+    // ---- Dispatch ----
+
+    void convertCurrents(const current_conversion &conversion, const net::readings_sample *samples, size_t count,
+                         integrator_state &state, ChannelCurrents_t *currents, uint32_t *deltaTimes) {
+        convertCurrents(selectedCurrentKernel(), conversion, samples, count, state, currents, deltaTimes);
+    }
+
+    void convertCurrents(current_kernel kernel, const current_conversion &conversion,
+                         const net::readings_sample *samples, size_t count, integrator_state &state,
+                         ChannelCurrents_t *currents, uint32_t *deltaTimes) {
+        switch (kernel) {
+            case current_kernel::scalar:
+                convertScalar(conversion, samples, count, state, currents, deltaTimes);
+                return;
+#ifdef FORTRESS_X86_KERNELS
+            case current_kernel::sse2:
+                convertSse2(conversion, samples, count, state, currents, deltaTimes);
+                return;
+            case current_kernel::avx2:
+                convertAvx2(conversion, samples, count, state, currents, deltaTimes);
+                return;
+#endif
+            default:
+                throw std::invalid_argument(std::string("Current kernel not available: ") + toString(kernel));
+        }
+    }
+
+    current_kernel selectedCurrentKernel() {
+        static const current_kernel kernel = availableCurrentKernels().back();
+        return kernel;
+    }
+
+    std::vector<current_kernel> availableCurrentKernels() {
+        std::vector<current_kernel> kernels{ current_kernel::scalar };
+#ifdef FORTRESS_X86_KERNELS
+        kernels.push_back(current_kernel::sse2);
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            kernels.push_back(current_kernel::avx2);
+#endif
+        return kernels;
+    }
+
+    const char *toString(current_kernel kernel) {
+        switch (kernel) {
+            case current_kernel::scalar:
+                return "scalar";
+            case current_kernel::sse2:
+                return "sse2";
+            case current_kernel::avx2:
+                return "avx2";
+        }
+        return "unknown";
+    }
+}
@@ -0,0 +1,243 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+
+#include "FRRelay.h"
+
+FRRelay::FRRelay(asio::io_context &io_context, uint16_t port, std::string deviceHost, uint16_t devicePort) :
+        server_interface(io_context, port),
+        m_deviceHost{ std::move(deviceHost) },
+        m_nDevicePort{ devicePort },
+        m_device{ io_context, *this },
+        m_strand{ asio::make_strand(io_context) },
+        m_pReconnectTimer{ std::make_unique<asio::steady_timer>(m_strand) } {}
+
+bool FRRelay::start() {
+    if (!server_interface::start())
+        return false;
+
+    asio::post(m_strand, [this]() { connectToDevice(); });
+    return true;
+}
+
+void FRRelay::setOverflowPolicy(tcp_connection::overflow_policy policy, size_t highWaterMark) {
+    if (policy == tcp_connection::overflow_policy::block)
+        throw std::invalid_argument("A slow viewer would block the relay for everyone");
+
+    m_overflowPolicy = policy;
+    m_nHighWaterMark = highWaterMark;
+}
+
+// ---- Protected Methods ----
+
+bool FRRelay::onClientConnect(std::shared_ptr<tcp_connection> client) {
+    std::cout << "[RELAY] New Viewer Connected\n";
+    client->setOverflowPolicy(m_overflowPolicy, m_nHighWaterMark);
+
+    sendMessage(client, makeMessage<ServerAccept>({ client->getID() }));
+    asio::post(m_strand, [this, client]() {
+        m_viewers.push_back(client);
+        if (m_viewers.size() == 1)
+            sendText(client, "You control the device");
+        if (!m_bDeviceAccepted)
+            sendText(client, "Device not connected yet");
+    });
+    return true;
+}
+
+void FRRelay::onClientDisconnect(std::shared_ptr<tcp_connection> client) {
+    std::cout << '[' << client->getID() << "] Viewer Disconnected. Sent " << client->getMessagesWrittenCount()
+              << " messages, peak queue depth " << client->getPeakQueueDepth() << ", dropped "
+              << client->getMessagesDroppedCount() << ", coalesced " << client->getMessagesCoalescedCount() << '\n';
+
+    {
+        std::scoped_lock lock(m_muxPackingViewers);
+        m_packingViewers.erase(client->getID());
+    }
+
+    asio::post(m_strand, [this, client]() {
+        auto it = std::find(m_viewers.begin(), m_viewers.end(), client);
+        if (it == m_viewers.end())
+            return;
+
+        const bool bWasOwner = it == m_viewers.begin();
+        m_viewers.erase(it);
+
+        if (bWasOwner && !m_viewers.empty()) {
+            std::cout << '[' << m_viewers.front()->getID() << "] Now owns the device\n";
+            sendText(m_viewers.front(), "You control the device");
+        }
+
+        // Nobody is watching: do not keep the device sampling. A viewer reconnecting starts the session again.
+        if (m_viewers.empty() && m_sessionStart && m_device.isConnected()) {
+            std::cout << "[RELAY] No viewers left, stopping the session\n";
+            m_device.sendMessage(makeMessage<ClientStopUpdating>());
+            m_sessionStart.reset();
+        }
+    });
+}
+
+void FRRelay::onMessage(const FRClient client, message<MsgTypes> &msg) {
+    switch (msg.header.id) {
+        case ServerPing:
+            // The round trip to the relay, the device only serves the relay
+            client->send(msg);
+            break;
+        case ClientStartUpdating:
+        case ClientStopUpdating:
+        case ClientSetSampleFrequency:
+        case ClientSetSensorHV:
+        case ClientMessage:
+            asio::post(m_strand, [this, client, msg]() { forwardCommand(client, msg); });
+            break;
+        case ClientSetReadingsCodecs: {
+            // Not forwarded: the relay picks the codec of the device for all the viewers
+            const bool bPacking = decodePayload<ClientSetReadingsCodecs>(msg).codecs &
+                                  codecMask(readings_codec::delta_packed);
+            std::scoped_lock lock(m_muxPackingViewers);
+            if (bPacking)
+                m_packingViewers.insert(client->getID());
+            else
+                m_packingViewers.erase(client->getID());
+            break;
+        }
+        case ClientDisconnect:
+            std::cout << '[' << client->getID() << "] Viewer Disconnects\n";
+            break;
+        default:
+            // Pings bounced by the viewers and the requests for other channels
+            break;
+    }
+}
+
+// ---- Private Methods ----
+
+void FRRelay::onDeviceMessage(message<MsgTypes> &msg) {
+    if (isReadings(msg.header.id)) {
+        relayReadings(msg);
+        ++m_nFramesRelayed;
+        return;
+    }
+
+    switch (msg.header.id) {
+        case ServerAccept:
+            asio::post(m_strand, [this]() {
+                std::cout << "[RELAY] Device accepted the relay\n";
+                m_bDeviceAccepted = true;
+                m_nFramesRelayed = 0;
+                sendTextToAll("Device connected");
+                // Older firmware ignores it and sends raw readings
+                m_device.sendMessage(makeMessage<ClientSetReadingsCodecs>({ codecMask(readings_codec::delta_packed) }));
+
+                // The device lost the session when the connection dropped
+                if (m_sessionStart)
+                    m_device.sendMessage(*m_sessionStart);
+            });
+            break;
+        case ServerDeny:
+            std::cout << "[RELAY] Device denied the connection\n";
+            break;
+        case ServerFinishedUpload:
+            asio::post(m_strand, [this]() { m_sessionStart.reset(); });
+            sendMessageToAllClients(msg);
+            break;
+        case ServerMessage:
+            sendMessageToAllClients(msg);
+            break;
+        case ClientPing:
+            // Bounced to the device, as a desktop app would
+            asio::post(m_strand, [this, msg]() { m_device.sendMessage(msg); });
+            break;
+        default:
+            break;
+    }
+}
+
+void FRRelay::relayReadings(const message<MsgTypes> &msg) {
+    // Encoded once, shared by all the viewers
+    if (msg.header.id != ServerReadingsPacked) {
+        sendMessageToAllClients(encodeFrame(msg));
+        return;
+    }
+
+    sendMessageToClients(encodeFrame(msg), [this](const FRClient &viewer) { return isPackingViewer(viewer->getID()); });
+
+    // Not holding the lock while the predicates take it under the one of the connections
+    size_t nPackingViewers;
+    {
+        std::scoped_lock lock(m_muxPackingViewers);
+        nPackingViewers = m_packingViewers.size();
+    }
+    if (nPackingViewers >= getClientsCount())
+        return;
+
+    try {
+        sendMessageToClients(encodeFrame(unpackReadings(msg)),
+                             [this](const FRClient &viewer) { return !isPackingViewer(viewer->getID()); });
+    } catch (const std::exception &e) {
+        std::cerr << "[RELAY] Cannot unpack readings from the device: " << e.what() << '\n';
+    }
+}
+
+bool FRRelay::isPackingViewer(uint32_t id) {
+    std::scoped_lock lock(m_muxPackingViewers);
+    return m_packingViewers.contains(id);
+}
+
+void FRRelay::onDeviceDisconnected() {
+    asio::post(m_strand, [this]() {
+        std::cout << "[RELAY] Device disconnected after " << m_nFramesRelayed << " frames\n";
+        m_bDeviceAccepted = false;
+        sendTextToAll("Device disconnected, reconnecting");
+    });
+}
+
+void FRRelay::connectToDevice() {
+    if (!m_device.isConnected())
+        m_device.connect(m_deviceHost, m_nDevicePort);
+
+    // A connection that fails or drops is tried again at the next period
+    m_pReconnectTimer->expires_after(RECONNECT_PERIOD);
+    m_pReconnectTimer->async_wait([this](asio::error_code ec) {
+        if (!ec)
+            connectToDevice();
+    });
+}
+
+void FRRelay::forwardCommand(const std::shared_ptr<tcp_connection> &client, const message<MsgTypes> &msg) {
+    if (m_viewers.empty() || m_viewers.front() != client) {
+        std::cout << '[' << client->getID() << "] Command " << int(msg.header.id) << " refused, not the owner\n";
+        sendText(client, "Only the owner controls the device");
+        return;
+    }
+
+    if (!m_bDeviceAccepted) {
+        sendText(client, "Device not connected");
+        return;
+    }
+
+    if (msg.header.id == ClientStartUpdating)
+        m_sessionStart = msg;
+    else if (msg.header.id == ClientStopUpdating)
+        m_sessionStart.reset();
+
+    m_device.sendMessage(msg);
+}
+
+void FRRelay::sendText(const std::shared_ptr<tcp_connection> &client, const std::string &text) {
+    message<MsgTypes> msg;
+    msg.header.id = ServerMessage;
+    msg.body.resize(std::min<size_t>(text.size(), MAX_BODY_SIZE));
+    std::memcpy(msg.body.data(), text.data(), msg.body.size());
+    msg.header.size = static_cast<uint32_t>(msg.body.size());
+    sendMessage(client, std::move(msg));
+}
+
+void FRRelay::sendTextToAll(const std::string &text) {
+    for (auto &viewer: m_viewers)
+        sendText(viewer, text);
+}
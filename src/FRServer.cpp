@@ -12,18 +12,34 @@
 
 bool FRServer::onClientConnect(std::shared_ptr<tcp_connection> client) {
     std::cout << "[SERVER] New Client Connected\n";
-    message<MsgTypes> newMessage;
-    newMessage.header.id = ServerAccept;
-    newMessage << client->getID();
-    sendMessage(client, newMessage);
+    client->setOverflowPolicy(m_overflowPolicy, m_nHighWaterMark);
+
+    sendMessage(client, makeMessage<ServerAccept>({ client->getID() }));
     std::cout << '[' << client->getID() << "] Client Validated" << std::endl;
     return true;
 }
 
 void FRServer::onClientDisconnect(std::shared_ptr<tcp_connection> client) {
-    std::cout << '[' << client->getID() << "] Client Disconnected\n";
-    if (m_bIsUpdating)
-        stopUpdating();
+    std::cout << '[' << client->getID() << "] Client Disconnected. Sent " << client->getMessagesWrittenCount()
+              << " messages, " << client->getMessagesPerWrite() << " per write. Peak queue depth "
+              << client->getPeakQueueDepth() << ", dropped " << client->getMessagesDroppedCount() << ", coalesced "
+              << client->getMessagesCoalescedCount() << '\n';
+    if (client->getRoundTripTimes().count() > 0)
+        std::cout << '[' << client->getID() << "] Round trip " << client->getRoundTripTimes().getSummary() << '\n';
+    asio::post(m_strand, [this, id = client->getID()]() {
+        closeDatagramChannel(id);
+        closeSharedMemoryChannel(id);
+        m_replays.erase(id);
+        m_packingClients.erase(id);
+        bool bCanResume = m_sequencedClients.erase(id) > 0;
+
+        if (m_bIsUpdating && getClientsCount() == 0) {
+            if (bCanResume)
+                waitForResume();
+            else
+                stopUpdating();
+        }
+    });
 }
 
 void FRServer::onMessage(const FRClient client, message<MsgTypes> &msg) {
@@ -35,13 +51,39 @@ void FRServer::onMessage(const FRClient client, message<MsgTypes> &msg) {
             onPingReceive(client, msg);
             break;
         case ClientStartUpdating:
-            startUpdating(msg);
+            asio::post(m_strand, [this, msg]() mutable { startUpdating(msg); });
             break;
         case ClientStopUpdating:
-            stopUpdating();
+            asio::post(m_strand, [this]() { stopUpdating(); });
+            break;
+        case ClientSetReadingsCodecs:
+            asio::post(m_strand, [this, id = client->getID(), request = decodePayload<ClientSetReadingsCodecs>(msg)]() {
+                if (request.codecs & codecMask(readings_codec::delta_packed))
+                    m_packingClients.insert(id);
+                else
+                    m_packingClients.erase(id);
+            });
+            break;
+        case ClientOpenDatagramChannel:
+            asio::post(m_strand, [this, client, port = decodePayload<ClientOpenDatagramChannel>(msg).port]() {
+                openDatagramChannel(client, port);
+            });
+            break;
+        case ClientOpenSharedMemoryChannel: {
+            auto payload = decodePayload<ClientOpenSharedMemoryChannel>(msg);
+            std::string name{ payload.name, strnlen(payload.name, sizeof(payload.name)) };
+            asio::post(m_strand, [this, client, name = std::move(name)]() { openSharedMemoryChannel(client, name); });
             break;
+        }
         case ClientDisconnect:
             std::cout << '[' << client->getID() << "] Client Disconnects\n";
+            // Leaving on purpose, it will not resume
+            asio::post(m_strand, [this, id = client->getID()]() { m_sequencedClients.erase(id); });
+            break;
+        case ClientResumeSession:
+            asio::post(m_strand, [this, client, request = decodePayload<ClientResumeSession>(msg)]() {
+                resumeSession(client, request);
+            });
             break;
         case MessageAll:
             break;
@@ -53,22 +95,68 @@ void FRServer::onMessage(const FRClient client, message<MsgTypes> &msg) {
 // ---- Public Methods ----
 
 void FRServer::togglePingUpdate() {
-    if (!m_bIsPinging) {
-        m_bIsPinging = true;
-        pingAllHandler();
-    } else {
-        m_bIsPinging = false;
-    }
+    asio::post(m_strand, [this]() {
+        if (!m_bIsPinging) {
+            m_bIsPinging = true;
+            pingAllHandler();
+        } else {
+            m_bIsPinging = false;
+        }
+    });
 }
 
 void FRServer::pingAll() {
     std::cout << "[SERVER]: Ping All\n";
-    message<MsgTypes> msg;
-    msg.header.id = ClientPing;
+    sendMessageToAllClients(makeMessage<ClientPing>({ std::chrono::steady_clock::now() }));
+}
+
+void FRServer::setReadingsBatching(uint16_t maxSamples, uint32_t maxSpanMicros) {
+    m_bBatchReadings = maxSamples > 0;
+    m_readingsBatch.configure(maxSamples, maxSpanMicros);
+    m_readingsBatch.clear();
+}
+
+void FRServer::setReadingsPacking(bool bPack) {
+    m_bPackReadings = bPack;
+}
+
+void FRServer::setDatagramsEnabled(bool bEnabled) {
+    m_bDatagramsEnabled = bEnabled;
+}
+
+void FRServer::setSharedMemoryEnabled(bool bEnabled) {
+    m_bSharedMemoryEnabled = bEnabled;
+}
+
+void FRServer::setOverflowPolicy(tcp_connection::overflow_policy policy, size_t highWaterMark) {
+    if (policy == tcp_connection::overflow_policy::block)
+        throw std::invalid_argument("The readings are produced on the asio threads, which must never block");
+
+    m_overflowPolicy = policy;
+    m_nHighWaterMark = highWaterMark;
+}
 
-    std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
-    msg << timeNow;
-    sendMessageToAllClients(msg);
+void FRServer::printStatsEvery(asio::chrono::seconds period) {
+    asio::post(m_strand, [this, period]() {
+        m_statsPeriod = period;
+        m_pStatsTimer->cancel();
+        if (period.count() > 0)
+            printStats();
+    });
+}
+
+void FRServer::sendReadings(const RawReadings_t &readings) {
+    auto timestamp = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - m_startUpdateTime).count());
+
+    if (!m_bBatchReadings) {
+        broadcastReadings(makeMessage<ServerReadings>({ readings, timestamp }));
+        return;
+    }
+
+    m_readingsBatch.push(readings, timestamp);
+    if (m_readingsBatch.isReady(timestamp))
+        flushReadings();
 }
 
 // ---- Private Methods ----
@@ -90,12 +178,13 @@ void FRServer::respondToPing(const std::shared_ptr<tcp_connection> &client, cons
 }
 
 void FRServer::onPingReceive(const std::shared_ptr<tcp_connection> &client, message<MsgTypes> &msg) {
-    std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
-    std::chrono::system_clock::time_point timeThen;
-    msg >> timeThen;
+    auto roundTrip = std::chrono::steady_clock::now() - decodePayload<ClientPing>(msg).time;
+    auto &roundTripTimes = client->getRoundTripTimes();
+    roundTripTimes.record(roundTrip);
+
     std::cout << '[' << client->getID() << "] Ping: "
-              << std::chrono::duration<double>(timeNow - timeThen).count() * 1000
-              << " ms.\n";
+              << std::chrono::duration<double>(roundTrip).count() * 1000
+              << " ms. " << roundTripTimes.getSummary() << '\n';
 }
 
 void FRServer::updateHelper() {
@@ -115,19 +204,253 @@ void FRServer::updateHelper() {
 
 void FRServer::startUpdating(message<MsgTypes> &msg) {
     if (!m_bIsUpdating) {
-        uint16_t frequency;
-        msg >> frequency;
+        auto request = decodePayload<ClientStartUpdating>(msg);
+        uint16_t frequency = request.frequency;
+
+        // Packed only if every client can decode it. Those connecting later that cannot get the batches unpacked.
+        bool bPack = m_bPackReadings && !m_packingClients.empty() && m_packingClients.size() >= getClientsCount();
+        m_readingsBatch.setCodec(bPack ? readings_codec::delta_packed : readings_codec::raw);
+
         auto delay = static_cast<int>(1.0 / frequency * 1'000);
         m_nSamplingPeriodMilliseconds = asio::chrono::milliseconds{ delay };
+        m_startUpdateTime = std::chrono::steady_clock::now();
+        m_readingsBatch.clear();
         m_bIsUpdating = true;
         updateHelper();
 
         std::cout << "[SERVER]: Start updating width sampling period of " << m_nSamplingPeriodMilliseconds.count()
-                  << " ms.\n";
+                  << " ms" << (bPack ? ", packed readings" : "") << ".\n";
     }
 }
 
 void FRServer::stopUpdating() {
     m_bIsUpdating = false;
+    m_pResumeTimer->cancel();
+    // Send the last partial batch, then tell the clients the session is over as the firmware does
+    flushReadings();
+    sendMessageToAllClients(makeMessage<ServerFinishedUpload>());
     std::cout << "[SERVER]: Stop updating\n";
+
+    if (m_datagramSender.getSentCount() > 0 || m_datagramSender.getFailedCount() > 0)
+        std::cout << "[SERVER]: Sent " << m_datagramSender.getSentCount() << " datagrams, "
+                  << m_datagramSender.getFailedCount() << " failed\n";
+}
+
+void FRServer::flushReadings() {
+    if (m_readingsBatch.empty())
+        return;
+
+    broadcastReadings(m_readingsBatch.take());
+}
+
+void FRServer::broadcastReadings(const message<MsgTypes> &msg) {
+    const uint32_t sequence = m_nReadingsSequence++;
+    auto sequenced = encodeFrame(makeSequencedReadings(sequence, msg));
+    m_replayBuffer.push(sequence, sequenced);
+
+    // The clients still replaying get this frame from the replay buffer, after the older ones
+    for (auto &[id, sender]: m_sharedMemoryClients)
+        if (!m_replays.contains(id))
+            sender->send(sequenced);
+
+    if (!m_datagramClients.empty()) {
+        auto datagram = encodeDatagram(sequence, msg);
+        for (auto &[id, client]: m_datagramClients) {
+            if (m_replays.contains(id) || m_sharedMemoryClients.contains(id))
+                continue;
+            m_datagramSender.send(datagram, client.endpoint);
+            ++client.nDatagrams;
+        }
+    }
+
+    auto isPlainClient = [this](const std::shared_ptr<tcp_connection> &client) {
+        return !hasReadingsChannel(client->getID()) && !m_sequencedClients.contains(client->getID());
+    };
+    if (msg.header.id == ServerReadingsPacked) {
+        sendMessageToClients(encodeFrame(msg), [&](const std::shared_ptr<tcp_connection> &client) {
+            return isPlainClient(client) && m_packingClients.contains(client->getID());
+        });
+        if (m_packingClients.size() < getClientsCount())
+            sendMessageToClients(encodeFrame(unpackReadings(msg)), [&](const std::shared_ptr<tcp_connection> &client) {
+                return isPlainClient(client) && !m_packingClients.contains(client->getID());
+            });
+    } else {
+        sendMessageToClients(encodeFrame(msg), isPlainClient);
+    }
+
+    if (!m_sequencedClients.empty())
+        sendMessageToClients(sequenced, [this](const std::shared_ptr<tcp_connection> &client) {
+            const uint32_t id = client->getID();
+            return m_sequencedClients.contains(id) && !hasReadingsChannel(id) && !m_replays.contains(id);
+        });
+
+    if (!m_replays.empty())
+        pumpReplays();
+}
+
+bool FRServer::hasReadingsChannel(uint32_t clientId) const {
+    return m_datagramClients.contains(clientId) || m_sharedMemoryClients.contains(clientId);
+}
+
+void FRServer::openDatagramChannel(const std::shared_ptr<tcp_connection> &client, uint16_t port) {
+    if (port == 0) {
+        closeDatagramChannel(client->getID());
+        return;
+    }
+
+    if (!m_bDatagramsEnabled) {
+        std::cout << '[' << client->getID() << "] Datagrams disabled, readings stay on TCP\n";
+        return;
+    }
+
+    asio::ip::udp::endpoint endpoint{ client->getRemoteAddress(), port };
+    m_datagramClients[client->getID()] = { endpoint, 0 };
+    std::cout << '[' << client->getID() << "] Readings over UDP to " << endpoint << '\n';
+    handOverReadings(client);
+}
+
+void FRServer::closeDatagramChannel(uint32_t clientId) {
+    auto it = m_datagramClients.find(clientId);
+    if (it == m_datagramClients.end())
+        return;
+
+    std::cout << '[' << clientId << "] Readings over TCP. Sent " << it->second.nDatagrams << " datagrams\n";
+    m_datagramClients.erase(it);
+}
+
+void FRServer::openSharedMemoryChannel(const std::shared_ptr<tcp_connection> &client, const std::string &name) {
+    closeSharedMemoryChannel(client->getID());
+    if (name.empty())
+        return;
+
+    // The client must be on this host, or the name refers to a ring it cannot read
+    if (!m_bSharedMemoryEnabled || !client->getRemoteAddress().is_loopback()) {
+        std::cout << '[' << client->getID() << "] Shared memory not available, readings stay on "
+                  << (m_datagramClients.contains(client->getID()) ? "UDP\n" : "TCP\n");
+        return;
+    }
+
+    try {
+        m_sharedMemoryClients[client->getID()] = std::make_unique<shm_sender>(name);
+    } catch (std::exception const &e) {
+        std::cout << '[' << client->getID() << "] Cannot open shared memory channel: " << e.what() << '\n';
+        return;
+    }
+
+    std::cout << '[' << client->getID() << "] Readings through shared memory " << name << '\n';
+    handOverReadings(client);
+}
+
+void FRServer::closeSharedMemoryChannel(uint32_t clientId) {
+    auto it = m_sharedMemoryClients.find(clientId);
+    if (it == m_sharedMemoryClients.end())
+        return;
+
+    std::cout << '[' << clientId << "] Readings over " << (m_datagramClients.contains(clientId) ? "UDP" : "TCP")
+              << ". Sent " << it->second->getSentCount() << " frames through shared memory, dropped "
+              << it->second->getDroppedCount() << '\n';
+    m_sharedMemoryClients.erase(it);
+}
+
+void FRServer::handOverReadings(const std::shared_ptr<tcp_connection> &client) {
+    if (m_sequencedClients.contains(client->getID()) && !m_replays.contains(client->getID()) &&
+        client->getQueueDepth() > 0) {
+        m_replays[client->getID()] = { client, m_replayBuffer.next(), 0 };
+        pumpReplays();
+    }
+}
+
+void FRServer::resumeSession(const std::shared_ptr<tcp_connection> &client, const resume_payload &request) {
+    // Frames of another run, or no longer buffered, cannot be sent again
+    uint32_t first = m_replayBuffer.next();
+    if (request.epoch == m_nEpoch) {
+        if (m_replayBuffer.contains(request.sequence))
+            first = request.sequence;
+        else if (static_cast<int32_t>(request.sequence - m_replayBuffer.oldest()) < 0)
+            first = m_replayBuffer.oldest();
+    }
+
+    m_sequencedClients.insert(client->getID());
+    sendMessage(client, makeMessage<ServerResumeSession>({ m_nEpoch, first }));
+
+    if (first != m_replayBuffer.next()) {
+        std::cout << '[' << client->getID() << "] Resuming from frame " << first << ", "
+                  << m_replayBuffer.next() - first << " frames to replay, "
+                  << (request.epoch == m_nEpoch ? first - request.sequence : 0) << " lost\n";
+        m_replays[client->getID()] = { client, first, 0 };
+        pumpReplays();
+    }
+}
+
+void FRServer::pumpReplays() {
+    for (auto it = m_replays.begin(); it != m_replays.end();) {
+        auto &[id, replay] = *it;
+        if (!replay.client->isConnected()) {
+            it = m_replays.erase(it);
+            continue;
+        }
+
+        // Frames overwritten while the client was catching up are lost
+        if (replay.next != m_replayBuffer.next() && !m_replayBuffer.contains(replay.next))
+            replay.next = m_replayBuffer.oldest();
+
+        // Stay well below the high-water mark, so that the overflow policy never drops replayed frames
+        while (replay.next != m_replayBuffer.next() &&
+               replay.client->getQueueDepth() < replay.client->getHighWaterMark() / 2) {
+            replay.client->send(m_replayBuffer.at(replay.next++));
+            ++replay.nReplayed;
+        }
+
+        // A client on UDP or shared memory goes back to it once the replayed frames are written, or the next frames
+        // would overtake them
+        bool bDone = replay.next == m_replayBuffer.next() &&
+                     (!hasReadingsChannel(id) || replay.client->getQueueDepth() == 0);
+
+        if (bDone) {
+            if (replay.nReplayed > 0)
+                std::cout << '[' << id << "] Resumed, replayed " << replay.nReplayed << " frames\n";
+            it = m_replays.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if (!m_replays.empty()) {
+        m_pReplayTimer->expires_after(REPLAY_PERIOD);
+        m_pReplayTimer->async_wait([this](asio::error_code ec) {
+            if (!ec)
+                pumpReplays();
+        });
+    }
+}
+
+void FRServer::waitForResume() {
+    std::cout << "[SERVER]: No clients left, keep updating for " << RESUME_TIMEOUT.count()
+              << " s in case one resumes\n";
+
+    m_pResumeTimer->expires_after(RESUME_TIMEOUT);
+    m_pResumeTimer->async_wait([this](asio::error_code ec) {
+        if (!ec && m_bIsUpdating && getClientsCount() == 0)
+            stopUpdating();
+    });
+}
+
+void FRServer::printStats() {
+    std::unordered_map<uint32_t, connection_stats> stats;
+    for (auto &current: getConnectionStats()) {
+        auto last = m_lastStats.find(current.id);
+        if (last != m_lastStats.end()) {
+            auto rates = connection_rates::between(last->second, current);
+            std::cout << '[' << current.id << "] " << rates.bytesOut / 1000 << " kB/s, " << rates.framesOut
+                      << " frames/s out, " << rates.bytesIn / 1000 << " kB/s in. Total " << current << '\n';
+        }
+        stats.emplace(current.id, current);
+    }
+    m_lastStats = std::move(stats);
+
+    m_pStatsTimer->expires_after(m_statsPeriod);
+    m_pStatsTimer->async_wait([this](asio::error_code ec) {
+        if (!ec)
+            printStats();
+    });
 }
@@ -0,0 +1,68 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+// Firmware that predates the message schemas accepts the client with an empty ServerAccept, which must still reach
+// onMessage, with either connection implementation. Exits with 1 if it does not.
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include "networking/client_interface.h"
+
+using namespace fortress::net;
+
+class accept_client : public client_interface {
+public:
+    std::atomic<bool> bAccepted{ false };
+
+    using client_interface::client_interface;
+
+    void onServerDisconnected() override {}
+
+protected:
+    void onMessage(message<MsgTypes> &msg) override {
+        if (msg.header.id == ServerAccept && !decodeOptionalPayload<ServerAccept>(msg))
+            bAccepted = true;
+    }
+};
+
+// A device that writes the header of an empty ServerAccept, as the old firmware did
+static bool emptyAcceptReachesClient(connection_impl impl) {
+    asio::io_context context;
+    asio::ip::tcp::acceptor acceptor{ context, { asio::ip::address_v4::loopback(), 0 } };
+    asio::ip::tcp::socket device{ context };
+    const message_header<MsgTypes> accept{ ServerAccept, 0 };
+    acceptor.async_accept(device, [&](asio::error_code ec) {
+        if (!ec)
+            asio::write(device, asio::buffer(&accept, sizeof(accept)));
+    });
+
+    accept_client client{ context };
+    client.setConnectionImpl(impl);
+    client.connect("127.0.0.1", acceptor.local_endpoint().port());
+    std::thread thread{ [&context]() { context.run(); } };
+
+    for (int i = 0; i < 100 && !client.bAccepted; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    client.disconnect();
+    context.stop();
+    thread.join();
+    return client.bAccepted;
+}
+
+int main() {
+    for (auto impl: { connection_impl::callbacks, connection_impl::coroutines }) {
+        const bool bAccepted = emptyAcceptReachesClient(impl);
+        std::cout << "Empty ServerAccept " << (bAccepted ? "reaches" : "DOES NOT REACH") << " the "
+                  << (impl == connection_impl::callbacks ? "callbacks" : "coroutines") << " client\n";
+        if (!bAccepted)
+            return 1;
+    }
+    return 0;
+}
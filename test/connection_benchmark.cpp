@@ -0,0 +1,109 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+// Loopback benchmark of the connection implementations: readings frames go from one connection to another in
+// bursts, the next burst is sent when the last frame of the previous one is received. Every heap allocation made
+// in the meantime, by the connections or by asio, is counted.
+
+#include "networking/coro_connection.h"
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+using namespace fortress::net;
+
+static std::atomic<uint64_t> nAllocations{ 0 };
+
+void *operator new(std::size_t size) {
+    nAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *pointer = std::malloc(size))
+        return pointer;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+constexpr size_t N_MESSAGES = 200'000;
+
+message<MsgTypes> makeReadingsMessage() {
+    message<MsgTypes> msg;
+    msg.header.id = ServerReadings;
+    for (uint16_t ch = 0; ch < fortress::consts::N_CHANNELS; ++ch)
+        msg << ch;
+    msg << uint32_t{ 0 };
+    return msg;
+}
+
+void run(const char *name, connection_impl impl, tcp_connection::read_mode readMode, size_t burst) {
+    asio::io_context context;
+    asio::ip::tcp::acceptor acceptor{ context, { asio::ip::address_v4::loopback(), 0 }};
+
+    asio::ip::tcp::socket senderSocket{ asio::make_strand(context) };
+    asio::ip::tcp::socket receiverSocket{ asio::make_strand(context) };
+    receiverSocket.connect(acceptor.local_endpoint());
+    acceptor.accept(senderSocket);
+
+    const shared_frame frame = encodeFrame(makeReadingsMessage());
+    std::shared_ptr<tcp_connection> sender;
+    size_t nReceived = 0;
+
+    auto sendBurst = [&]() {
+        for (size_t i = 0; i < burst; ++i)
+            sender->send(frame);
+    };
+
+    sender = makeConnection(impl, context, std::move(senderSocket), tcp_connection::owner::server,
+                            [](owned_message<MsgTypes> &) {});
+    auto receiver = makeConnection(impl, context, std::move(receiverSocket), tcp_connection::owner::client,
+                                   [&](owned_message<MsgTypes> &) {
+                                       if (++nReceived == N_MESSAGES)
+                                           context.stop();
+                                       else if (nReceived % burst == 0)
+                                           sendBurst();
+                                   }, nullptr, readMode);
+
+    sender->connectToClient(0);
+    receiver->connectToClient(1);
+
+    const uint64_t nAllocationsBefore = nAllocations;
+    auto start = std::chrono::steady_clock::now();
+
+    asio::post(context, sendBurst);
+    context.run();
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    const uint64_t nAllocated = nAllocations - nAllocationsBefore;
+
+    std::cout << std::left << std::setw(24) << name
+              << std::setw(8) << (readMode == tcp_connection::read_mode::stream ? "stream" : "exact")
+              << "burst " << std::setw(5) << burst
+              << std::setw(10) << elapsed.count() / N_MESSAGES << " ns/message "
+              << std::setw(10) << static_cast<double>(nAllocated) / N_MESSAGES << " allocations/message "
+              << std::setw(8) << sender->getMessagesPerWrite() << " messages/write\n";
+
+    sender->closeSocket();
+    receiver->closeSocket();
+}
+
+int main() {
+    std::cout << "Sending " << N_MESSAGES << " readings frames over loopback\n";
+
+    for (auto readMode: { tcp_connection::read_mode::exact, tcp_connection::read_mode::stream }) {
+        for (size_t burst: { 1, 64 }) {
+            run("tcp_connection", connection_impl::callbacks, readMode, burst);
+            run("coro_connection", connection_impl::coroutines, readMode, burst);
+        }
+    }
+
+    return 0;
+}
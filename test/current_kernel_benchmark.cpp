@@ -0,0 +1,59 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+// Conversion of the ADC readings to currents with each kernel this CPU supports, reporting time/sample. Before
+// timing, each kernel is checked to give the same bits as the scalar one.
+//
+// Usage: CurrentKernelBenchmark [--benchmark_filter=avx2]
+
+#include <benchmark/benchmark.h>
+#include <iostream>
+#include "current_kernel_check.h"
+
+using namespace fortress;
+using namespace fortress::net;
+
+static const std::vector<readings_sample> SAMPLES = makeIntegratorSamples(4096);
+
+static void BM_ConvertCurrents(benchmark::State &state, current_kernel kernel) {
+    if (!matchesScalar(kernel, SAMPLES)) {
+        state.SkipWithError("Results differ from the scalar kernel");
+        return;
+    }
+
+    const auto count = static_cast<size_t>(state.range(0));
+    std::vector<ChannelCurrents_t> currents(count);
+    std::vector<uint32_t> deltaTimes(count);
+    integrator_state integrators;
+
+    size_t first = 0;
+    for (auto _: state) {
+        convertCurrents(kernel, CHECK_CONVERSION, SAMPLES.data() + first, count, integrators, currents.data(),
+                        deltaTimes.data());
+        benchmark::DoNotOptimize(currents.data());
+        first = (first + count) % (SAMPLES.size() - count + 1);
+    }
+    state.counters["time/sample"] = benchmark::Counter(static_cast<double>(count),
+                                                       benchmark::Counter::kIsIterationInvariantRate |
+                                                       benchmark::Counter::kInvert);
+}
+
+int main(int argc, char **argv) {
+    // One sample, as ServerReadings carries, and a full batch
+    for (auto kernel: availableCurrentKernels())
+        benchmark::RegisterBenchmark((std::string("BM_ConvertCurrents/") + toString(kernel)).c_str(),
+                                     BM_ConvertCurrents, kernel)->Arg(1)->Arg(MAX_SAMPLES_PER_BATCH);
+
+    std::cout << "Selected kernel: " << toString(selectedCurrentKernel()) << '\n';
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
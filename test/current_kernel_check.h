@@ -0,0 +1,67 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+// Samples and checks shared by Test and CurrentKernelBenchmark: every kernel must give the same bits as the scalar
+// one.
+
+#ifndef FORTRESS_CURRENT_KERNEL_CHECK_H
+#define FORTRESS_CURRENT_KERNEL_CHECK_H
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "CurrentKernel.h"
+
+// The circuit of SharedParams, which cannot be included without Qt
+inline constexpr fortress::current_conversion CHECK_CONVERSION{
+        65535, 4.096f, static_cast<float>(8.2 / 2.7), 100, 65500 };
+
+// Samples as the integrators produce them: ramps reset when crossing the threshold, with a glitch now and then
+inline std::vector<fortress::net::readings_sample> makeIntegratorSamples(size_t count) {
+    std::vector<fortress::net::readings_sample> samples(count);
+    fortress::net::RawReadings_t readings{};
+
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t ch = 0; ch < readings.size(); ++ch) {
+            readings[ch] += static_cast<uint16_t>(37 * (ch + 1) + i % 11);
+            if (readings[ch] > CHECK_CONVERSION.integratorThreshold)
+                readings[ch] -= CHECK_CONVERSION.integratorThreshold;
+            if (i % 997 == ch)
+                readings[ch] -= std::min<uint16_t>(readings[ch], 500);
+        }
+        samples[i] = { readings, static_cast<uint32_t>(i * 100) };   // 10 kHz
+    }
+    return samples;
+}
+
+// Converted in uneven chunks, to check the state carried between calls too
+inline std::vector<fortress::ChannelCurrents_t> convertAll(fortress::current_kernel kernel,
+                                                           const std::vector<fortress::net::readings_sample> &samples,
+                                                           std::vector<uint32_t> &deltaTimes) {
+    std::vector<fortress::ChannelCurrents_t> currents(samples.size());
+    deltaTimes.resize(samples.size());
+    fortress::integrator_state integrators;
+
+    for (size_t first = 0, chunk = 1; first < samples.size(); first += chunk, chunk = chunk * 2 + 1) {
+        chunk = std::min(chunk, samples.size() - first);
+        fortress::convertCurrents(kernel, CHECK_CONVERSION, samples.data() + first, chunk, integrators,
+                                  currents.data() + first, deltaTimes.data() + first);
+    }
+    return currents;
+}
+
+inline bool matchesScalar(fortress::current_kernel kernel, const std::vector<fortress::net::readings_sample> &samples) {
+    std::vector<uint32_t> expectedDeltaTimes;
+    std::vector<uint32_t> deltaTimes;
+    const auto expected = convertAll(fortress::current_kernel::scalar, samples, expectedDeltaTimes);
+    const auto currents = convertAll(kernel, samples, deltaTimes);
+
+    return deltaTimes == expectedDeltaTimes &&
+           std::memcmp(currents.data(), expected.data(), currents.size() * sizeof(fortress::ChannelCurrents_t)) == 0;
+}
+
+#endif //FORTRESS_CURRENT_KERNEL_CHECK_H
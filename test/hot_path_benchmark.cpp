@@ -0,0 +1,224 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+// Microbenchmarks of the path every sample takes on the desktop, from the message body to the plot. Each benchmark
+// reports time/sample: at 10 kHz the whole path must stay well below 100 us per sample.
+//
+// Usage: HotPathBenchmark [--benchmark_filter=Chart]
+
+#include <QGuiApplication>
+#include <QtCharts/QLineSeries>
+#include <benchmark/benchmark.h>
+#include "Backend.h"
+#include "ChartModel.h"
+#include "networking/readings_codec.h"
+
+// Samples as the integrators produce them: ramps reset when crossing the threshold
+static std::vector<readings_sample> makeSamples(size_t count) {
+    std::vector<readings_sample> samples(count);
+    RawReadings_t readings{};
+
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t ch = 0; ch < readings.size(); ++ch) {
+            readings[ch] += static_cast<uint16_t>(37 * (ch + 1) + i % 11);
+            if (readings[ch] > SharedParams::integratorThreshold)
+                readings[ch] -= SharedParams::integratorThreshold;
+        }
+        samples[i] = { readings, static_cast<uint32_t>(i * 100) };   // 10 kHz
+    }
+    return samples;
+}
+
+static const std::vector<readings_sample> SAMPLES = makeSamples(MAX_SAMPLES_PER_BATCH * 16);
+
+static void setTimePerSample(benchmark::State &state, size_t samplesPerIteration) {
+    state.counters["time/sample"] = benchmark::Counter(static_cast<double>(samplesPerIteration),
+                                                       benchmark::Counter::kIsIterationInvariantRate |
+                                                       benchmark::Counter::kInvert);
+}
+
+// Access to the steps of the readings path of Backend
+class BackendBenchmark {
+public:
+    static void openFile(Backend &backend) {
+        backend.openFile(10'000);
+    }
+
+    static uint32_t convertReadings(Backend &backend, const readings_sample &sample, CurrentReadings_t &currents) {
+        uint32_t deltaTime;
+        fortress::convertCurrents(Backend::CURRENT_CONVERSION, &sample, 1, backend.m_integrators, &currents,
+                                  &deltaTime);
+        return deltaTime;
+    }
+
+    static void writeSample(Backend &backend, uint32_t time, uint32_t deltaTime, const CurrentReadings_t &currents) {
+        backend.writeSample({ time, deltaTime, backend.m_integrators.readings, currents });
+    }
+};
+
+// ---- Serialization ----
+
+static void BM_MessagePushSample(benchmark::State &state) {
+    size_t i = 0;
+    for (auto _: state) {
+        const auto &sample = SAMPLES[i++ % SAMPLES.size()];
+        message<MsgTypes> msg;
+        msg.header.id = ServerReadings;
+        for (auto reading: sample.readings)
+            msg << reading;
+        msg << sample.timestamp;
+        benchmark::DoNotOptimize(msg);
+    }
+    setTimePerSample(state, 1);
+}
+
+// Includes copying the message to pop from, a 28 bytes inline copy
+static void BM_MessagePopSample(benchmark::State &state) {
+    message<MsgTypes> encoded;
+    encoded.header.id = ServerReadings;
+    for (auto reading: SAMPLES.front().readings)
+        encoded << reading;
+    encoded << SAMPLES.front().timestamp;
+
+    for (auto _: state) {
+        auto msg = encoded;
+        readings_sample sample;
+        msg >> sample.timestamp;
+        for (auto it = sample.readings.rbegin(); it != sample.readings.rend(); ++it)
+            msg >> *it;
+        benchmark::DoNotOptimize(sample);
+    }
+    setTimePerSample(state, 1);
+}
+
+// ---- Backend ----
+
+// The whole path of a frame as it arrives: handed to the pipeline, which decodes, converts, records and draws it on
+// its own threads. Once the queues are full, time/sample is that of the slowest lossless stage. Arguments: samples
+// per frame, packed or not.
+static void BM_BackendOnReadings(benchmark::State &state) {
+    const auto nSamples = static_cast<size_t>(state.range(0));
+    const bool bPacked = state.range(1) != 0;
+
+    message<MsgTypes> msg;
+    if (nSamples == 1) {
+        msg = makeMessage<ServerReadings>(SAMPLES.front());
+    } else if (bPacked) {
+        if (!encodePackedReadings(reinterpret_cast<const uint8_t *>(SAMPLES.data()), nSamples, msg)) {
+            state.SkipWithError("Packing would not make the frame smaller");
+            return;
+        }
+    } else {
+        msg.header.id = ServerReadingsBatch;
+        for (size_t i = 0; i < nSamples; ++i)
+            appendPayload<ServerReadingsBatch>(msg, SAMPLES[i]);
+    }
+
+    ChartModel chartModel;
+    Backend backend{ &chartModel };
+    BackendBenchmark::openFile(backend);
+
+    for (auto _: state)
+        backend.onMessage(msg);
+    setTimePerSample(state, nSamples);
+}
+
+static void BM_BackendConvertReadings(benchmark::State &state) {
+    ChartModel chartModel;
+    Backend backend{ &chartModel };
+    CurrentReadings_t currents{};
+
+    size_t i = 0;
+    for (auto _: state) {
+        benchmark::DoNotOptimize(BackendBenchmark::convertReadings(backend, SAMPLES[i++ % SAMPLES.size()], currents));
+        benchmark::DoNotOptimize(currents);
+    }
+    setTimePerSample(state, 1);
+}
+
+// Csv formatting through the QTextStream of the session file
+static void BM_BackendWriteSample(benchmark::State &state) {
+    ChartModel chartModel;
+    Backend backend{ &chartModel };
+    BackendBenchmark::openFile(backend);
+
+    std::vector<CurrentReadings_t> currents(SAMPLES.size());
+    std::vector<uint32_t> deltaTimes(SAMPLES.size());
+    for (size_t i = 0; i < SAMPLES.size(); ++i)
+        deltaTimes[i] = BackendBenchmark::convertReadings(backend, SAMPLES[i], currents[i]);
+
+    size_t i = 0;
+    for (auto _: state) {
+        const size_t j = i++ % SAMPLES.size();
+        BackendBenchmark::writeSample(backend, SAMPLES[j].timestamp, deltaTimes[j], currents[j]);
+    }
+    setTimePerSample(state, 1);
+}
+
+// ---- ChartModel ----
+
+// Published once per full batch, as the display stage does
+static void BM_ChartInsertReadings(benchmark::State &state) {
+    ChartModel chartModel;
+    Backend backend{ &chartModel };
+
+    std::vector<ADCReadings_t> readings(SAMPLES.size());
+    std::vector<CurrentReadings_t> currents(SAMPLES.size());
+    for (size_t i = 0; i < SAMPLES.size(); ++i) {
+        BackendBenchmark::convertReadings(backend, SAMPLES[i], currents[i]);
+        std::copy(SAMPLES[i].readings.begin(), SAMPLES[i].readings.end(), readings[i].begin());
+    }
+
+    size_t i = 0;
+    for (auto _: state) {
+        const size_t j = i++ % SAMPLES.size();
+        chartModel.insertReadings(readings[j], currents[j]);
+        if (i % MAX_SAMPLES_PER_BATCH == 0)
+            chartModel.publishSnapshot();
+    }
+    setTimePerSample(state, 1);
+}
+
+// One call redraws a whole channel: time/sample is per point of the plot window
+static void BM_ChartUpdatePlotSeries(benchmark::State &state) {
+    ChartModel chartModel;
+    QLineSeries leftSeries;
+    QLineSeries rightSeries;
+
+    // Halfway through the window, so both series are filled
+    const ADCReadings_t readings{};
+    const CurrentReadings_t currents{};
+    for (int i = 0; i < SharedParams::plotWindowSizeInPoint / 2; ++i)
+        chartModel.insertReadings(readings, currents);
+    chartModel.publishSnapshot();
+
+    for (auto _: state)
+        chartModel.updatePlotSeries(&leftSeries, &rightSeries, 0);
+    setTimePerSample(state, SharedParams::plotWindowSizeInPoint);
+}
+
+BENCHMARK(BM_MessagePushSample);
+BENCHMARK(BM_MessagePopSample);
+BENCHMARK(BM_BackendOnReadings)->Args({ 1, 0 })->Args({ MAX_SAMPLES_PER_BATCH, 0 })->Args({ MAX_SAMPLES_PER_BATCH, 1 });
+BENCHMARK(BM_BackendConvertReadings);
+BENCHMARK(BM_BackendWriteSample);
+BENCHMARK(BM_ChartInsertReadings);
+BENCHMARK(BM_ChartUpdatePlotSeries);
+
+int main(int argc, char *argv[]) {
+    // The chart series need a GUI application, but no display
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication app(argc, argv);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,131 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+// Loopback benchmark of the asio backend, epoll or io_uring depending on how the tree is configured: many pairs of
+// connections exchange small readings frames in bursts, the next burst of a pair is sent when the last frame of
+// the previous one is received. Build it with and without FORTRESS_IO_URING, or run IoBackendBenchmarkUring, and
+// compare the throughput and the CPU time spent per message.
+//
+// Usage: IoBackendBenchmark -threads 1 -connections 16 -burst 64 -messages 2000000
+
+#include "networking/tcp_connection.h"
+#include "networking/io_backend.h"
+#include "argparse.h"
+#include <chrono>
+#include <thread>
+#include <sys/resource.h>
+
+using namespace fortress::net;
+
+message<MsgTypes> makeReadingsMessage() {
+    message<MsgTypes> msg;
+    msg.header.id = ServerReadings;
+    for (uint16_t ch = 0; ch < fortress::consts::N_CHANNELS; ++ch)
+        msg << ch;
+    msg << uint32_t{ 0 };
+    return msg;
+}
+
+// User and system time of the whole process
+std::chrono::duration<double, std::nano> cpuTime() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    auto toNanos = [](const timeval &time) {
+        return std::chrono::duration<double, std::nano>(std::chrono::seconds(time.tv_sec) +
+                                                        std::chrono::microseconds(time.tv_usec));
+    };
+    return toNanos(usage.ru_utime) + toNanos(usage.ru_stime);
+}
+
+struct connection_pair {
+    std::shared_ptr<tcp_connection> sender;
+    std::shared_ptr<tcp_connection> receiver;
+    size_t nReceived{ 0 };
+};
+
+void run(tcp_connection::read_mode readMode, unsigned nThreads, size_t nConnections, size_t burst, size_t nMessages) {
+    asio::io_context context;
+    asio::ip::tcp::acceptor acceptor{ context, { asio::ip::address_v4::loopback(), 0 }};
+
+    const shared_frame frame = encodeFrame(makeReadingsMessage());
+    const size_t nMessagesPerPair = std::max<size_t>(nMessages / nConnections / burst, 1) * burst;
+    std::vector<connection_pair> pairs(nConnections);
+    std::atomic<size_t> nPairsDone{ 0 };
+
+    auto sendBurst = [&frame, burst](connection_pair &pair) {
+        for (size_t i = 0; i < burst; ++i)
+            pair.sender->send(frame);
+    };
+
+    for (size_t i = 0; i < nConnections; ++i) {
+        asio::ip::tcp::socket senderSocket{ asio::make_strand(context) };
+        asio::ip::tcp::socket receiverSocket{ asio::make_strand(context) };
+        receiverSocket.connect(acceptor.local_endpoint());
+        acceptor.accept(senderSocket);
+
+        auto &pair = pairs[i];
+        pair.sender = std::make_shared<tcp_connection>(context, std::move(senderSocket), tcp_connection::owner::server,
+                                                       [](owned_message<MsgTypes> &) {});
+        pair.receiver = std::make_shared<tcp_connection>(
+                context, std::move(receiverSocket), tcp_connection::owner::client,
+                [&, &pair = pair](owned_message<MsgTypes> &) {
+                    if (++pair.nReceived == nMessagesPerPair) {
+                        if (++nPairsDone == nConnections)
+                            context.stop();
+                    } else if (pair.nReceived % burst == 0) {
+                        sendBurst(pair);
+                    }
+                }, nullptr, readMode);
+
+        pair.sender->connectToClient(static_cast<uint32_t>(2 * i));
+        pair.receiver->connectToClient(static_cast<uint32_t>(2 * i + 1));
+    }
+
+    const auto cpuStart = cpuTime();
+    const auto start = std::chrono::steady_clock::now();
+
+    for (auto &pair: pairs)
+        asio::post(context, [&]() { sendBurst(pair); });
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < nThreads; ++i)
+        threads.emplace_back([&context]() { context.run(); });
+    for (auto &thread: threads)
+        thread.join();
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    const auto cpu = cpuTime() - cpuStart;
+    const size_t nTotal = nMessagesPerPair * nConnections;
+
+    std::cout << std::left << std::setw(8) << (readMode == tcp_connection::read_mode::stream ? "stream" : "exact")
+              << std::setw(10) << nTotal / elapsed.count() * 1e3 << " M messages/s "
+              << std::setw(10) << cpu.count() / nTotal << " CPU ns/message "
+              << std::setw(8) << pairs.front().sender->getMessagesPerWrite() << " messages/write\n";
+}
+
+int main(int argc, char *argv[]) {
+    ArgumentParser parser(argc, argv);
+    parser.addArgument<int>("threads", 1);          // Threads running the asio context
+    parser.addArgument<int>("connections", 16);     // Pairs of connections
+    parser.addArgument<int>("burst", 64);           // Frames in flight per pair
+    parser.addArgument<int>("messages", 2'000'000); // Frames sent in total
+    parser.parseArguments();
+
+    const auto nThreads = static_cast<unsigned>(std::max(parser.getValue<int>("threads"), 1));
+    const auto nConnections = static_cast<size_t>(std::max(parser.getValue<int>("connections"), 1));
+    const auto burst = static_cast<size_t>(std::max(parser.getValue<int>("burst"), 1));
+    const auto nMessages = static_cast<size_t>(std::max(parser.getValue<int>("messages"), 1));
+
+    std::cout << "Backend " << ioBackendReport() << ": " << nMessages << " readings frames of "
+              << encodeFrame(makeReadingsMessage())->size() << " bytes over " << nConnections
+              << " loopback connections, bursts of " << burst << ", " << nThreads << " thread(s)\n";
+
+    for (auto readMode: { tcp_connection::read_mode::exact, tcp_connection::read_mode::stream })
+        run(readMode, nThreads, nConnections, burst, nMessages);
+
+    return 0;
+}
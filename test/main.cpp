@@ -1,13 +1,37 @@
 #include "networking/message.h"
 #include "constants.h"
+#include "current_kernel_check.h"
 #include <iostream>
 #include <cstdint>
 #include <cstring>
 #include <bitset>
 #include <iomanip>
+#include <chrono>
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <new>
 
 using namespace fortress::net;
 
+// Count heap allocations to check the readings path does not allocate
+static std::atomic<size_t> nAllocations{ 0 };
+
+void *operator new(size_t size) {
+    ++nAllocations;
+    if (void *ptr = std::malloc(size))
+        return ptr;
+    throw std::bad_alloc{};
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
 void printByteArray(char *begin, const char *end) {
     for (auto *ptr { begin }; ptr != end; ++ptr) {
         std::bitset<8> x(*ptr);
@@ -16,6 +40,50 @@ void printByteArray(char *begin, const char *end) {
 }
 
 
+// Emulate the readings path: the server builds a ServerReadings message, the connection copies the received body
+// into a message handed to the client, which decodes the sample
+template<typename Message>
+void benchmarkReadingsPath(const char *name) {
+    constexpr size_t nMessages = 1'000'000;
+    constexpr size_t nChannels = 8;
+
+    Message received;
+    std::array<uint16_t, nChannels> readings{};
+    uint64_t checksum = 0;
+
+    size_t allocationsBefore = nAllocations;
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < nMessages; ++i) {
+        Message msg;
+        msg.header.id = ServerReadings;
+        for (size_t ch = 0; ch < nChannels; ++ch)
+            msg << static_cast<uint16_t>(i + ch);
+        msg << static_cast<uint32_t>(i);
+
+        // Read the body into the connection temporary message
+        received.header = msg.header;
+        received.body.resize(msg.header.size);
+        std::memcpy(received.body.data(), msg.body.data(), msg.size());
+
+        // The client gets its own copy
+        Message owned = received;
+
+        uint32_t time;
+        message_reader reader{ owned };
+        for (auto &reading: readings)
+            reader >> reading;
+        reader >> time;
+        checksum += time + readings[0];
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    size_t allocations = nAllocations - allocationsBefore;
+
+    std::cout << std::dec << name << ": " << static_cast<double>(allocations) / nMessages << " allocations/message, "
+              << elapsed.count() / nMessages << " ns/message (checksum " << checksum << ")\n";
+}
+
 int main() {
     float pi = 3.14;
 
@@ -50,7 +118,7 @@ int main() {
 
     // Decode message
     float decodePi;
-    msg >> decodePi;
+    message_reader(msg) >> decodePi;
 
     std::cout << "Decoded pi: " << decodePi << '\n';
 
@@ -62,7 +130,20 @@ int main() {
     std::cout << "Hex message: ";
         for (auto& el : dataBody)
             std::cout << std::setfill('0') << std::setw(2) << std::hex << (0xff & (unsigned int)el) << ' ';
-
+    std::cout << "\n\n";
+
+    benchmarkReadingsPath<message<MsgTypes, std::vector<uint8_t>>>("Heap body");
+    benchmarkReadingsPath<message<MsgTypes>>("Inline body");
+
+    // The vector kernels must give the same currents as the scalar one
+    const auto samples = makeIntegratorSamples(4096);
+    for (auto kernel: fortress::availableCurrentKernels()) {
+        const bool bMatches = matchesScalar(kernel, samples);
+        std::cout << "Current kernel " << fortress::toString(kernel) << (bMatches ? ": matches" : ": DIFFERS FROM")
+                  << " scalar\n";
+        if (!bMatches)
+            return 1;
+    }
 
     return 0;
 }
\ No newline at end of file
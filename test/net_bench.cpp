@@ -0,0 +1,277 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+// End-to-end loopback benchmark of the networking stack: an in-process server_interface broadcasts readings frames
+// to N client_interface instances. For every combination of client count, message size and send rate it reports
+// the messages and megabytes delivered per second, the CPU time of the process and the one-way latency
+// percentiles, as JSON on the standard output. The logs of the stack go to the standard error.
+//
+// Sizes are in samples per message: 1 sends ServerReadings, more send ServerReadingsBatch. A rate of 0 sends as
+// fast as the clients receive. The connections block the sender when their queue is full, so nothing is dropped
+// and the latency includes the time spent queued.
+//
+// Usage: net_bench -clients 1,4,16 -sizes 1,8,64 -rates 1000,10000,0 -duration_ms 1000 > results.json
+
+#include "networking/server_interface.h"
+#include "networking/client_interface.h"
+#include "argparse.h"
+#include <chrono>
+#include <thread>
+#include <sys/resource.h>
+
+using namespace fortress::net;
+using namespace std::chrono_literals;
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr auto CONNECT_TIMEOUT = 5s;
+constexpr auto DRAIN_TIMEOUT = 10s;
+
+struct bench_point {
+    size_t nClients;
+    uint16_t nSamples;
+    uint32_t rate;
+};
+
+struct bench_result {
+    bench_point point;
+    size_t frameSize;
+    uint64_t nSent;
+    uint64_t nReceived;
+    double seconds;
+    double cpuSeconds;
+    latency_histogram::summary latency;
+};
+
+// User and system time of the whole process, server and clients
+double cpuSeconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+           static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+class bench_server : public server_interface {
+public:
+    bench_server(asio::io_context &context, uint16_t port) : server_interface(context, port) {}
+
+protected:
+    bool onClientConnect(std::shared_ptr<tcp_connection> client) override {
+        client->setOverflowPolicy(tcp_connection::overflow_policy::block);
+        return true;
+    }
+
+    void onClientDisconnect(std::shared_ptr<tcp_connection>) override {}
+
+    void onMessage(std::shared_ptr<tcp_connection>, message<MsgTypes> &) override {}
+};
+
+// The timestamp of the first sample of each frame is the time it was sent, in microseconds since epoch: server and
+// clients share the clock, so the difference with the time it is received is the one-way latency
+class bench_client : public client_interface {
+private:
+    bench_clock::time_point m_epoch;
+    latency_histogram &m_latency;
+    std::atomic<uint64_t> m_nReceived{ 0 };
+
+public:
+    bench_client(asio::io_context &context, bench_clock::time_point epoch, latency_histogram &latency) :
+            client_interface{ context }, m_epoch{ epoch }, m_latency{ latency } {}
+
+    void onServerDisconnected() override {}
+
+    [[nodiscard]] uint64_t getReceivedCount() const {
+        return m_nReceived;
+    }
+
+protected:
+    void onMessage(message<MsgTypes> &msg) override {
+        if (msg.header.id != ServerReadings && msg.header.id != ServerReadingsBatch)
+            return;
+
+        uint32_t timestamp;
+        std::memcpy(&timestamp, msg.body.data() + offsetof(readings_sample, timestamp), sizeof(timestamp));
+        m_latency.record(bench_clock::now() - (m_epoch + std::chrono::microseconds(timestamp)));
+        ++m_nReceived;
+    }
+};
+
+message<MsgTypes> makeFrame(uint16_t nSamples, uint32_t timestamp) {
+    readings_sample sample{ {}, timestamp };
+    if (nSamples == 1)
+        return makeMessage<ServerReadings>(sample);
+
+    message<MsgTypes> msg;
+    msg.header.id = ServerReadingsBatch;
+    for (uint16_t i = 0; i < nSamples; ++i)
+        appendPayload<ServerReadingsBatch>(msg, sample);
+    return msg;
+}
+
+bench_result run(const bench_point &point, uint16_t port, unsigned nServerThreads, unsigned nClientThreads,
+                 bench_clock::duration duration) {
+    bench_result result{ point, encodeFrame(makeFrame(point.nSamples, 0))->size(), 0, 0, 0, 0, {}};
+    latency_histogram latency;
+
+    asio::io_context serverContext;
+    asio::io_context clientContext;
+    auto clientWork = asio::make_work_guard(clientContext);
+    std::vector<std::thread> clientThreads;
+
+    bench_server server{ serverContext, port };
+    server.start();
+    server.run(nServerThreads);
+
+    const auto epoch = bench_clock::now();
+    std::vector<std::unique_ptr<bench_client>> clients;
+    for (size_t i = 0; i < point.nClients; ++i) {
+        clients.push_back(std::make_unique<bench_client>(clientContext, epoch, latency));
+        clients.back()->connect("127.0.0.1", port);
+    }
+    for (unsigned i = 0; i < nClientThreads; ++i)
+        clientThreads.emplace_back([&clientContext]() { clientContext.run(); });
+
+    auto allConnected = [&]() {
+        return server.getClientsCount() == point.nClients &&
+               std::all_of(clients.begin(), clients.end(), [](auto &client) { return client->isConnected(); });
+    };
+    auto nReceived = [&]() {
+        uint64_t n = 0;
+        for (auto &client: clients)
+            n += client->getReceivedCount();
+        return n;
+    };
+
+    const auto connectDeadline = bench_clock::now() + CONNECT_TIMEOUT;
+    while (!allConnected() && bench_clock::now() < connectDeadline)
+        std::this_thread::sleep_for(1ms);
+
+    if (allConnected()) {
+        const double cpuStart = cpuSeconds();
+        const auto start = bench_clock::now();
+        const auto end = start + duration;
+        const auto interval = point.rate > 0 ? std::chrono::nanoseconds(1s) / point.rate : std::chrono::nanoseconds(0);
+
+        // Each frame is encoded once and shared by all the clients, as FRServer does
+        for (auto due = start; due < end; due += interval) {
+            if (interval.count() > 0)
+                std::this_thread::sleep_until(due);
+            const auto now = bench_clock::now();
+            if (now >= end)
+                break;
+
+            auto timestamp = std::chrono::duration_cast<std::chrono::microseconds>(now - epoch).count();
+            server.sendMessageToAllClients(encodeFrame(makeFrame(point.nSamples, static_cast<uint32_t>(timestamp))));
+            ++result.nSent;
+        }
+
+        const uint64_t nExpected = result.nSent * point.nClients;
+        const auto drainDeadline = bench_clock::now() + DRAIN_TIMEOUT;
+        while (nReceived() < nExpected && bench_clock::now() < drainDeadline)
+            std::this_thread::sleep_for(100us);
+
+        result.seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+        result.cpuSeconds = cpuSeconds() - cpuStart;
+    } else {
+        std::cerr << "Only " << server.getClientsCount() << " of " << point.nClients << " clients connected\n";
+    }
+
+    result.nReceived = nReceived();
+    result.latency = latency.getSummary();
+
+    for (auto &client: clients)
+        if (client->isConnected())
+            client->disconnect();
+
+    clientWork.reset();
+    clientContext.stop();
+    for (auto &thread: clientThreads)
+        thread.join();
+
+    serverContext.stop();
+    server.join();
+    return result;
+}
+
+std::vector<uint32_t> parseList(const std::string &list) {
+    std::vector<uint32_t> values;
+    std::stringstream in(list);
+    std::string value;
+    while (std::getline(in, value, ','))
+        if (!value.empty())
+            values.push_back(static_cast<uint32_t>(std::stoul(value)));
+    return values;
+}
+
+void writeJson(std::ostream &out, const std::vector<bench_result> &results, unsigned nServerThreads,
+               unsigned nClientThreads, bench_clock::duration duration) {
+    auto micros = [](latency_histogram::duration value) { return value.count(); };
+
+    out << "{\n"
+        << "  \"backend\": \"" << ioBackendReport() << "\",\n"
+        << "  \"server_threads\": " << nServerThreads << ",\n"
+        << "  \"client_threads\": " << nClientThreads << ",\n"
+        << "  \"duration_ms\": " << std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() << ",\n"
+        << "  \"results\": [";
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto &r = results[i];
+        const double seconds = r.seconds > 0 ? r.seconds : 1;
+        const double messagesPerSecond = static_cast<double>(r.nReceived) / seconds;
+
+        out << (i == 0 ? "\n" : ",\n")
+            << "    {\"clients\": " << r.point.nClients
+            << ", \"samples_per_message\": " << r.point.nSamples
+            << ", \"message_bytes\": " << r.frameSize
+            << ", \"target_rate\": " << r.point.rate
+            << ", \"messages_sent\": " << r.nSent
+            << ", \"messages_received\": " << r.nReceived
+            << ", \"seconds\": " << r.seconds
+            << ", \"messages_per_second\": " << messagesPerSecond
+            << ", \"megabytes_per_second\": " << messagesPerSecond * static_cast<double>(r.frameSize) / 1e6
+            << ", \"cpu_seconds\": " << r.cpuSeconds
+            << ", \"cpu_ns_per_message\": " << (r.nReceived > 0 ? r.cpuSeconds * 1e9 / static_cast<double>(r.nReceived) : 0)
+            << ", \"latency_us\": {\"p50\": " << micros(r.latency.p50) << ", \"p90\": " << micros(r.latency.p90)
+            << ", \"p99\": " << micros(r.latency.p99) << ", \"max\": " << micros(r.latency.max) << "}}";
+    }
+
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, char *argv[]) {
+    ArgumentParser parser(argc, argv);
+    parser.addArgument<int>("port", 60100);
+    parser.addArgument<std::string>("clients", "1,4,16");       // Client counts
+    parser.addArgument<std::string>("sizes", "1,8,64");         // Samples per message
+    parser.addArgument<std::string>("rates", "1000,10000,0");   // Messages per second, 0 as fast as possible
+    parser.addArgument<int>("duration_ms", 1000);               // Sending time of each combination
+    parser.addArgument<int>("threads", 2);                      // Threads running the server context
+    parser.addArgument<int>("client_threads", 2);               // Threads running the clients context
+    parser.parseArguments();
+
+    const auto port = static_cast<uint16_t>(parser.getValue<int>("port"));
+    const auto duration = std::chrono::milliseconds(std::max(parser.getValue<int>("duration_ms"), 1));
+    const auto nServerThreads = static_cast<unsigned>(std::max(parser.getValue<int>("threads"), 1));
+    const auto nClientThreads = static_cast<unsigned>(std::max(parser.getValue<int>("client_threads"), 1));
+
+    // Keep the standard output for the results
+    std::streambuf *stdoutBuffer = std::cout.rdbuf(std::cerr.rdbuf());
+
+    std::vector<bench_result> results;
+    for (auto nClients: parseList(parser.getValue<std::string>("clients")))
+        for (auto nSamples: parseList(parser.getValue<std::string>("sizes")))
+            for (auto rate: parseList(parser.getValue<std::string>("rates"))) {
+                bench_point point{ std::max<size_t>(nClients, 1),
+                                   static_cast<uint16_t>(std::clamp<uint32_t>(nSamples, 1, MAX_SAMPLES_PER_BATCH)),
+                                   rate };
+                results.push_back(run(point, port, nServerThreads, nClientThreads, duration));
+            }
+
+    std::cout.rdbuf(stdoutBuffer);
+    writeJson(std::cout, results, nServerThreads, nClientThreads, duration);
+    return 0;
+}
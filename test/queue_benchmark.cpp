@@ -0,0 +1,94 @@
+//
+// Created by Jacopo Gasparetto on 18/10/26.
+//
+// SPDX-FileCopyrightText: 2021 INFN
+// SPDX-License-Identifier: EUPL-1.2
+// SPDX-FileContributor: Jacopo Gasparetto
+//
+// Contention benchmark of the outbound queues: one thread pushes readings messages while another pops them.
+
+#include "networking/threadsafe_queue.h"
+#include "networking/spsc_queue.h"
+#include <thread>
+#include <chrono>
+
+using namespace fortress::net;
+
+constexpr size_t N_MESSAGES = 2'000'000;
+constexpr size_t CAPACITY = 1024;
+
+message<MsgTypes> makeReadingsMessage(size_t i) {
+    message<MsgTypes> msg;
+    msg.header.id = ServerReadings;
+    for (uint16_t ch = 0; ch < fortress::consts::N_CHANNELS; ++ch)
+        msg << static_cast<uint16_t>(i + ch);
+    msg << static_cast<uint32_t>(i);
+    return msg;
+}
+
+template<typename Producer, typename Consumer>
+void run(const char *name, Producer producer, Consumer consumer) {
+    uint64_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    std::thread consumerThread([&]() {
+        message<MsgTypes> msg;
+        for (size_t i = 0; i < N_MESSAGES; ++i) {
+            consumer(msg);
+            checksum += msg.header.size;
+        }
+    });
+
+    for (size_t i = 0; i < N_MESSAGES; ++i)
+        producer(makeReadingsMessage(i));
+
+    consumerThread.join();
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << std::left << std::setw(28) << name
+              << std::setw(10) << elapsed.count() / N_MESSAGES << " ns/message "
+              << std::setw(10) << N_MESSAGES / elapsed.count() * 1e3 << " M messages/s "
+              << "(checksum " << checksum << ")\n";
+}
+
+int main() {
+    std::cout << "Transferring " << N_MESSAGES << " messages between two threads\n";
+
+    {
+        // Bounded as the SPSC ring, the consumer polls empty() and pops as tcp_connection used to do
+        ts_queue<message<MsgTypes>> queue;
+        run("ts_queue (polling)",
+            [&](message<MsgTypes> &&msg) {
+                while (queue.count() >= CAPACITY)
+                    std::this_thread::yield();
+                queue.push_back(msg);
+            },
+            [&](message<MsgTypes> &msg) {
+                while (queue.empty())
+                    std::this_thread::yield();
+                msg = queue.pop_front();
+            });
+    }
+
+    {
+        spsc_queue<message<MsgTypes>> queue{ CAPACITY };
+        run("spsc_queue (polling)",
+            [&](message<MsgTypes> &&msg) {
+                while (!queue.try_push(std::move(msg)))
+                    std::this_thread::yield();
+            },
+            [&](message<MsgTypes> &msg) {
+                while (!queue.try_pop(msg))
+                    std::this_thread::yield();
+            });
+    }
+
+    {
+        spsc_queue<message<MsgTypes>> queue{ CAPACITY };
+        run("spsc_queue (blocking wait)",
+            [&](message<MsgTypes> &&msg) { queue.wait_push(std::move(msg)); },
+            [&](message<MsgTypes> &msg) { queue.wait_pop(msg); });
+    }
+
+    return 0;
+}